@@ -0,0 +1,288 @@
+/*
+ * libut - Userspace Tracing Toolkit
+ *
+ * Copyright (C) 2018 Robert Bragg
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Microbenchmarks for libut's hot paths, run on 1 or more threads
+ * concurrently, reporting the average cost of an event per thread in
+ * nanoseconds and (if perf events are available) retired user-space
+ * instructions:
+ *
+ *   push-pop:     ut_push_task() + ut_pop_task() for a registered task,
+ *                 in the steady state with a default sized ring that's
+ *                 already been filled once (2 events per iteration)
+ *   registration: the first push + pop of a new task description on a
+ *                 thread, which has to register and share it (1 event per
+ *                 iteration)
+ *   backtrace:    push + pop, emitting a backtrace sample at each pop (2
+ *                 events per iteration)
+ *   wrap:         push + pop with a ring that's small enough to stay in
+ *                 the cache, and wraps every few hundred samples (2 events
+ *                 per iteration)
+ *
+ * Results are printed as a single line of key=value pairs, for example:
+ *
+ *   hot-path: bench=push-pop threads=1 server=no iterations=100000 \
+ *             ns_per_event=40.12 instructions_per_event=180.50
+ *
+ * The server label is only for the output, since whether we're connected
+ * depends on whether ut-server is running (see run-benchmarks.sh).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "ut.h"
+
+#define MAX_REGISTRATIONS 50000 /* task indices are 16bit */
+
+/* Enough to fill a default sized ring, so its pages are faulted in */
+#define N_WARMUP_ITERATIONS 20000
+
+enum bench {
+    BENCH_PUSH_POP,
+    BENCH_REGISTRATION,
+    BENCH_BACKTRACE,
+    BENCH_WRAP,
+};
+
+static const struct {
+    const char *name;
+    uint64_t n_iterations;
+    int events_per_iteration;
+
+    /* libut configuration for the benchmark, which must be set before
+     * the first tracepoint
+     */
+    const char *buffer_size;
+    const char *backtrace_frames;
+} benches[] = {
+    [BENCH_PUSH_POP] =     { "push-pop", 1000000, 2, NULL, NULL },
+    [BENCH_REGISTRATION] = { "registration", MAX_REGISTRATIONS, 1, NULL, NULL },
+    [BENCH_BACKTRACE] =    { "backtrace", 100000, 2, NULL, "10" },
+    [BENCH_WRAP] =         { "wrap", 1000000, 2, "64K", NULL },
+};
+
+struct thread_result {
+    uint64_t elapsed_ns;
+    uint64_t n_instructions;
+    bool have_instructions;
+};
+
+static enum bench bench;
+static uint64_t n_iterations;
+static pthread_barrier_t start_barrier;
+
+static struct ut_task_desc warmup_task = { .name = "warmup" };
+static struct ut_task_desc bench_task = { .name = "bench" };
+
+static uint64_t
+read_monotonic_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Counts user-space instructions retired by the calling thread */
+static int
+open_instruction_counter(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static struct ut_task_desc *
+create_task_descs(int n)
+{
+    struct ut_task_desc *descs = calloc(n, sizeof(*descs));
+
+    for (int i = 0; i < n; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "bench-%d", i);
+        descs[i].name = strdup(name);
+    }
+
+    return descs;
+}
+
+static void
+run_bench(struct ut_task_desc *descs)
+{
+    switch (bench) {
+    case BENCH_PUSH_POP:
+    case BENCH_BACKTRACE:
+    case BENCH_WRAP:
+        for (uint64_t i = 0; i < n_iterations; i++) {
+            ut_push_task(&bench_task);
+            ut_pop_task(&bench_task);
+        }
+        break;
+    case BENCH_REGISTRATION:
+        for (uint64_t i = 0; i < n_iterations; i++) {
+            ut_push_task(&descs[i]);
+            ut_pop_task(&descs[i]);
+        }
+        break;
+    }
+}
+
+static void *
+bench_thread(void *data)
+{
+    struct thread_result *result = data;
+    struct ut_task_desc *descs = NULL;
+    int counter_fd = open_instruction_counter();
+    uint64_t start;
+
+    if (bench == BENCH_REGISTRATION)
+        descs = create_task_descs(n_iterations);
+
+    /* Make sure the thread's buffers are allocated and faulted in (and
+     * the task we benchmark is registered) before we start timing
+     */
+    for (int i = 0; i < N_WARMUP_ITERATIONS; i++) {
+        ut_push_task(&warmup_task);
+        ut_pop_task(&warmup_task);
+    }
+    ut_push_task(&bench_task);
+    ut_pop_task(&bench_task);
+
+    pthread_barrier_wait(&start_barrier);
+
+    if (counter_fd >= 0)
+        ioctl(counter_fd, PERF_EVENT_IOC_ENABLE, 0);
+    start = read_monotonic_clock();
+
+    run_bench(descs);
+
+    result->elapsed_ns = read_monotonic_clock() - start;
+    if (counter_fd >= 0) {
+        ioctl(counter_fd, PERF_EVENT_IOC_DISABLE, 0);
+        result->have_instructions =
+            read(counter_fd, &result->n_instructions,
+                 sizeof(result->n_instructions)) ==
+            sizeof(result->n_instructions);
+        close(counter_fd);
+    }
+
+    return NULL;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: bench-hot-path BENCH [N_THREADS] [SERVER_LABEL]\n"
+            "\n"
+            "  BENCH is one of push-pop, registration, backtrace or wrap\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int n_threads = argc > 2 ? atoi(argv[2]) : 1;
+    const char *server_label = argc > 3 ? argv[3] : "unknown";
+    pthread_t *threads;
+    struct thread_result *results;
+    double total_ns = 0, total_instructions = 0;
+    bool have_instructions = true;
+    uint64_t n_events;
+    int i;
+
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    for (i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++) {
+        if (strcmp(argv[1], benches[i].name) == 0)
+            break;
+    }
+    if (i == (int)(sizeof(benches) / sizeof(benches[0])) || n_threads < 1) {
+        usage();
+        return 1;
+    }
+    bench = i;
+
+    n_iterations = benches[bench].n_iterations;
+    if (bench == BENCH_REGISTRATION)
+        n_iterations /= n_threads;
+    n_events = n_iterations * benches[bench].events_per_iteration;
+
+    setenv("UT_ENABLE", "1", 1);
+    if (benches[bench].buffer_size)
+        setenv("UT_BUFFER_SIZE", benches[bench].buffer_size, 1);
+    if (benches[bench].backtrace_frames)
+        setenv("UT_BACKTRACE_FRAMES", benches[bench].backtrace_frames, 1);
+
+    threads = calloc(n_threads, sizeof(*threads));
+    results = calloc(n_threads, sizeof(*results));
+
+    pthread_barrier_init(&start_barrier, NULL, n_threads);
+
+    for (i = 0; i < n_threads; i++)
+        pthread_create(&threads[i], NULL, bench_thread, &results[i]);
+
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+
+        total_ns += results[i].elapsed_ns;
+        total_instructions += results[i].n_instructions;
+        if (!results[i].have_instructions)
+            have_instructions = false;
+    }
+
+    printf("hot-path: bench=%s threads=%d server=%s iterations=%llu "
+           "ns_per_event=%.2f",
+           benches[bench].name,
+           n_threads,
+           server_label,
+           (unsigned long long)n_iterations,
+           total_ns / n_threads / n_events);
+    if (have_instructions)
+        printf(" instructions_per_event=%.2f\n",
+               total_instructions / n_threads / n_events);
+    else
+        printf(" instructions_per_event=n/a\n");
+
+    return 0;
+}
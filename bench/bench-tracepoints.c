@@ -0,0 +1,75 @@
+/*
+ * libut - Userspace Tracing Toolkit
+ *
+ * Copyright (C) 2018 Robert Bragg
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Measures the cost of a UT_PUSH_TASK/UT_POP_TASK pair around a trivial
+ * workload, to compare builds with tracepoints compiled out
+ * (-DUT_TRACE_LEVEL=0) against tracepoints that are disabled (UT_ENABLE=0)
+ * or enabled (UT_ENABLE=1) at runtime.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ut.h"
+
+static struct ut_task_desc bench_task = { .name = "bench" };
+
+static uint64_t
+read_monotonic_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void __attribute__((noinline))
+workload(volatile uint64_t *counter)
+{
+    (*counter)++;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *variant = argc > 1 ? argv[1] : "default";
+    uint64_t n_iterations = argc > 2 ? strtoull(argv[2], NULL, 10) : 10000000;
+    volatile uint64_t counter = 0;
+    uint64_t start, end;
+
+    start = read_monotonic_clock();
+    for (uint64_t i = 0; i < n_iterations; i++) {
+        UT_PUSH_TASK(UT_LEVEL_NORMAL, &bench_task);
+        workload(&counter);
+        UT_POP_TASK(UT_LEVEL_NORMAL, &bench_task);
+    }
+    end = read_monotonic_clock();
+
+    printf("tracepoints: variant=%s iterations=%llu ns_per_iteration=%.2f\n",
+           variant,
+           (unsigned long long)n_iterations,
+           (double)(end - start) / n_iterations);
+
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * libut - Userspace Tracing Toolkit
+ *
+ * Copyright (C) 2018 Robert Bragg
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Measures the per-call overhead of the libut-sysapiwrappers.so
+ * interposers, which should be preloaded, e.g.
+ *
+ *   LD_PRELOAD=./libut-sysapiwrappers.so LD_LIBRARY_PATH=. \
+ *       ./bench/bench-wrappers no
+ *
+ * For each API we time a tight loop of calls through the wrapper and a
+ * loop of calls to the libc function directly (looked up via dlopen() so
+ * it bypasses the interposer) as the untraced baseline. Results are
+ * printed as one line of key=value pairs per API, for example:
+ *
+ *   wrappers: api=read server=no preloaded=yes baseline_ns=95.10 \
+ *             wrapped_ns=260.52 overhead_ns=165.42
+ *
+ * Where an API is benchmarked as a pair of calls (e.g. lock + unlock) the
+ * times are per call.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#define N_ITERATIONS 200000
+
+static struct {
+    ssize_t (*read)(int fd, void *buf, size_t count);
+    ssize_t (*write)(int fd, const void *buf, size_t count);
+    int (*ioctl)(int fd, unsigned long request, ...);
+    ssize_t (*send)(int fd, const void *buf, size_t len, int flags);
+    ssize_t (*recv)(int fd, void *buf, size_t len, int flags);
+    int (*pthread_mutex_lock)(pthread_mutex_t *mutex);
+    int (*pthread_mutex_unlock)(pthread_mutex_t *mutex);
+    int (*pthread_cond_signal)(pthread_cond_t *cond);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+} libc;
+
+static int zero_fd;
+static int null_fd;
+static int sockets[2];
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t
+read_monotonic_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bench_read(bool wrapped)
+{
+    char buf[1];
+
+    if (wrapped)
+        read(zero_fd, buf, sizeof(buf));
+    else
+        libc.read(zero_fd, buf, sizeof(buf));
+}
+
+static void
+bench_write(bool wrapped)
+{
+    char buf[1] = { 0 };
+
+    if (wrapped)
+        write(null_fd, buf, sizeof(buf));
+    else
+        libc.write(null_fd, buf, sizeof(buf));
+}
+
+static void
+bench_ioctl(bool wrapped)
+{
+    int n_bytes;
+
+    if (wrapped)
+        ioctl(sockets[0], FIONREAD, &n_bytes);
+    else
+        libc.ioctl(sockets[0], FIONREAD, &n_bytes);
+}
+
+static void
+bench_send_recv(bool wrapped)
+{
+    char buf[1] = { 0 };
+
+    if (wrapped) {
+        send(sockets[0], buf, sizeof(buf), 0);
+        recv(sockets[1], buf, sizeof(buf), 0);
+    } else {
+        libc.send(sockets[0], buf, sizeof(buf), 0);
+        libc.recv(sockets[1], buf, sizeof(buf), 0);
+    }
+}
+
+static void
+bench_mutex_lock_unlock(bool wrapped)
+{
+    if (wrapped) {
+        pthread_mutex_lock(&mutex);
+        pthread_mutex_unlock(&mutex);
+    } else {
+        libc.pthread_mutex_lock(&mutex);
+        libc.pthread_mutex_unlock(&mutex);
+    }
+}
+
+static void
+bench_cond_signal(bool wrapped)
+{
+    if (wrapped)
+        pthread_cond_signal(&cond);
+    else
+        libc.pthread_cond_signal(&cond);
+}
+
+static void
+bench_malloc_free(bool wrapped)
+{
+    /* Note: volatile so the compiler can't elide the pair of calls */
+    void * volatile ptr;
+
+    if (wrapped) {
+        ptr = malloc(64);
+        free(ptr);
+    } else {
+        ptr = libc.malloc(64);
+        libc.free(ptr);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*func)(bool wrapped);
+    int calls_per_iteration;
+} benches[] = {
+    { "read", bench_read, 1 },
+    { "write", bench_write, 1 },
+    { "ioctl", bench_ioctl, 1 },
+    { "send+recv", bench_send_recv, 2 },
+    { "pthread_mutex_lock+unlock", bench_mutex_lock_unlock, 2 },
+    { "pthread_cond_signal", bench_cond_signal, 1 },
+    { "malloc+free", bench_malloc_free, 2 },
+};
+
+static double
+time_calls(void (*func)(bool wrapped), bool wrapped, int calls_per_iteration)
+{
+    uint64_t start;
+
+    /* warm up, e.g. so the wrapper has resolved the real function */
+    for (int i = 0; i < 1000; i++)
+        func(wrapped);
+
+    start = read_monotonic_clock();
+    for (int i = 0; i < N_ITERATIONS; i++)
+        func(wrapped);
+
+    return ((double)(read_monotonic_clock() - start) /
+            N_ITERATIONS / calls_per_iteration);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *server_label = argc > 1 ? argv[1] : "unknown";
+    void *libc_handle = dlopen("libc.so.6", RTLD_NOW | RTLD_NOLOAD);
+    bool preloaded;
+
+    if (!libc_handle) {
+        fprintf(stderr, "Failed to find libc: %s\n", dlerror());
+        return 1;
+    }
+
+    libc.read = dlsym(libc_handle, "read");
+    libc.write = dlsym(libc_handle, "write");
+    libc.ioctl = dlsym(libc_handle, "ioctl");
+    libc.send = dlsym(libc_handle, "send");
+    libc.recv = dlsym(libc_handle, "recv");
+    libc.pthread_mutex_lock = dlsym(libc_handle, "pthread_mutex_lock");
+    libc.pthread_mutex_unlock = dlsym(libc_handle, "pthread_mutex_unlock");
+    libc.pthread_cond_signal = dlsym(libc_handle, "pthread_cond_signal");
+    libc.malloc = dlsym(libc_handle, "malloc");
+    libc.free = dlsym(libc_handle, "free");
+
+    preloaded = (void *)libc.read != (void *)read;
+    if (!preloaded)
+        fprintf(stderr, "libut-sysapiwrappers.so isn't preloaded\n");
+
+    zero_fd = open("/dev/zero", O_RDONLY);
+    null_fd = open("/dev/null", O_WRONLY);
+    if (zero_fd < 0 || null_fd < 0 ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        perror("Failed to open files for benchmarking");
+        return 1;
+    }
+
+    for (int i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++) {
+        double baseline = time_calls(benches[i].func, false,
+                                     benches[i].calls_per_iteration);
+        double wrapped = time_calls(benches[i].func, true,
+                                    benches[i].calls_per_iteration);
+
+        printf("wrappers: api=%s server=%s preloaded=%s baseline_ns=%.2f "
+               "wrapped_ns=%.2f overhead_ns=%.2f\n",
+               benches[i].name,
+               server_label,
+               preloaded ? "yes" : "no",
+               baseline,
+               wrapped,
+               wrapped - baseline);
+    }
+
+    return 0;
+}
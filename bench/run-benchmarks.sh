@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Runs the hot path microbenchmarks with 1, 2, 4... up to BENCH_MAX_THREADS
+# threads (default: the number of CPUs) and the system api wrapper
+# benchmarks, first without a server and then with ut-server running, if it
+# has been built (or UT_SERVER is set).
+#
+# Each run prints lines of key=value results (see bench-hot-path.c and
+# bench-wrappers.c), so the output of `make -s bench` can be saved and
+# compared between builds.
+
+cd "$(dirname "$0")/.."
+
+max_threads=${BENCH_MAX_THREADS:-$(nproc)}
+server=${UT_SERVER:-./ut-server}
+
+run_benchmarks()
+{
+    for bench in push-pop registration backtrace wrap; do
+        threads=1
+        while true; do
+            ./bench/bench-hot-path $bench $threads $1 2>/dev/null
+            [ $threads -ge $max_threads ] && break
+            threads=$((threads * 2))
+            [ $threads -gt $max_threads ] && threads=$max_threads
+        done
+    done
+
+    LD_PRELOAD=./libut-sysapiwrappers.so LD_LIBRARY_PATH=. \
+        ./bench/bench-wrappers $1 2>/dev/null
+}
+
+if grep -q "@ut-conductor" /proc/net/unix 2>/dev/null; then
+    echo "A ut-server is already running, so can't benchmark without one" >&2
+    exit 1
+fi
+
+run_benchmarks no
+
+if [ ! -x "$server" ]; then
+    echo "Skipping benchmarks with a server, since $server isn't built" >&2
+    exit 0
+fi
+
+"$server" >/dev/null 2>&1 &
+server_pid=$!
+
+# Wait for the server to start listening
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    grep -q "@ut-conductor" /proc/net/unix && break
+    sleep 0.1
+done
+
+run_benchmarks yes
+
+kill $server_pid
+wait $server_pid 2>/dev/null
+exit 0
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Measures how long ut-server takes to capture data from a synthetic client
+# (see ut-synthetic-client.c) across different numbers of client threads
+# and ring sizes, using ut-server --bench.
+#
+# Each capture prints one line of key=value results, e.g.
+#
+#   capture: ring_size=8M clients=4 stop_ms=0.210 decode_ms=120.512 \
+#            encode_ms=80.003 write_ms=3.120 total_ms=203.845 \
+#            output_bytes=41234567
+#
+# BENCH_CLIENTS and BENCH_RING_SIZES can be set to override the defaults.
+
+cd "$(dirname "$0")/.."
+
+server=${UT_SERVER:-./ut-server}
+client_counts=${BENCH_CLIENTS:-"1 4 16"}
+ring_sizes=${BENCH_RING_SIZES:-"1M 8M"}
+tmp=$(mktemp -d)
+
+if [ ! -x "$server" ]; then
+    echo "Can't run capture benchmarks since $server isn't built" >&2
+    exit 1
+fi
+
+if grep -q "@ut-conductor" /proc/net/unix 2>/dev/null; then
+    echo "A ut-server is already running" >&2
+    exit 1
+fi
+
+wait_for()
+{
+    for i in $(seq 100); do
+        eval "$1" && return 0
+        sleep 0.1
+    done
+    echo "Timed out waiting for: $1" >&2
+    return 1
+}
+
+# Enough events to fill and wrap the rings
+events_for_ring_size()
+{
+    case $1 in
+    *K|*k) echo $((${1%?} * 1024 / 96 * 2));;
+    *M|*m) echo $((${1%?} * 1024 * 1024 / 96 * 2));;
+    *) echo $(($1 / 96 * 2));;
+    esac
+}
+
+for size in $ring_sizes; do
+    for clients in $client_counts; do
+        "$server" --bench > /dev/null 2> $tmp/server.log &
+        server_pid=$!
+        wait_for 'grep -q "@ut-conductor" /proc/net/unix' || break
+
+        UT_BUFFER_SIZE=$size ./bench/ut-synthetic-client \
+            --threads=$clients --events=$(events_for_ring_size $size) \
+            > $tmp/client.log 2>/dev/null &
+        client_pid=$!
+        wait_for "grep -q ready $tmp/client.log"
+
+        kill -INT $server_pid
+        wait $server_pid
+        kill $client_pid
+        wait $client_pid 2>/dev/null
+
+        sed -n "s/^capture: /capture: ring_size=$size /p" $tmp/server.log
+    done
+done
+
+rm -rf $tmp
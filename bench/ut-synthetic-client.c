@@ -0,0 +1,214 @@
+/*
+ * libut - Userspace Tracing Toolkit
+ *
+ * Copyright (C) 2018 Robert Bragg
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* A synthetic libut client for benchmarking ut-server, which fills the
+ * rings of N threads with nested push/pop streams over M task
+ * descriptions, then prints "ready" and waits to be captured.
+ *
+ * Each thread does a reproducible random walk over the task stack, up to
+ * a maximum depth, choosing tasks with a skewed distribution so that a few
+ * tasks are much more common than the rest, as in real applications.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ut.h"
+
+static int n_threads = 1;
+static int n_tasks = 32;
+static int max_depth = 8;
+static uint64_t n_events = 100000; /* per thread */
+static uint64_t rate; /* events per second per thread, or 0 for unlimited */
+
+static struct ut_task_desc *task_descs;
+static pthread_barrier_t done_barrier;
+
+#define RATE_BATCH 1000
+
+static uint64_t
+xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+static uint64_t
+read_monotonic_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sleep_until(uint64_t timestamp)
+{
+    struct timespec ts = {
+        .tv_sec = timestamp / 1000000000ULL,
+        .tv_nsec = timestamp % 1000000000ULL,
+    };
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void *
+client_thread(void *data)
+{
+    uint64_t rng = (uintptr_t)data + 1;
+    struct ut_task_desc *stack[max_depth];
+    uint64_t start = read_monotonic_clock();
+    int depth = 0;
+
+    for (uint64_t i = 0; i < n_events; i++) {
+        bool push = (depth == 0 ||
+                     (depth < max_depth && xorshift64(&rng) % 2));
+
+        if (push) {
+            /* Skewed towards low task indices */
+            int range = 1 + xorshift64(&rng) % n_tasks;
+            struct ut_task_desc *task = &task_descs[xorshift64(&rng) % range];
+
+            ut_push_task(task);
+            stack[depth++] = task;
+        } else
+            ut_pop_task(stack[--depth]);
+
+        if (rate && i % RATE_BATCH == RATE_BATCH - 1)
+            sleep_until(start + (i + 1) * 1000000000ULL / rate);
+    }
+
+    while (depth)
+        ut_pop_task(stack[--depth]);
+
+    pthread_barrier_wait(&done_barrier);
+
+    /* Stay alive until we've been captured */
+    while (true)
+        pause();
+
+    return NULL;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: ut-synthetic-client [options]\n"
+            "\n"
+            "  -t, --threads=N      Number of threads (default 1)\n"
+            "  -m, --tasks=M        Number of task descriptions (default 32)\n"
+            "  -d, --depth=D        Maximum task stack depth (default 8)\n"
+            "  -n, --events=N       Events per thread (default 100000)\n"
+            "  -r, --rate=R         Events per second per thread (default\n"
+            "                       unlimited)\n"
+            "  -h, --help           Display this help\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    pthread_t *threads;
+    int opt;
+
+    static const struct option long_options[] = {
+        { "threads", required_argument, 0, 't' },
+        { "tasks", required_argument, 0, 'm' },
+        { "depth", required_argument, 0, 'd' },
+        { "events", required_argument, 0, 'n' },
+        { "rate", required_argument, 0, 'r' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "t:m:d:n:r:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            n_threads = atoi(optarg);
+            break;
+        case 'm':
+            n_tasks = atoi(optarg);
+            break;
+        case 'd':
+            max_depth = atoi(optarg);
+            break;
+        case 'n':
+            n_events = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (n_threads < 1 || n_tasks < 1 || max_depth < 1) {
+        usage();
+        return 1;
+    }
+
+    setenv("UT_ENABLE", "1", 1);
+
+    task_descs = calloc(n_tasks, sizeof(*task_descs));
+    for (int i = 0; i < n_tasks; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "synthetic-%d", i);
+        task_descs[i].name = strdup(name);
+    }
+
+    pthread_barrier_init(&done_barrier, NULL, n_threads + 1);
+
+    threads = calloc(n_threads, sizeof(*threads));
+    for (int i = 0; i < n_threads; i++)
+        pthread_create(&threads[i], NULL, client_thread, (void *)(uintptr_t)i);
+
+    pthread_barrier_wait(&done_barrier);
+
+    printf("ready\n");
+    fflush(stdout);
+
+    while (true)
+        pause();
+
+    return 0;
+}
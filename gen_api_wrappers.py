@@ -1,238 +1,649 @@
 #!/usr/bin/env python
 
+# Each argument is [ type, name ] or [ type, name, record_name ] to record its
+# value (cast to an int64_t) whenever tracing is enabled, and "record_ret" is
+# the name to record the return value with. Failures (-1) are recorded as
+# -errno.
+#
+# "name_fd" names a file descriptor (see ut_set_fd_name()) after a "path" or,
+# for sockets, the address of the "peer" (or NULL to query it) or the
+# "socket" domain, type and state of a new socket, if the call succeeded, or
+# "when" the given condition is true. It may be a list, to name several fds.
+# "clear" clears the name instead, "before" the call if the fd number may be
+# reused once the call returns (e.g. close).
+#
+# "untimed" wrappers don't record a task, but just keep track of fd names.
+#
+# "lock" is for profiling lock contention (see ut_lock_acquired()) with the
+# 'mutex' argument:
+#   acquire: only contended acquisitions are recorded, as a task
+#   try_acquire, release: just track which locks are held, without a task
+#   wait: the mutex is released while waiting (e.g. pthread_cond_wait) and
+#         reacquired afterwards (see ut_lock_reacquired())
+#
+# "cond" is for pairing the wakeups of condition variable waiters with the
+# signal/broadcast that woke them, via a per-cond sequence number (see
+# ut_cond_signal_seq()). Signals record the "seq" of the signal (and
+# "broadcast") and waiters record the latest "seq_before" and after waiting.
+#
+# "wait_reason" is why the call may block (see enum ut_wait_reason), for
+# ut-server's breakdown of the time each thread spends blocked.
+#
+# ut-server recognises these record names:
+#   fd: a file descriptor
+#   size: the number of bytes requested
+#   bytes: a return value that's the number of bytes transferred
+#   events: a return value that's the number of ready events of a wait for
+#           events (e.g. epoll_wait), which identifies event loops
+#   timeout: a timeout in milliseconds
+#
 apis = [
     {
         "name": "mmap",
+        "category": "MEMORY",
         "args": [
             [ 'void *', 'addr' ],
-            [ 'size_t', 'len' ],
+            [ 'size_t', 'len', 'size' ],
             [ 'int', 'prot' ],
             [ 'int', 'flags' ],
-            [ 'int', 'fd' ],
+            [ 'int', 'fd', 'fd' ],
             [ 'off_t', 'offset' ],
         ],
         "ret": 'void *'
     },
     {
         "name": "open",
+        "category": "IO",
+        "wait_reason": 'IO',
         "args": [
             [ 'const char *', 'path' ],
             [ 'int', 'flags' ],
             [ 'mode_t', 'mode' ],
         ],
-        "ret": 'int'
+        "ret": 'int',
+        "record_ret": 'fd',
+        "name_fd": { "fd": 'ret', "path": 'path' },
     },
     {
         "name": "read",
+        "category": "IO",
+        "wait_reason": 'IO',
         "args": [
-            [ 'int', 'fd' ],
+            [ 'int', 'fd', 'fd' ],
             [ 'void *', 'buf' ],
-            [ 'size_t', 'count' ],
+            [ 'size_t', 'count', 'size' ],
         ],
-        "ret": 'ssize_t'
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
     },
     {
         "name": "write",
+        "category": "IO",
+        "wait_reason": 'IO',
         "args": [
-            [ 'int', 'fd' ],
+            [ 'int', 'fd', 'fd' ],
+            [ 'const void *', 'buf' ],
+            [ 'size_t', 'count', 'size' ],
+        ],
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
+    },
+    {
+        "name": "pread",
+        "category": "IO",
+        "wait_reason": 'IO',
+        "args": [
+            [ 'int', 'fd', 'fd' ],
+            [ 'void *', 'buf' ],
+            [ 'size_t', 'count', 'size' ],
+            [ 'off_t', 'offset' ],
+        ],
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
+    },
+    {
+        "name": "pwrite",
+        "category": "IO",
+        "wait_reason": 'IO',
+        "args": [
+            [ 'int', 'fd', 'fd' ],
             [ 'const void *', 'buf' ],
-            [ 'size_t', 'count' ],
+            [ 'size_t', 'count', 'size' ],
+            [ 'off_t', 'offset' ],
+        ],
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
+    },
+    {
+        "name": "readv",
+        "category": "IO",
+        "wait_reason": 'IO',
+        "args": [
+            [ 'int', 'fd', 'fd' ],
+            [ 'const void *', 'iov' ],
+            [ 'int', 'iovcnt' ],
+        ],
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
+    },
+    {
+        "name": "writev",
+        "category": "IO",
+        "wait_reason": 'IO',
+        "args": [
+            [ 'int', 'fd', 'fd' ],
+            [ 'const void *', 'iov' ],
+            [ 'int', 'iovcnt' ],
+        ],
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
+    },
+    {
+        "name": "fsync",
+        "category": "IO",
+        "wait_reason": 'IO',
+        "args": [
+            [ 'int', 'fd', 'fd' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'ret',
+    },
+    {
+        "name": "fdatasync",
+        "category": "IO",
+        "wait_reason": 'IO',
+        "args": [
+            [ 'int', 'fd', 'fd' ],
         ],
-        "ret": 'ssize_t'
+        "ret": 'int',
+        "record_ret": 'ret',
     },
     {
         "name": "ioctl",
+        "category": "IO",
+        "wait_reason": 'IO',
         "args": [
-            [ 'int', 'fd' ],
-            [ 'unsigned long', 'req' ],
+            [ 'int', 'fd', 'fd' ],
+            [ 'unsigned long', 'req', 'request' ],
             [ 'void *', 'data' ],
         ],
-        "ret": 'int'
+        "ret": 'int',
+        "record_ret": 'ret',
     },
     {
         "name": "nanosleep",
+        "category": "WAIT",
+        "wait_reason": 'SLEEP',
         "args": [
             [ 'const void *', 'req' ],
             [ 'void *', 'rem' ],
         ],
-        "ret": 'int'
+        "ret": 'int',
+        "record_ret": 'ret',
     },
     {
-        "name": "send",
+        "name": "clock_nanosleep",
+        "category": "WAIT",
+        "wait_reason": 'SLEEP',
+        "args": [
+            [ 'int', 'clockid' ],
+            [ 'int', 'flags' ],
+            [ 'const void *', 'req' ],
+            [ 'void *', 'rem' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'ret',
+        "versions": [ "GLIBC_2.2.5", "GLIBC_2.17" ]
+    },
+    # Note: these don't call nanosleep() via its symbol, so aren't otherwise
+    # traced
+    {
+        "name": "usleep",
+        "category": "WAIT",
+        "wait_reason": 'SLEEP',
+        "args": [
+            [ 'unsigned int', 'usec' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'ret',
+    },
+    {
+        "name": "sleep",
+        "category": "WAIT",
+        "wait_reason": 'SLEEP',
+        "args": [
+            [ 'unsigned int', 'seconds' ],
+        ],
+        "ret": 'unsigned int',
+    },
+    {
+        "name": "sched_yield",
+        "category": "WAIT",
+        "wait_reason": 'SLEEP',
+        "args": [],
+        "ret": 'int',
+    },
+    {
+        "name": "socket",
+        "untimed": True,
+        "args": [
+            [ 'int', 'domain' ],
+            [ 'int', 'type' ],
+            [ 'int', 'protocol' ],
+        ],
+        "ret": 'int',
+        "name_fd": { "fd": 'ret', "socket": 'domain, type, "unconnected"' },
+    },
+    {
+        "name": "socketpair",
+        "untimed": True,
+        "args": [
+            [ 'int', 'domain' ],
+            [ 'int', 'type' ],
+            [ 'int', 'protocol' ],
+            [ 'int *', 'sv' ],
+        ],
+        "ret": 'int',
+        "name_fd": [
+            { "fd": 'sv[0]', "socket": 'domain, type, "socketpair"',
+              "when": 'ret == 0' },
+            { "fd": 'sv[1]', "socket": 'domain, type, "socketpair"',
+              "when": 'ret == 0' },
+        ],
+    },
+    {
+        "name": "close",
+        "untimed": True,
+        "args": [
+            [ 'int', 'fd' ],
+        ],
+        "ret": 'int',
+        "name_fd": { "fd": 'fd', "clear": True, "before": True },
+    },
+    # Note: we don't know the new fd's name, but it mustn't keep the name of
+    # the fd it replaced
+    {
+        "name": "dup2",
+        "untimed": True,
+        "args": [
+            [ 'int', 'oldfd' ],
+            [ 'int', 'newfd' ],
+        ],
+        "ret": 'int',
+        "name_fd": { "fd": 'newfd', "clear": True,
+                     "when": 'ret >= 0 && oldfd != newfd' },
+    },
+    {
+        "name": "dup3",
+        "untimed": True,
+        "args": [
+            [ 'int', 'oldfd' ],
+            [ 'int', 'newfd' ],
+            [ 'int', 'flags' ],
+        ],
+        "ret": 'int',
+        "name_fd": { "fd": 'newfd', "clear": True },
+        "versions": [ "GLIBC_2.9" ]
+    },
+    {
+        "name": "connect",
+        "category": "IO",
+        "wait_reason": 'NETWORK',
+        "args": [
+            [ 'int', 'sockfd', 'fd' ],
+            [ 'const void *', 'addr' ],
+            [ 'int', 'addrlen' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'ret',
+        # Note: non-blocking sockets are still connecting when this returns
+        "name_fd": { "fd": 'sockfd', "peer": 'addr',
+                     "when": 'ret == 0 || saved_errno == EINPROGRESS' },
+    },
+    {
+        "name": "accept",
+        "category": "IO",
+        "wait_reason": 'NETWORK',
         "args": [
             [ 'int', 'sockfd' ],
+            [ 'void * restrict', 'addr' ],
+            [ 'void * restrict', 'addrlen' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'fd',
+        "name_fd": { "fd": 'ret', "peer": 'NULL' },
+    },
+    {
+        "name": "accept4",
+        "category": "IO",
+        "wait_reason": 'NETWORK',
+        "args": [
+            [ 'int', 'sockfd' ],
+            [ 'void * restrict', 'addr' ],
+            [ 'void * restrict', 'addrlen' ],
+            [ 'int', 'flags' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'fd',
+        "name_fd": { "fd": 'ret', "peer": 'NULL' },
+        "versions": [ "GLIBC_2.10" ]
+    },
+    {
+        "name": "send",
+        "category": "IO",
+        "wait_reason": 'NETWORK',
+        "args": [
+            [ 'int', 'sockfd', 'fd' ],
             [ 'const void *', 'buf' ],
-            [ 'size_t', 'len' ],
+            [ 'size_t', 'len', 'size' ],
             [ 'int', 'flags' ],
         ],
-        "ret": 'ssize_t'
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
     },
     {
         "name": "sendto",
+        "category": "IO",
+        "wait_reason": 'NETWORK',
         "args": [
-            [ 'int', 'sockfd' ],
+            [ 'int', 'sockfd', 'fd' ],
             [ 'const void *', 'buf' ],
-            [ 'size_t', 'len' ],
+            [ 'size_t', 'len', 'size' ],
             [ 'int', 'flags' ],
             [ 'const void *', 'dest_addr' ],
             [ 'int', 'addrlen' ],
         ],
-        "ret": 'ssize_t'
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
     },
     {
         "name": "sendmsg",
+        "category": "IO",
+        "wait_reason": 'NETWORK',
         "args": [
-            [ 'int', 'sockfd' ],
+            [ 'int', 'sockfd', 'fd' ],
             [ 'const void *', 'msg' ],
             [ 'int', 'flags' ],
         ],
-        "ret": 'ssize_t'
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
     },
     {
         "name": "recv",
+        "category": "IO",
+        "wait_reason": 'NETWORK',
         "args": [
-            [ 'int', 'socket' ],
+            [ 'int', 'socket', 'fd' ],
             [ 'void *', 'buf' ],
-            [ 'size_t', 'len' ],
+            [ 'size_t', 'len', 'size' ],
             [ 'int', 'flags' ],
         ],
-        "ret": 'ssize_t'
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
     },
     {
         "name": "recvfrom",
+        "category": "IO",
+        "wait_reason": 'NETWORK',
         "args": [
-            [ 'int', 'socket' ],
+            [ 'int', 'socket', 'fd' ],
             [ 'void * restrict', 'buf' ],
-            [ 'size_t', 'len' ],
+            [ 'size_t', 'len', 'size' ],
             [ 'int', 'flags' ],
             [ 'void * restrict', 'addr' ],
             [ 'int * restrict', 'addr_len' ],
         ],
-        "ret": 'ssize_t'
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
     },
     {
         "name": "recvmsg",
+        "category": "IO",
+        "wait_reason": 'NETWORK',
         "args": [
-            [ 'int', 'socket' ],
+            [ 'int', 'socket', 'fd' ],
             [ 'void *', 'msg' ],
             [ 'int', 'flags' ],
         ],
-        "ret": 'ssize_t'
+        "ret": 'ssize_t',
+        "record_ret": 'bytes',
     },
     {
         "name": "pthread_mutex_lock",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
         "args": [
-            [ 'void *', 'mutex' ],
+            [ 'void *', 'mutex', 'mutex' ],
         ],
-        "ret": 'int'
+        "ret": 'int',
+        "lock": 'acquire',
     },
     {
         "name": "pthread_mutex_trylock",
+        "category": "LOCKS",
         "args": [
             [ 'void *', 'mutex' ],
         ],
-        "ret": 'int'
+        "ret": 'int',
+        "lock": 'try_acquire',
+        "versions": [ "GLIBC_2.2.5", "GLIBC_2.34" ]
     },
     {
         "name": "pthread_mutex_unlock",
+        "category": "LOCKS",
         "args": [
             [ 'void *', 'mutex' ],
         ],
-        "ret": 'int'
+        "ret": 'int',
+        "lock": 'release',
     },
 
     #XXX: note the pthread_cond_ apis have LinuxThreads vs NPTL versions
     {
         "name": "pthread_cond_wait",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
         "args": [
-            [ 'void * restrict', 'cond' ],
+            [ 'void * restrict', 'cond', 'cond' ],
             [ 'void * restrict', 'mutex' ],
         ],
         "ret": 'int',
+        "record_ret": 'ret',
+        "lock": 'wait',
+        "cond": 'wait',
         "versions": [ "GLIBC_2.2.5", "GLIBC_2.3.2" ]
     },
     {
         "name": "pthread_cond_timedwait",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
         "args": [
-            [ 'void * restrict', 'cond' ],
+            [ 'void * restrict', 'cond', 'cond' ],
             [ 'void * restrict', 'mutex' ],
             [ 'void * restrict', 'abstime' ],
         ],
         "ret": 'int',
+        "record_ret": 'ret',
+        "lock": 'wait',
+        "cond": 'wait',
         "versions": [ "GLIBC_2.2.5", "GLIBC_2.3.2" ]
     },
     {
         "name": "pthread_cond_signal",
+        "category": "LOCKS",
         "args": [
-            [ 'void *', 'cond' ],
+            [ 'void *', 'cond', 'cond' ],
         ],
         "ret": 'int',
+        "cond": 'signal',
         "versions": [ "GLIBC_2.2.5", "GLIBC_2.3.2" ]
     },
     {
         "name": "pthread_cond_broadcast",
+        "category": "LOCKS",
         "args": [
-            [ 'void *', 'cond' ],
+            [ 'void *', 'cond', 'cond' ],
         ],
         "ret": 'int',
+        "cond": 'broadcast',
         "versions": [ "GLIBC_2.2.5", "GLIBC_2.3.2" ]
     },
 
+    # Note: since glibc 2.34 these are in libc, with new default versions
+    {
+        "name": "sem_wait",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
+        "args": [
+            [ 'void *', 'sem', 'sem' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'ret',
+        "versions": [ "GLIBC_2.2.5", "GLIBC_2.34" ]
+    },
+    {
+        "name": "sem_timedwait",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
+        "args": [
+            [ 'void * restrict', 'sem', 'sem' ],
+            [ 'const void * restrict', 'abstime' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'ret',
+        "versions": [ "GLIBC_2.2.5", "GLIBC_2.34" ]
+    },
+    {
+        "name": "pthread_rwlock_rdlock",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
+        "args": [
+            [ 'void *', 'rwlock', 'rwlock' ],
+        ],
+        "ret": 'int',
+        "versions": [ "GLIBC_2.2.5", "GLIBC_2.34" ]
+    },
+    {
+        "name": "pthread_rwlock_wrlock",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
+        "args": [
+            [ 'void *', 'rwlock', 'rwlock' ],
+        ],
+        "ret": 'int',
+        "versions": [ "GLIBC_2.2.5", "GLIBC_2.34" ]
+    },
+    {
+        "name": "pthread_rwlock_timedrdlock",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
+        "args": [
+            [ 'void * restrict', 'rwlock', 'rwlock' ],
+            [ 'const void * restrict', 'abstime' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'ret',
+        "versions": [ "GLIBC_2.2.5", "GLIBC_2.34" ]
+    },
+    {
+        "name": "pthread_rwlock_timedwrlock",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
+        "args": [
+            [ 'void * restrict', 'rwlock', 'rwlock' ],
+            [ 'const void * restrict', 'abstime' ],
+        ],
+        "ret": 'int',
+        "record_ret": 'ret',
+        "versions": [ "GLIBC_2.2.5", "GLIBC_2.34" ]
+    },
+    {
+        "name": "pthread_join",
+        "category": "LOCKS",
+        "wait_reason": 'LOCK',
+        "args": [
+            [ 'unsigned long', 'thread' ],
+            [ 'void **', 'retval' ],
+        ],
+        "ret": 'int',
+        "versions": [ "GLIBC_2.2.5", "GLIBC_2.34" ]
+    },
+
     {
         "name": "poll",
+        "category": "WAIT",
+        "wait_reason": 'POLL',
         "args": [
             [ 'void *', 'fds' ],
-            [ 'unsigned long', 'nfds' ],
-            [ 'int', 'timeout' ],
+            [ 'unsigned long', 'nfds', 'nfds' ],
+            [ 'int', 'timeout', 'timeout' ],
         ],
         "ret": 'int',
+        "record_ret": 'events',
     },
     {
         "name": "ppoll",
+        "category": "WAIT",
+        "wait_reason": 'POLL',
         "args": [
             [ 'void *', 'fds' ],
-            [ 'unsigned long', 'nfds' ],
+            [ 'unsigned long', 'nfds', 'nfds' ],
             [ 'void *', 'tmo_p' ],
             [ 'void *', 'sigmask' ],
         ],
         "ret": 'int',
+        "record_ret": 'events',
+        "versions": [ "GLIBC_2.4" ]
     },
     {
         "name": "epoll_wait",
+        "category": "WAIT",
+        "wait_reason": 'POLL',
         "args": [
-            [ 'int', 'epfd' ],
+            [ 'int', 'epfd', 'epfd' ],
             [ 'void *', 'events' ],
-            [ 'int', 'maxevents' ],
-            [ 'int', 'timeout' ],
+            [ 'int', 'maxevents', 'maxevents' ],
+            [ 'int', 'timeout', 'timeout' ],
         ],
         "ret": 'int',
+        "record_ret": 'events',
+        "versions": [ "GLIBC_2.3.2" ]
     },
     {
         "name": "epoll_pwait",
+        "category": "WAIT",
+        "wait_reason": 'POLL',
         "args": [
-            [ 'int', 'epfd' ],
+            [ 'int', 'epfd', 'epfd' ],
             [ 'void *', 'events' ],
-            [ 'int', 'maxevents' ],
-            [ 'int', 'timeout' ],
+            [ 'int', 'maxevents', 'maxevents' ],
+            [ 'int', 'timeout', 'timeout' ],
             [ 'void *', 'sigmask' ],
         ],
         "ret": 'int',
+        "record_ret": 'events',
+        "versions": [ "GLIBC_2.6" ]
     },
     {
         "name": "select",
+        "category": "WAIT",
+        "wait_reason": 'POLL',
         "args": [
-            [ 'int', 'nfds' ],
+            [ 'int', 'nfds', 'nfds' ],
             [ 'fd_set * restrict', 'readfds' ],
             [ 'fd_set * restrict', 'writefds' ],
             [ 'fd_set * restrict', 'errorfds' ],
             [ 'struct timeval * restrict', 'timeout' ],
         ],
         "ret": 'int',
+        "record_ret": 'events',
     },
     {
         "name": "pselect",
+        "category": "WAIT",
+        "wait_reason": 'POLL',
         "args": [
-            [ 'int', 'nfds' ],
+            [ 'int', 'nfds', 'nfds' ],
             [ 'fd_set * restrict', 'readfds' ],
             [ 'fd_set * restrict', 'writefds' ],
             [ 'fd_set * restrict', 'errorfds' ],
@@ -240,17 +651,16 @@ apis = [
             [ 'const sigset_t *', 'sigmask' ],
         ],
         "ret": 'int',
+        "record_ret": 'events',
     },
 ]
 
-def emit_wrapper(func, symname, ver=None):
+def get_signature(func):
     if 'ret' in func:
         rettype = func['ret']
     else:
         rettype = "void"
 
-    print(rettype)
-
     args=""
     for arg in func['args']:
         args = args + arg[0] + " " + arg[1] + ", "
@@ -259,38 +669,246 @@ def emit_wrapper(func, symname, ver=None):
     else:
         args = args[:-2]
 
+    names=""
+    for arg in func['args']:
+        names = names + arg[1] + ", "
+    if names != "":
+        names = names[:-2]
+
+    return rettype, args, names
+
+# The pointer to the real function initially points to a trampoline which
+# resolves all the real symbols, in case the wrapper is called before our
+# constructor has run
+def emit_real_symbol(func, symname):
+    rettype, args, names = get_signature(func)
+
+    print("static " + rettype + " lazy_" + symname + "(" + args + ");")
+    print("static " + rettype + " (*real_" + symname + ")(" + args + ") = lazy_" + symname + ";")
+    print("")
+    print("static " + rettype)
+    print("lazy_" + symname + "(" + args + ")")
+    print("{")
+    print("    resolve_real_symbols();")
+    if 'ret' in func:
+        print("    return real_" + symname + "(" + names + ");")
+    else:
+        print("    real_" + symname + "(" + names + ");")
+    print("}")
+    print("")
+
+def emit_resolve_real_symbol(func, symname, ver=None):
+    if ver == None:
+        print("    real_" + symname + " = resolve_symbol(\"" + func['name'] + "\", NULL);")
+    else:
+        print("    real_" + symname + " = resolve_symbol(\"" + func['name'] + "\", \"" + ver + "\");")
+
+# Returns a list of [ record_name, C expression ] for the values to record
+# via ut_pop_task_args(), where the return value may only be recorded after
+# errno has been saved
+def get_recorded_values(func):
+    values = []
+
+    for arg in func['args']:
+        if len(arg) > 2 and '*' in arg[0]:
+            values.append([ arg[2], "(int64_t)(intptr_t)" + arg[1] ])
+        elif len(arg) > 2:
+            values.append([ arg[2], "(int64_t)" + arg[1] ])
+
+    cond = func['cond'] if 'cond' in func else None
+    if cond in [ 'signal', 'broadcast' ]:
+        values.append([ 'seq', "(int64_t)seq" ])
+    if cond == 'broadcast':
+        values.append([ 'broadcast', "1" ])
+    if cond == 'wait':
+        values.append([ 'seq_before', "(int64_t)seq_before" ])
+        values.append([ 'seq', "(int64_t)ut_cond_seq(cond)" ])
+
+    if 'record_ret' in func:
+        values.append([ func['record_ret'],
+                        "ret == -1 ? -saved_errno : (int64_t)ret" ])
+
+    return values
+
+def get_name_fds(func):
+    if 'name_fd' not in func:
+        return []
+    elif isinstance(func['name_fd'], list):
+        return func['name_fd']
+    else:
+        return [ func['name_fd'] ]
+
+def emit_name_fd(name_fd):
+    indent = "            "
+    if 'when' in name_fd:
+        print("        if (" + name_fd['when'] + ")")
+    elif 'before' in name_fd:
+        indent = "        "
+    else:
+        print("        if (ret >= 0)")
+
+    if 'clear' in name_fd:
+        print(indent + "ut_set_fd_name(" + name_fd['fd'] + ", NULL);")
+    elif 'path' in name_fd:
+        print(indent + "ut_set_fd_name(" + name_fd['fd'] + ", " + name_fd['path'] + ");")
+    elif 'socket' in name_fd:
+        print(indent + "ut_name_new_socket_fd(" + name_fd['fd'] + ", " + name_fd['socket'] + ");")
+    else:
+        print(indent + "ut_name_socket_fd(" + name_fd['fd'] + ", " + name_fd['peer'] + ");")
+
+def emit_pop_task_args(func, values, indent=""):
+    print(indent + "    if (ut_tracing_enabled()) {")
+    print(indent + "        int saved_errno = errno;")
+    print(indent + "        int64_t args[] = {")
+    for value in values:
+        print(indent + "            " + value[1] + ",")
+    print(indent + "        };")
+    print("")
+    for name_fd in get_name_fds(func):
+        emit_name_fd(name_fd)
+    print(indent + "        ut_pop_task_args(&task_desc, " + str(len(values)) + ", args);")
+    print(indent + "        errno = saved_errno;")
+    print(indent + "    }")
+
+# Lock/unlock wrappers which don't record a task for every call
+def emit_untimed_lock_wrapper(func, symname):
+    rettype, args, names = get_signature(func)
+
+    print(rettype)
+    print(symname + "(" + args + ")")
+    print("{")
+    print("    " + rettype + " ret;")
+    print("")
+    print("    if (!ut_tracing_enabled())")
+    print("        return real_" + symname + "(" + names + ");")
+    print("")
+    if func['lock'] == 'release':
+        print("    lock_released(mutex, mutex_has_waiters(mutex));")
+        print("    ret = real_" + symname + "(" + names + ");")
+    else:
+        print("    ret = real_" + symname + "(" + names + ");")
+        print("    if (ret == 0)")
+        print("        lock_acquired(mutex);")
+    print("")
+    print("    return ret;")
+    print("}")
+    print("")
+
+# Wrappers which don't record a task, but just keep track of fd names
+def emit_untimed_fd_wrapper(func, symname):
+    rettype, args, names = get_signature(func)
+    name_fds = get_name_fds(func)
+    before = [ name_fd for name_fd in name_fds if 'before' in name_fd ]
+    after = [ name_fd for name_fd in name_fds if 'before' not in name_fd ]
+
+    print(rettype)
+    print(symname + "(" + args + ")")
+    print("{")
+    print("    " + rettype + " ret;")
+    print("")
+    print("    if (!ut_tracing_enabled())")
+    print("        return real_" + symname + "(" + names + ");")
+    print("")
+    if len(before):
+        print("    {")
+        print("        int saved_errno = errno;")
+        print("")
+        for name_fd in before:
+            emit_name_fd(name_fd)
+        print("        errno = saved_errno;")
+        print("    }")
+    print("    ret = real_" + symname + "(" + names + ");")
+    if len(after):
+        print("    {")
+        print("        int saved_errno = errno;")
+        print("")
+        for name_fd in after:
+            emit_name_fd(name_fd)
+        print("        errno = saved_errno;")
+        print("    }")
+    print("")
+    print("    return ret;")
+    print("}")
+    print("")
+
+def emit_wrapper(func, symname):
+    rettype, args, names = get_signature(func)
+    values = get_recorded_values(func)
+
+    if 'lock' in func and func['lock'] in [ 'try_acquire', 'release' ]:
+        emit_untimed_lock_wrapper(func, symname)
+        return
+
+    if 'untimed' in func:
+        emit_untimed_fd_wrapper(func, symname)
+        return
+
+    print(rettype)
     print(symname + "(" + args + ")")
     print("{")
-    print("    static " + rettype + "(*real_" + symname + ")(" + args + ");")
     print("    static struct ut_task_desc task_desc = {")
-    print("        .name = \"" + func['name'] + "\"")
+    print("        .name = \"" + func['name'] + "\",")
+    print("        .category = UT_CATEGORY_" + func['category'] + ",")
+    if 'wait_reason' in func:
+        print("        .wait_reason = UT_WAIT_" + func['wait_reason'] + ",")
+    if len(values):
+        print("        .args = \"" + ",".join([ value[0] for value in values ]) + "\",")
     print("    };")
 
     if 'ret' in func:
         print("    " + rettype + " ret;")
+    if 'cond' in func and func['cond'] == 'wait':
+        print("    uint64_t seq_before = 0;")
+    elif 'cond' in func:
+        print("    uint64_t seq = 0;")
 
     print("")
-    print("    if (unlikely(!ut_push_task_ptr))")
-    print("        load_libut();")
-    print("")
-    print("    if (unlikely(!real_" + symname + "))")
-    if ver == None:
-        print("        real_" + symname + " = dlsym(RTLD_NEXT, \"" + func['name'] + "\");")
-    else:
-        print("        real_" + symname + " = dlvsym(RTLD_NEXT, \"" + func['name'] + "\", \"" + ver + "\");")
-    print("")
-    print("    ut_push_task_ptr(&task_desc);")
-    names=""
-    for arg in func['args']:
-        names = names + arg[1] + ", "
-    if names != "":
-        names = names[:-2]
 
+    lock = func['lock'] if 'lock' in func else None
+    if lock == 'acquire':
+        print("    if (!ut_tracing_enabled() ||")
+        print("        !category_enabled(UT_CATEGORY_" + func['category'] + "))")
+        print("        return real_" + symname + "(" + names + ");")
+        print("")
+        print("    /* Only contended acquisitions are recorded */")
+        print("    ret = real_" + get_real_symname('pthread_mutex_trylock') + "(mutex);")
+        print("    if (ret == EBUSY) {")
+        print("        push_task(&task_desc);")
+        print("        ret = real_" + symname + "(" + names + ");")
+        emit_pop_task_args(func, values, "    ")
+        print("    }")
+        print("    if (ret == 0)")
+        print("        lock_acquired(mutex);")
+        print("")
+        print("    return ret;")
+        print("}")
+        print("")
+        return
+
+    cond = func['cond'] if 'cond' in func else None
+    if cond == 'wait' and lock == 'wait':
+        print("    if (ut_tracing_enabled()) {")
+        print("        seq_before = ut_cond_seq(cond);")
+        print("        lock_released(mutex, mutex_has_waiters(mutex));")
+        print("    }")
+    elif lock == 'wait':
+        print("    if (ut_tracing_enabled())")
+        print("        lock_released(mutex, mutex_has_waiters(mutex));")
+    print("    push_task(&task_desc);")
+    if cond in [ 'signal', 'broadcast' ]:
+        print("    if (ut_tracing_enabled())")
+        print("        seq = ut_cond_signal_seq(cond);")
     if 'ret' in func:
         print("    ret = real_" + symname + "(" + names + ");")
     else:
         print("    real_" + symname + "(" + names + ");")
-    print("    ut_pop_task_ptr(&task_desc);")
+    if lock == 'wait':
+        print("    if (ut_tracing_enabled())")
+        print("        lock_reacquired(mutex);")
+    if len(values):
+        emit_pop_task_args(func, values)
+    else:
+        print("    pop_task(&task_desc);")
 
     print("")
     if 'ret' in func:
@@ -298,37 +916,166 @@ def emit_wrapper(func, symname, ver=None):
     print("}")
     print("")
 
+# The name of the real function pointer to call a function directly, where
+# for versioned functions any version will do
+def get_real_symname(name):
+    for func in apis:
+        if func['name'] == name and "versions" in func:
+            return "__ut_" + name + "_" + func['versions'][0].replace('.', '_')
+    return name
+
+def for_each_symbol(callback):
+    for func in apis:
+        if 'skip' in func and func['skip'] == True:
+            continue
+
+        if "versions" in func:
+            for ver in func['versions']:
+                vername = "__ut_" + func['name'] + "_" + ver.replace('.', '_');
+                callback(func, vername, ver)
+        else:
+            callback(func, func['name'], None)
+
 
 print("#define _GNU_SOURCE")
 print("#include <sys/types.h>")
 print("#include <dlfcn.h>")
+print("#include <errno.h>")
+print("#include <stdbool.h>")
+print("#include <stdint.h>")
+print("#include <stdio.h>")
+print("#include <stdlib.h>")
 print("")
 print("#include \"ut-shared-data.h\"")
 print("")
 print("/* AUTOMATICALLY GENERATED; DO NOT EDIT */")
 print("")
 print("")
-print("#define unlikely(x) __builtin_expect(x, 0)")
+print("/* Note: when tracing is disabled these are just a nop, and the wrappers")
+print(" * must never change errno as seen by the caller")
+print(" */")
+print("static inline __attribute__((always_inline)) void")
+print("push_task(struct ut_task_desc *task_desc)")
+print("{")
+print("    if (ut_tracing_enabled()) {")
+print("        int saved_errno = errno;")
+print("        ut_push_task(task_desc);")
+print("        errno = saved_errno;")
+print("    }")
+print("}")
+print("")
+print("static inline __attribute__((always_inline)) void")
+print("pop_task(struct ut_task_desc *task_desc)")
+print("{")
+print("    if (ut_tracing_enabled()) {")
+print("        int saved_errno = errno;")
+print("        ut_pop_task(task_desc);")
+print("        errno = saved_errno;")
+print("    }")
+print("}")
+print("")
+print("static inline __attribute__((always_inline)) bool")
+print("category_enabled(enum ut_task_category category)")
+print("{")
+print("    int saved_errno = errno;")
+print("    bool enabled = ut_category_enabled(category);")
+print("    errno = saved_errno;")
+print("    return enabled;")
+print("}")
+print("")
+print("static inline __attribute__((always_inline)) void")
+print("lock_acquired(void *lock)")
+print("{")
+print("    int saved_errno = errno;")
+print("    ut_lock_acquired(lock);")
+print("    errno = saved_errno;")
+print("}")
+print("")
+print("static inline __attribute__((always_inline)) void")
+print("lock_reacquired(void *lock)")
+print("{")
+print("    int saved_errno = errno;")
+print("    ut_lock_reacquired(lock);")
+print("    errno = saved_errno;")
+print("}")
 print("")
-print("void load_libut(void);")
+print("static inline __attribute__((always_inline)) void")
+print("lock_released(void *lock, bool contended)")
+print("{")
+print("    int saved_errno = errno;")
+print("    ut_lock_released(lock, contended);")
+print("    errno = saved_errno;")
+print("}")
 print("")
-print("extern void (*ut_push_task_ptr)(struct ut_task_desc *task_desc);")
-print("extern void (*ut_pop_task_ptr)(struct ut_task_desc *task_desc);")
+print("/* Note: this peeks at the lock word of glibc's pthread_mutex_t, which is 2")
+print(" * while there may be waiters, except for robust and priority")
+print(" * inheriting/protecting mutexes, where it's the owner's tid. It's also 2")
+print(" * after a condition variable wait, since the mutex is then reacquired as if")
+print(" * there were waiters, which is why libut ignores this for such holds (see")
+print(" * ut_lock_reacquired())")
+print(" */")
+print("static inline bool")
+print("mutex_has_waiters(void *mutex)")
+print("{")
+print("#if defined(__GLIBC__) && defined(__x86_64__)")
+print("    struct {")
+print("        int lock;")
+print("        unsigned int count;")
+print("        int owner;")
+print("        unsigned int nusers;")
+print("        int kind;")
+print("    } *glibc_mutex = mutex;")
 print("")
+print("    if (glibc_mutex->kind & 0x70)")
+print("        return false;")
 print("")
+print("    return __atomic_load_n(&glibc_mutex->lock, __ATOMIC_RELAXED) > 1;")
+print("#else")
+print("    return false;")
+print("#endif")
+print("}")
+print("")
+print("static void *")
+print("resolve_symbol(const char *name, const char *version)")
+print("{")
+print("    void *sym = (version ? dlvsym(RTLD_NEXT, name, version) :")
+print("                 dlsym(RTLD_NEXT, name));")
+print("")
+print("    /* e.g. GLIBC_2.34 with an older glibc, in which case nothing can be")
+print("     * linked against that version anyway")
+print("     */")
+print("    if (!sym && version)")
+print("        sym = dlsym(RTLD_NEXT, name);")
+print("")
+print("    if (!sym) {")
+print("        fprintf(stderr, \"Failed to find real %s symbol\\n\", name);")
+print("        abort();")
+print("    }")
+print("")
+print("    return sym;")
+print("}")
+print("")
+print("void ut_name_socket_fd(int fd, const void *peer);")
+print("void ut_name_new_socket_fd(int fd, int domain, int type, const char *state);")
+print("uint64_t ut_cond_signal_seq(void *cond);")
+print("uint64_t ut_cond_seq(void *cond);")
+print("")
+print("static void resolve_real_symbols(void);")
 print("")
 
+for_each_symbol(lambda func, symname, ver: emit_real_symbol(func, symname))
 
-for func in apis:
-    if 'skip' in func and func['skip'] == True:
-        continue
+print("/* Note: it's harmless if multiple threads race to call this via the lazy")
+print(" * trampolines since they will all store the same pointers")
+print(" */")
+print("static void __attribute__((constructor))")
+print("resolve_real_symbols(void)")
+print("{")
+for_each_symbol(emit_resolve_real_symbol)
+print("}")
+print("")
 
-    if "versions" in func:
-        for ver in func['versions']:
-            vername = "__ut_" + func['name'] + "_" + ver.replace('.', '_');
-            emit_wrapper(func, vername, ver)
-    else:
-        emit_wrapper(func, func['name'])
+for_each_symbol(lambda func, symname, ver: emit_wrapper(func, symname))
 
 
 for func in apis:
@@ -338,12 +1085,11 @@ for func in apis:
     if "versions" not in func:
         continue
 
-    first = True
+    # The last version is the default
     for ver in func['versions']:
         vername = "__ut_" + func['name'] + "_" + ver.replace('.', '_');
-        if first:
-            sep = "@"
-        else:
+        if ver == func['versions'][-1]:
             sep = "@@"
+        else:
+            sep = "@"
         print('__asm__(".symver ' + vername + ', ' + func['name'] + sep + ver + '");')
-        first = False
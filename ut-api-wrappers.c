@@ -29,18 +29,23 @@
 
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <dlfcn.h>
+#include <malloc.h>
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
-#include "ut.h"
-
-#define unlikely(x) __builtin_expect(x, 0)
-
-void (*ut_push_task_ptr)(struct ut_task_desc *task_desc);
-void (*ut_pop_task_ptr)(struct ut_task_desc *task_desc);
+#include "ut-shared-data.h"
+#include "ut-utils.h"
 
 /* Provided so libut has a way to lookup the RTLD_NEXT
  * symbol - relative to these wrappers - to be able to
@@ -52,66 +57,292 @@ ut_dlsym_next_untraced(const char *sym)
     return dlsym(RTLD_NEXT, sym);
 }
 
-/* XXX: note we aren't using a pthread_once_t but it's fine
- * have a race here since the result will be the same if
- * repeated.
+/* Sequence numbers for the signals and broadcasts of each condition variable,
+ * so ut-server can pair waiters with the signal that woke them up. Condition
+ * variables are hashed into a fixed number of counters, so unrelated
+ * condition variables may share a sequence, which only means their sequence
+ * numbers aren't contiguous.
+ */
+#define COND_SEQ_SLOTS 1024
+
+static uint64_t cond_seqs[COND_SEQ_SLOTS];
+
+static uint64_t *
+cond_seq_slot(void *cond)
+{
+    uintptr_t hash = (uintptr_t)cond;
+
+    hash ^= hash >> 17;
+    hash *= 0x9e3779b97f4a7c15ULL;
+
+    return &cond_seqs[(hash >> 32) % COND_SEQ_SLOTS];
+}
+
+/* Returns the sequence number for a new signal/broadcast of cond */
+uint64_t
+ut_cond_signal_seq(void *cond)
+{
+    return __atomic_add_fetch(cond_seq_slot(cond), 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the sequence number of the latest signal/broadcast of cond */
+uint64_t
+ut_cond_seq(void *cond)
+{
+    return __atomic_load_n(cond_seq_slot(cond), __ATOMIC_SEQ_CST);
+}
+
+/* Names a socket fd after its peer's address (e.g. "tcp:10.0.0.1:80"), for
+ * the connect() and accept() wrappers. If peer is NULL the address is queried
+ * with getpeername().
  */
 void
-load_libut(void)
+ut_name_socket_fd(int fd, const void *peer)
 {
-    void *handle = dlopen("libut.so", RTLD_LAZY);
-    if (handle) {
-        ut_push_task_ptr = dlsym(handle, "ut_push_task");
-        ut_pop_task_ptr = dlsym(handle, "ut_pop_task");
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    const struct sockaddr *sa = peer;
+    char host[INET6_ADDRSTRLEN];
+    char name[UT_FD_NAME_MAX];
+    int type = 0;
+    socklen_t type_len = sizeof(type);
+    const char *proto;
+
+    if (!sa) {
+        if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) < 0)
+            return;
+        sa = (struct sockaddr *)&addr;
+    }
+
+    /* The peer of an accepted unix socket is usually unnamed, so we name
+     * it after the listening socket instead
+     */
+    if (sa->sa_family == AF_UNIX &&
+        !((const struct sockaddr_un *)sa)->sun_path[0] &&
+        !((const struct sockaddr_un *)sa)->sun_path[1]) {
+        addr_len = sizeof(addr);
+        if (getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0)
+            return;
+        sa = (struct sockaddr *)&addr;
+    }
+
+    getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len);
+    proto = type == SOCK_DGRAM ? "udp" : "tcp";
+
+    switch (sa->sa_family) {
+    case AF_INET: {
+        const struct sockaddr_in *in = (const void *)sa;
+
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        snprintf(name, sizeof(name), "%s:%s:%d", proto, host,
+                 ntohs(in->sin_port));
+        break;
+    }
+    case AF_INET6: {
+        const struct sockaddr_in6 *in6 = (const void *)sa;
+
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        snprintf(name, sizeof(name), "%s:[%s]:%d", proto, host,
+                 ntohs(in6->sin6_port));
+        break;
     }
+    case AF_UNIX: {
+        const struct sockaddr_un *un = (const void *)sa;
+
+        /* Note: abstract socket names start with a nul byte */
+        if (un->sun_path[0])
+            snprintf(name, sizeof(name), "unix:%s", un->sun_path);
+        else
+            snprintf(name, sizeof(name), "unix:@%s", un->sun_path + 1);
+        break;
+    }
+    default:
+        snprintf(name, sizeof(name), "socket:family=%d", sa->sa_family);
+        break;
+    }
+
+    ut_set_fd_name(fd, name);
 }
 
-/* Tricky cases to handle, like dlsym using calloc */
-#if 0
-/* dlsym uses calloc, so to break the recursion we need a temporary fallback */
-static uint8_t tmp_calloc_heap[4096];
-static size_t tmp_calloc_off;
+/* Names a new socket fd after its protocol and the given state (e.g.
+ * "tcp:unconnected"), until it's named after its peer, so I/O on it is still
+ * recognised as network I/O and not attributed to whatever previously had
+ * the same fd
+ */
+void
+ut_name_new_socket_fd(int fd, int domain, int type, const char *state)
+{
+    char name[UT_FD_NAME_MAX];
+
+    type &= ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-void *ut_untraced_malloc(size_t size);
-void *ut_untraced_realloc(void * ptr, size_t size);
-void ut_untraced_free(void * ptr);
+    switch (domain) {
+    case AF_INET:
+    case AF_INET6:
+        snprintf(name, sizeof(name), "%s:%s",
+                 type == SOCK_DGRAM ? "udp" : "tcp", state);
+        break;
+    case AF_UNIX:
+        snprintf(name, sizeof(name), "unix:%s", state);
+        break;
+    default:
+        snprintf(name, sizeof(name), "socket:family=%d", domain);
+        break;
+    }
 
-void *
-malloc(size_t size)
+    ut_set_fd_name(fd, name);
+}
+
+/* The malloc() family are wrapped by hand, since dlsym() may itself
+ * allocate (e.g. calloc() for its dlerror() state), and so allocations made
+ * while we're resolving the real allocator are served from a small static
+ * bootstrap arena instead. Bootstrap allocations are never freed, and are
+ * moved to a real allocation if reallocated.
+ *
+ * Allocations smaller than UT_MALLOC_MIN_SIZE bytes aren't traced, and at
+ * high rates allocations are sampled like any other task, if there's an
+ * event budget (see UT_EVENT_BUDGET).
+ */
+#define BOOTSTRAP_ARENA_SIZE 65536
+
+struct bootstrap_header {
+    size_t size;
+    size_t padding; /* keeps allocations 16 byte aligned */
+};
+
+static uint8_t bootstrap_arena[BOOTSTRAP_ARENA_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_offset;
+
+static void *(*real_malloc)(size_t size);
+static void *(*real_calloc)(size_t nmemb, size_t size);
+static void *(*real_realloc)(void *ptr, size_t size);
+static void (*real_free)(void *ptr);
+
+static size_t malloc_min_size;
+
+static struct ut_task_desc malloc_task_desc = {
+    .name = "malloc",
+    .category = UT_CATEGORY_MEMORY,
+    .args = "alloc",
+};
+
+static struct ut_task_desc calloc_task_desc = {
+    .name = "calloc",
+    .category = UT_CATEGORY_MEMORY,
+    .args = "alloc",
+};
+
+static struct ut_task_desc realloc_task_desc = {
+    .name = "realloc",
+    .category = UT_CATEGORY_MEMORY,
+    .args = "alloc",
+};
+
+static struct ut_task_desc free_task_desc = {
+    .name = "free",
+    .category = UT_CATEGORY_MEMORY,
+    .args = "free",
+};
+
+/* Note: the arena is zero initialized and never reused, so this also
+ * serves calloc()
+ */
+static void *
+bootstrap_alloc(size_t size)
 {
-    static struct ut_task_desc task_desc = {
-        .name = "malloc"
-    };
-    void * ret;
+    size_t len = sizeof(struct bootstrap_header) + ((size + 15) & ~15);
+    size_t offset = __atomic_fetch_add(&bootstrap_offset, len,
+                                       __ATOMIC_RELAXED);
+    struct bootstrap_header *header;
+
+    if (offset + len > BOOTSTRAP_ARENA_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    ut_push_task(&task_desc);
-    ret = ut_untraced_malloc(size);
-    ut_pop_task(&task_desc);
+    header = (void *)(bootstrap_arena + offset);
+    header->size = size;
 
-    return ret;
+    return header + 1;
 }
 
-void
-free(void * ptr)
+static inline bool
+is_bootstrap_alloc(void *ptr)
+{
+    return (uint8_t *)ptr >= bootstrap_arena &&
+           (uint8_t *)ptr < bootstrap_arena + BOOTSTRAP_ARENA_SIZE;
+}
+
+/* Returns false while the real allocator is being resolved, for callers to
+ * fall back to the bootstrap arena
+ */
+static bool
+resolve_allocator(void)
+{
+    static bool resolving;
+
+    if (__atomic_exchange_n(&resolving, true, __ATOMIC_ACQUIRE))
+        return false;
+
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    __atomic_store_n(&real_malloc, dlsym(RTLD_NEXT, "malloc"),
+                     __ATOMIC_RELEASE);
+
+    if (!real_malloc || !real_calloc || !real_realloc || !real_free) {
+        fprintf(stderr, "Failed to resolve the real allocator\n");
+        abort();
+    }
+
+    __atomic_store_n(&resolving, false, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static void __attribute__((constructor))
+init_malloc_wrappers(void)
+{
+    malloc_min_size = MIN(ut_get_uint_env("UT_MALLOC_MIN_SIZE", 0), SIZE_MAX);
+}
+
+/* Note: like the generated wrappers, these must never change errno as seen by
+ * the caller (e.g. if libut fails to connect to the server while allocating
+ * a thread's state)
+ */
+static inline void
+push_alloc_task(struct ut_task_desc *task_desc)
+{
+    int saved_errno = errno;
+
+    ut_push_task(task_desc);
+    errno = saved_errno;
+}
+
+static inline void
+pop_alloc_task(struct ut_task_desc *task_desc, int64_t value)
 {
-    static struct ut_task_desc task_desc = {
-        .name = "free"
-    };
+    int saved_errno = errno;
 
-    ut_push_task(&task_desc);
-    ut_untraced_free(ptr);
-    ut_pop_task(&task_desc);
+    ut_pop_task_args(task_desc, 1, &value);
+    errno = saved_errno;
 }
 
 void *
-tmp_malloc_zeroed(size_t size)
+malloc(size_t size)
 {
-    uint8_t *ret = tmp_calloc_heap + tmp_calloc_off;
+    void *ret;
 
-    if (tmp_calloc_off >= sizeof(tmp_calloc_heap))
-        return NULL;
+    if (unlikely(!__atomic_load_n(&real_malloc, __ATOMIC_ACQUIRE)) &&
+        !resolve_allocator())
+        return bootstrap_alloc(size);
+
+    if (!ut_tracing_enabled() || size < malloc_min_size)
+        return real_malloc(size);
 
-    tmp_calloc_off = (tmp_calloc_off + size + 7) & ~0x7;
+    push_alloc_task(&malloc_task_desc);
+    ret = real_malloc(size);
+    pop_alloc_task(&malloc_task_desc, size);
 
     return ret;
 }
@@ -119,42 +350,76 @@ tmp_malloc_zeroed(size_t size)
 void *
 calloc(size_t nmemb, size_t size)
 {
-    static void *(*real_calloc)(size_t nmemb, size_t size);
-    static bool in_dlsym;
-    static struct ut_task_desc task_desc = {
-        .name = "calloc"
-    };
-    void * ret;
-
-    /* XXX: calloc causes trouble becuse it's used by dlsym */
-    if (unlikely(!real_calloc)) {
-        if (!in_dlsym) {
-            in_dlsym = true;
-            real_calloc = dlsym(RTLD_NEXT, "calloc");
-            in_dlsym = false;
-        } else
-            return tmp_malloc_zeroed(nmemb * size);
-    } else {
-        ut_push_task(&task_desc);
-        ret = real_calloc(nmemb, size);
-        ut_pop_task(&task_desc);
+    size_t total;
+    void *ret;
+
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
     }
 
+    if (unlikely(!__atomic_load_n(&real_malloc, __ATOMIC_ACQUIRE)) &&
+        !resolve_allocator())
+        return bootstrap_alloc(total);
+
+    if (!ut_tracing_enabled() || total < malloc_min_size)
+        return real_calloc(nmemb, size);
+
+    push_alloc_task(&calloc_task_desc);
+    ret = real_calloc(nmemb, size);
+    pop_alloc_task(&calloc_task_desc, total);
+
     return ret;
 }
 
 void *
-realloc(void * ptr, size_t size)
+realloc(void *ptr, size_t size)
 {
-    static struct ut_task_desc task_desc = {
-        .name = "realloc"
-    };
-    void * ret;
+    void *ret;
+
+    if (unlikely(is_bootstrap_alloc(ptr))) {
+        struct bootstrap_header *header = (struct bootstrap_header *)ptr - 1;
 
-    ut_push_task(&task_desc);
-    ret = ut_untraced_realloc(ptr, size);
-    ut_pop_task(&task_desc);
+        ret = malloc(size);
+        if (ret)
+            memcpy(ret, ptr, header->size < size ? header->size : size);
+        return ret;
+    }
+
+    if (unlikely(!__atomic_load_n(&real_malloc, __ATOMIC_ACQUIRE)) &&
+        !resolve_allocator())
+        return ptr ? NULL : bootstrap_alloc(size);
+
+    if (!ut_tracing_enabled() || size < malloc_min_size)
+        return real_realloc(ptr, size);
+
+    push_alloc_task(&realloc_task_desc);
+    ret = real_realloc(ptr, size);
+    pop_alloc_task(&realloc_task_desc, size);
 
     return ret;
 }
-#endif
+
+void
+free(void *ptr)
+{
+    if (unlikely(!ptr || is_bootstrap_alloc(ptr)))
+        return;
+
+    /* e.g. if dlsym() frees something while we're resolving the real
+     * allocator, which we'd have to leak
+     */
+    if (unlikely(!__atomic_load_n(&real_malloc, __ATOMIC_ACQUIRE)) &&
+        !resolve_allocator())
+        return;
+
+    if (!ut_tracing_enabled() ||
+        (malloc_min_size && malloc_usable_size(ptr) < malloc_min_size)) {
+        real_free(ptr);
+        return;
+    }
+
+    push_alloc_task(&free_task_desc);
+    real_free(ptr);
+    pop_alloc_task(&free_task_desc, (uintptr_t)ptr);
+}
@@ -38,13 +38,44 @@
  * it's set then the full entry is valid.
  */
 
+#include <limits.h>
+
 #include "memfd.h"
 
 #include "ut-utils.h"
+#include "ut-shared-data.h"
 #include "ut-memfd-array.h"
 
 #define MEMFD_ARRAY_BUF_PAGE_COUNT 2
 
+static int
+_stack_create_file(struct ut_memfd_stack *stack)
+{
+    struct ut_index_entry entry = { .type = UT_INDEX_ANCILLARY };
+    char filename[PATH_MAX];
+    const char *basename;
+    int fd;
+
+    snprintf(filename, sizeof(filename), "%s-%d",
+             stack->path_prefix, stack->buffers.len);
+
+    fd = ut_untraced_open(filename, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    if (fd < 0) {
+        dbg("Failed to create ancillary data file %s: %m\n", filename);
+        return -1;
+    }
+
+    basename = strrchr(filename, '/');
+    basename = basename ? basename + 1 : filename;
+
+    entry.tid = stack->tid;
+    entry.serial = stack->serial;
+    strncpy(entry.filename, basename, sizeof(entry.filename) - 1);
+    ut_write_index_entry(stack->index_fd, &entry);
+
+    return fd;
+}
+
 static void
 _stack_alloc_buffer(struct ut_memfd_stack *stack)
 {
@@ -52,8 +83,11 @@ _stack_alloc_buffer(struct ut_memfd_stack *stack)
 
     memset(&stack->current_buf, 0, sizeof(stack->current_buf));
 
-    stack->current_buf.fd = memfd_create(stack->debug_name,
-                                         MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    if (stack->path_prefix)
+        stack->current_buf.fd = _stack_create_file(stack);
+    else
+        stack->current_buf.fd = memfd_create(stack->debug_name,
+                                             MFD_CLOEXEC|MFD_ALLOW_SEALING);
     if (stack->current_buf.fd >= 0) {
         stack->current_buf.size = MEMFD_ARRAY_BUF_PAGE_COUNT * page_size;
         stack->current_buf.offset = 0;
@@ -64,10 +98,19 @@ _stack_alloc_buffer(struct ut_memfd_stack *stack)
             close(stack->current_buf.fd);
             memset(&stack->current_buf, 0, sizeof(stack->current_buf));
             stack->current_buf.fd = -1;
+        } else {
+            struct ut_memfd_stack_buffer buffer = {
+                .data = stack->current_buf.data,
+                .size = stack->current_buf.size,
+            };
+            array_append_val(&stack->buffers,
+                             struct ut_memfd_stack_buffer, buffer);
         }
 
-        dbg("passing ancillary data fd\n");
-        ut_send_fd(stack->socket_fd, stack->current_buf.fd);
+        if (stack->socket_fd >= 0) {
+            dbg("passing ancillary data fd\n");
+            ut_send_fd(stack->socket_fd, stack->current_buf.fd);
+        }
     }
 }
 
@@ -81,6 +124,27 @@ ut_memfd_stack_init(struct ut_memfd_stack *stack,
 
     stack->socket_fd = socket_fd;
     stack->debug_name = strdup(debug_name);
+    array_init(&stack->buffers, sizeof(struct ut_memfd_stack_buffer), 4);
+
+    _stack_alloc_buffer(stack);
+}
+
+void
+ut_memfd_stack_init_files(struct ut_memfd_stack *stack,
+                          const char *path_prefix,
+                          int index_fd,
+                          int tid,
+                          uint32_t serial)
+{
+    memset(stack, 0, sizeof(*stack));
+    stack->current_buf.fd = -1;
+
+    stack->socket_fd = -1;
+    stack->path_prefix = strdup(path_prefix);
+    stack->index_fd = index_fd;
+    stack->tid = tid;
+    stack->serial = serial;
+    array_init(&stack->buffers, sizeof(struct ut_memfd_stack_buffer), 4);
 
     _stack_alloc_buffer(stack);
 }
@@ -111,3 +175,14 @@ ut_memfd_stack_memalign(struct ut_memfd_stack *stack,
         return NULL;
 }
 
+int
+ut_memfd_stack_get_n_buffers(struct ut_memfd_stack *stack)
+{
+    return stack->buffers.len;
+}
+
+struct ut_memfd_stack_buffer *
+ut_memfd_stack_get_buffer(struct ut_memfd_stack *stack, int n)
+{
+    return array_element_at(&stack->buffers, struct ut_memfd_stack_buffer, n);
+}
@@ -1,5 +1,12 @@
 #pragma once
 
+#include "ut-utils.h"
+
+struct ut_memfd_stack_buffer
+{
+    volatile void *data;
+    size_t size;
+};
 
 struct ut_memfd_stack
 {
@@ -8,6 +15,19 @@ struct ut_memfd_stack
     int socket_fd; /* Each new buffer allocated gets forwarded over this socket */
     char *debug_name;
 
+    /* Alternatively (with no server to forward fds to) buffers can be backed
+     * by files named <path_prefix>-<n> which are listed in an index file
+     */
+    char *path_prefix;
+    int index_fd;
+    int tid;
+    uint32_t serial;
+
+    /* All buffers allocated so far, as struct ut_memfd_stack_buffer, so they
+     * can be found by a crash handler
+     */
+    struct array buffers;
+
     /* Only track one, head buffer. */
     struct {
         int fd;
@@ -27,8 +47,22 @@ ut_memfd_stack_init(struct ut_memfd_stack *stack,
                     int socket_fd,
                     const char *debug_name);
 
+void
+ut_memfd_stack_init_files(struct ut_memfd_stack *stack,
+                          const char *path_prefix,
+                          int index_fd,
+                          int tid,
+                          uint32_t serial);
+
 volatile void *
 ut_memfd_stack_memalign(struct ut_memfd_stack *stack,
                         size_t size,
                         size_t alignment);
 
+/* Async-signal safe */
+int
+ut_memfd_stack_get_n_buffers(struct ut_memfd_stack *stack);
+
+/* Async-signal safe */
+struct ut_memfd_stack_buffer *
+ut_memfd_stack_get_buffer(struct ut_memfd_stack *stack, int n);
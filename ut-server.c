@@ -32,11 +32,18 @@
 #include <sys/socket.h>
 #include <sys/mman.h>
 #include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <json.h>
 
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <sched.h>
+#include <getopt.h>
+#include <limits.h>
+#include <fcntl.h>
+
+#include <linux/futex.h>
 
 #include <uv.h>
 
@@ -58,14 +65,39 @@ struct ut_ancillary_buffer {
     gputop_list_t link;
     int fd;
     uint8_t *buf;
-    uint32_t buf_size;
+    size_t buf_size;
+};
+
+/* A circular buffer of samples, prefixed with an info page */
+struct ut_ring {
+    volatile struct ut_info_page *info;
+    volatile struct ut_sample *buf;
+    size_t buf_size;
+
+    /* For rings in lossless mode, the samples we've read so far, and the
+     * client's sample count up to which we've read.
+     *
+     * At most drain_limit samples are kept, after which this is used as a
+     * circular buffer of the most recent samples.
+     */
+    struct array drained;
+    uint64_t drain_pos;
+    uint64_t n_drained;
+    uint64_t n_drain_discarded;
 };
 
 struct ut_client {
     int fd;
+
+    /* The info page of the main ring, with the client's pid/tid etc */
     volatile struct ut_info_page *info;
-    volatile struct ut_sample *buf;
-    uint32_t buf_size;
+
+    /* The main ring and, optionally, a ring for high priority tasks */
+    struct ut_ring rings[2];
+    int n_rings;
+
+    /* Whether we can write to the info pages, to update n_samples_read */
+    bool writable;
 
     gputop_list_t ancillary_buffers;
     struct array task_descriptors;
@@ -74,6 +106,11 @@ struct ut_client {
 
     bool exited;
 
+    /* For flight recorder buffers, the serial number that distinguishes
+     * this thread from others that may have had the same tid
+     */
+    uint32_t serial;
+
     char process_name[64];
     char thread_name[64];
 };
@@ -86,6 +123,34 @@ static uv_poll_t listener_poll;
 static int signal_poll_fd;
 static uv_poll_t signal_poll;
 
+static int n_numa_nodes;
+
+/* The task categories to enable for clients, as configured via
+ * --categories or commands on stdin, if set
+ */
+static uint64_t category_mask = ~0ULL;
+static bool category_mask_set;
+
+/* With --bench we report how long each phase of a capture takes */
+static bool bench_mode;
+
+/* With --verbose we also summarize the statistics of each thread/process on
+ * stderr, besides reporting them in the JSON output
+ */
+static bool verbose;
+
+/* The most samples we keep from draining each lossless ring, beyond which
+ * the oldest are discarded, as configured via --drain-limit
+ */
+#define UT_DEFAULT_DRAIN_LIMIT (1024 * 1024)
+static int drain_limit = UT_DEFAULT_DRAIN_LIMIT;
+
+static uv_poll_t stdin_poll;
+
+/* How often we read the circular buffers of lossless clients */
+#define DRAIN_INTERVAL_MS 10
+static uv_timer_t drain_timer;
+
 
 int
 listen_on_abstract_socket(const char *name)
@@ -239,14 +304,48 @@ update_client_names(struct ut_client *client)
     return true;
 }
 
+static void
+client_add_ancillary_data(struct ut_client *client,
+                          int fd, uint8_t *buf, size_t buf_size)
+{
+    struct ut_ancillary_buffer *ancillary = xmalloc0(sizeof(*ancillary));
+
+    ancillary->fd = fd;
+    ancillary->buf = buf;
+    ancillary->buf_size = buf_size;
+
+    dbg("added ancillary data for client = %p/tid=%d, size = %zu bytes\n",
+        client, client->info->tid, ancillary->buf_size);
+
+    gputop_list_insert(client->ancillary_buffers.prev, &ancillary->link);
+}
+
+static bool
+client_add_ancillary_buffer(struct ut_client *client, int ancillary_data_fd)
+{
+    struct stat sb;
+    void *buf;
+
+    fstat(ancillary_data_fd, &sb);
+    dbg("ancillary buffer size = %d\n", (int)sb.st_size);
+
+    buf = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, ancillary_data_fd, 0);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to mmap client's ancillary data buffer: %m\n");
+        close(ancillary_data_fd);
+        return false;
+    }
+
+    client_add_ancillary_data(client, ancillary_data_fd, buf, sb.st_size);
+
+    return true;
+}
+
 static void
 client_fd_cb(uv_poll_t *handle, int status, int events)
 {
     struct ut_client *client = handle->data;
-    struct ut_ancillary_buffer *ancillary;
     int ancillary_data_fd;
-    struct stat sb;
-    void *buf;
 
     fprintf(stderr, "client_fd_cb: client=%p\n", client);
     if (!client->info) {
@@ -268,43 +367,100 @@ client_fd_cb(uv_poll_t *handle, int status, int events)
         return;
     }
 
-    fstat(ancillary_data_fd, &sb);
-    dbg("ancillary buffer size = %d\n", (int)sb.st_size);
+    if (!client_add_ancillary_buffer(client, ancillary_data_fd))
+        sever_client(client);
+}
 
-    ancillary = xmalloc0(sizeof(*ancillary));
-    ancillary->fd = ancillary_data_fd;
+/* Adds a new client to all_clients for a circular buffer that's prefixed
+ * with an info page
+ */
+static struct ut_client *
+create_client_for_buffer(uint8_t *buf, size_t size, size_t page_size)
+{
+    struct ut_client *client = xmalloc0(sizeof(*client));
 
-    buf = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, ancillary_data_fd, 0);
-    if (!buf) {
-        fprintf(stderr, "Failed to mmap client's ancillary data buffer: %m\n");
-        free(ancillary);
-        close(ancillary_data_fd);
+    client->fd = -1;
 
-        sever_client(client);
-        return;
+    client->info = (void *)buf;
+    client->rings[0].info = (void *)buf;
+    client->rings[0].buf = (void *)(buf + page_size);
+    client->rings[0].buf_size = size - page_size;
+    client->n_rings = 1;
+
+    if (client->info->priority_ring_offset) {
+        size_t offset = client->info->priority_ring_offset;
+        size_t priority_size = client->info->priority_ring_size;
+
+        if (offset < page_size || priority_size <= page_size ||
+            offset + priority_size > size) {
+            fprintf(stderr, "Spurious client priority ring layout\n");
+        } else {
+            client->rings[0].buf_size = offset - page_size;
+            client->rings[1].info = (void *)(buf + offset);
+            client->rings[1].buf = (void *)(buf + offset + page_size);
+            client->rings[1].buf_size = priority_size - page_size;
+            client->n_rings = 2;
+        }
+    }
+
+    dbg("client thread id = %d\n", client->info->tid);
+
+    gputop_list_init(&client->ancillary_buffers);
+
+    array_append_val(&all_clients, struct ut_client *, client);
+
+    return client;
+}
+
+/* Maps a client's circular buffer (which may be a memfd or a file in
+ * flight-recorder mode) and adds a new client to all_clients
+ */
+static struct ut_client *
+create_client(int circular_buf_fd)
+{
+    struct ut_client *client;
+    uint8_t *buf;
+    struct stat sb;
+    bool writable;
+    size_t page_size = sysconf(_SC_PAGE_SIZE);
+
+    fstat(circular_buf_fd, &sb);
+    dbg("circular buffer size = %llu\n", (unsigned long long)sb.st_size);
+
+    if (sb.st_size <= page_size) {
+        fprintf(stderr, "Spurious client circular buffer size\n");
+        close(circular_buf_fd);
+        return NULL;
     }
 
-    ancillary->buf = (void *)buf;
-    ancillary->buf_size = sb.st_size;
+    /* Note: we only need write access for lossless clients and the files
+     * of a flight recorder may be read-only
+     */
+    writable = (fcntl(circular_buf_fd, F_GETFL) & O_ACCMODE) == O_RDWR;
 
-    dbg("received ancillary data fd for client = %p/tid=%d, size = %d bytes\n",
-        client, client->info->tid, ancillary->buf_size);
+    buf = mmap(NULL, sb.st_size,
+               writable ? PROT_READ|PROT_WRITE : PROT_READ,
+               MAP_SHARED, circular_buf_fd, 0);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to mmap client's circular buffer of samples: %m\n");
+        close(circular_buf_fd);
+        return NULL;
+    }
 
-    gputop_list_insert(client->ancillary_buffers.prev, &ancillary->link);
+    client = create_client_for_buffer(buf, sb.st_size, page_size);
+    client->writable = writable;
+
+    return client;
 }
 
 static void
 connect_new_client(void)
 {
     struct sockaddr_un addr;
-    socklen_t len;
+    socklen_t len = sizeof(addr);
     int client_fd = -1;
     int circular_buf_fd;
-    uint8_t *buf;
-    struct stat sb;
-    struct ut_info_page *info;
     struct ut_client *client;
-    size_t page_size = sysconf(_SC_PAGE_SIZE);
     uv_loop_t *loop = uv_default_loop();
 
     fprintf(stderr, "New client\n");
@@ -322,34 +478,111 @@ connect_new_client(void)
         return;
     }
 
-    fstat(circular_buf_fd, &sb);
-    dbg("circular buffer size = %d\n", (int)sb.st_size);
-
-    client = xmalloc0(sizeof(*client));
-    client->fd = client_fd;
-
-    buf = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, circular_buf_fd, 0);
-    if (!buf) {
-        fprintf(stderr, "Failed to mmap client's circular buffer of samples: %m\n");
-        free(client);
-        close(circular_buf_fd);
+    client = create_client(circular_buf_fd);
+    if (!client) {
         close(client_fd);
         return;
     }
 
-    client->info = (void *)buf;
-    client->buf = (void *)(buf + page_size);
-    client->buf_size = sb.st_size - page_size;
-
-    dbg("client thread id = %d\n", client->info->tid);
+    client->fd = client_fd;
 
-    gputop_list_init(&client->ancillary_buffers);
+    if (category_mask_set && client->writable)
+        client->info->category_mask = category_mask;
 
     client->poll.data = client;
     uv_poll_init(loop, &client->poll, client_fd);
     uv_poll_start(&client->poll, UV_READABLE, client_fd_cb);
+}
 
-    array_append_val(&all_clients, struct ut_client *, client);
+static struct ut_client *
+find_flight_recorder_client(int tid, uint32_t serial)
+{
+    for (int i = 0; i < all_clients.len; i++) {
+        struct ut_client *client = array_value_at(&all_clients, struct ut_client *, i);
+
+        if (client->info->tid == tid && client->serial == serial)
+            return client;
+    }
+
+    return NULL;
+}
+
+/* Instead of waiting for clients to connect, attach to the file-backed
+ * buffers of a process running in serverless, flight-recorder mode (which
+ * may have since crashed or exited) as described by its index file.
+ */
+static bool
+attach_flight_recorder(const char *index_filename)
+{
+    char dir[PATH_MAX];
+    char *sep;
+    struct ut_index_entry entry;
+    int index_fd;
+
+    strncpy(dir, index_filename, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    sep = strrchr(dir, '/');
+    if (sep)
+        *sep = '\0';
+    else
+        strcpy(dir, ".");
+
+    index_fd = open(index_filename, O_RDONLY|O_CLOEXEC);
+    if (index_fd < 0) {
+        fprintf(stderr, "Failed to open flight recorder index %s: %m\n",
+                index_filename);
+        return false;
+    }
+
+    while (read(index_fd, &entry, sizeof(entry)) == sizeof(entry)) {
+        char filename[PATH_MAX];
+        struct ut_client *client;
+        int fd;
+
+        entry.filename[sizeof(entry.filename) - 1] = '\0';
+        snprintf(filename, sizeof(filename), "%s/%s", dir, entry.filename);
+
+        fd = open(filename, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open %s: %m\n", filename);
+            continue;
+        }
+
+        switch (entry.type) {
+        case UT_INDEX_CIRCULAR_BUFFER:
+            client = create_client(fd);
+            if (client) {
+                client->serial = entry.serial;
+
+                /* Names are updated at capture time if still running */
+                snprintf(client->process_name, sizeof(client->process_name),
+                         "%d", client->info->pid);
+                snprintf(client->thread_name, sizeof(client->thread_name),
+                         "%d", client->info->tid);
+            }
+            break;
+        case UT_INDEX_ANCILLARY:
+            client = find_flight_recorder_client(entry.tid, entry.serial);
+            if (client)
+                client_add_ancillary_buffer(client, fd);
+            else {
+                fprintf(stderr, "Spurious ancillary buffer %s for unknown "
+                        "thread %d (serial %u)\n", filename, entry.tid,
+                        entry.serial);
+                close(fd);
+            }
+            break;
+        default:
+            fprintf(stderr, "Unknown flight recorder index entry type %u\n",
+                    entry.type);
+            close(fd);
+            break;
+        }
+    }
+
+    close(index_fd);
+
+    return all_clients.len > 0;
 }
 
 static void
@@ -372,18 +605,224 @@ sort_clients_cb(const void *v0, const void *v1)
         return c1->info->pid - c0->info->pid;
 }
 
+/* Estimates a percentile from a histogram as the middle of the bucket it
+ * falls in, clamped to the exact min/max values
+ */
+static uint64_t
+histogram_percentile(struct ut_shared_task_histogram *histogram,
+                     double percentile)
+{
+    double exact_target = histogram->count * percentile / 100.0;
+    uint64_t target = exact_target;
+    uint64_t n = 0;
+
+    if (target < exact_target || target == 0)
+        target++;
+
+    for (int i = 0; i < UT_HISTOGRAM_N_BUCKETS; i++) {
+        n += histogram->buckets[i];
+        if (n >= target) {
+            uint64_t start = ut_histogram_bucket_start(i);
+            uint64_t end = (i + 1 < UT_HISTOGRAM_N_BUCKETS ?
+                            ut_histogram_bucket_start(i + 1) :
+                            histogram->max_ns + 1);
+            uint64_t value = start + (end - start - 1) / 2;
+
+            return MIN(MAX(value, histogram->min_ns), histogram->max_ns);
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+/* Adds n instances of a value, where n > 1 accounts for sampled instances */
+static void
+histogram_add(struct ut_shared_task_histogram *histogram,
+              uint64_t value,
+              uint64_t n)
+{
+    histogram->count += n;
+    histogram->total_ns += value * n;
+    histogram->min_ns = MIN(histogram->min_ns, value);
+    histogram->max_ns = MAX(histogram->max_ns, value);
+    histogram->buckets[ut_histogram_bucket_index(value)] += n;
+}
+
+/* Appends the count of a histogram, and the total, mean, min, percentiles
+ * and max of its values (in ms) if it has any, to a JSON object
+ */
+static void
+_js_append_histogram_summary(JsonNode *js_object,
+                             struct ut_shared_task_histogram *histogram)
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    static const char *percentile_names[] = {
+        "p50_ms", "p90_ms", "p99_ms", "p99.9_ms"
+    };
+
+    json_append_member(js_object, "count", json_mknumber(histogram->count));
+    if (!histogram->count)
+        return;
+
+    json_append_member(js_object, "total_ms",
+                       json_mknumber(histogram->total_ns / 1e6));
+    json_append_member(js_object, "mean_ms",
+                       json_mknumber(histogram->total_ns / 1e6 /
+                                     histogram->count));
+    json_append_member(js_object, "min_ms",
+                       json_mknumber(histogram->min_ns / 1e6));
+
+    for (int i = 0; i < ARRAY_SIZE(percentiles); i++) {
+        uint64_t value = histogram_percentile(histogram, percentiles[i]);
+
+        json_append_member(js_object, percentile_names[i],
+                           json_mknumber(value / 1e6));
+    }
+
+    json_append_member(js_object, "max_ms",
+                       json_mknumber(histogram->max_ns / 1e6));
+}
+
+static JsonNode *
+_js_histogram_summary(struct ut_shared_task_histogram *histogram)
+{
+    JsonNode *js_summary = json_mkobject();
+
+    _js_append_histogram_summary(js_summary, histogram);
+
+    return js_summary;
+}
+
+static JsonNode *
+_js_task_histogram(struct ut_shared_task_histogram *histogram)
+{
+    JsonNode *js_record = json_mkobject();
+
+    json_append_member(js_record, "type", json_mkstring("task-histogram"));
+    json_append_member(js_record, "task",
+                       json_mknumber(histogram->task_desc_idx));
+    _js_append_histogram_summary(js_record, histogram);
+
+    return js_record;
+}
+
+/* Collects pointers to the client's task description records, indexed by
+ * task_desc index
+ */
+static void
+client_get_task_descs(struct ut_client *client, struct array *task_descs)
+{
+    struct ut_ancillary_buffer *ancillary;
+
+    array_init(task_descs, sizeof(struct ut_shared_task_desc *), 64);
+
+    gputop_list_for_each(ancillary, &client->ancillary_buffers, link) {
+        for (size_t i = 0; i < ancillary->buf_size; ) {
+            struct ut_ancillary_record *header = (void *)(ancillary->buf + i);
+            struct ut_shared_task_desc *desc = (void *)(header + 1);
+            int len = task_descs->len;
+
+            if (!ut_load_acquire(&header->size))
+                break;
+            i += header->size;
+
+            if (header->type != UT_ANCILLARY_TASK_DESC)
+                continue;
+
+            if (desc->idx >= len) {
+                array_set_len(task_descs, desc->idx + 1);
+                memset(task_descs->bytes + len * task_descs->elem_size, 0,
+                       (task_descs->len - len) * task_descs->elem_size);
+            }
+            *array_element_at(task_descs, struct ut_shared_task_desc *,
+                              desc->idx) = desc;
+        }
+    }
+}
+
+/* Returns the name of a task, or "unknown" if it's not described */
+static const char *
+find_task_name(struct array *task_descs, int task_desc_idx)
+{
+    struct ut_shared_task_desc *desc = NULL;
+
+    if (task_desc_idx < task_descs->len)
+        desc = array_value_at(task_descs, struct ut_shared_task_desc *,
+                              task_desc_idx);
+
+    return desc ? desc->name : "unknown";
+}
+
+/* Collects pointers to the client's task arg names records (see
+ * ut_pop_task_args()), indexed by task_desc index
+ */
+static void
+client_get_task_arg_names(struct ut_client *client, struct array *arg_names)
+{
+    struct ut_ancillary_buffer *ancillary;
+
+    array_init(arg_names, sizeof(struct ut_shared_task_arg_names *), 64);
+
+    gputop_list_for_each(ancillary, &client->ancillary_buffers, link) {
+        for (size_t i = 0; i < ancillary->buf_size; ) {
+            struct ut_ancillary_record *header = (void *)(ancillary->buf + i);
+            struct ut_shared_task_arg_names *names = (void *)(header + 1);
+            int len = arg_names->len;
+
+            if (!ut_load_acquire(&header->size))
+                break;
+            i += header->size;
+
+            if (header->type != UT_ANCILLARY_TASK_ARG_NAMES)
+                continue;
+
+            if (names->task_desc_idx >= len) {
+                array_set_len(arg_names, names->task_desc_idx + 1);
+                memset(arg_names->bytes + len * arg_names->elem_size, 0,
+                       (arg_names->len - len) * arg_names->elem_size);
+            }
+            *array_element_at(arg_names, struct ut_shared_task_arg_names *,
+                              names->task_desc_idx) = names;
+        }
+    }
+}
+
+/* Returns the index of the recorded value with the given name for a task, or
+ * -1 if there's no such value
+ */
+static int
+find_task_arg(struct array *arg_names, int task_desc_idx, const char *name)
+{
+    struct ut_shared_task_arg_names *names;
+
+    if (task_desc_idx >= arg_names->len)
+        return -1;
+
+    names = array_value_at(arg_names, struct ut_shared_task_arg_names *,
+                           task_desc_idx);
+    if (!names)
+        return -1;
+
+    for (int i = 0; i < names->n_args; i++) {
+        if (strncmp(names->names[i], name, UT_TASK_ARG_NAME_LEN) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
 static void
 _js_client_append_ancillary_data(JsonNode *js_client, struct ut_client *client)
 {
     JsonNode *js_ancillary = json_mkarray();
     struct ut_ancillary_buffer *ancillary;
-    int task_desc_index = 1; /* index 0 reserved */
 
     gputop_list_for_each(ancillary, &client->ancillary_buffers, link) {
-        for (int i = 0; i < ancillary->buf_size; ) {
+        for (size_t i = 0; i < ancillary->buf_size; ) {
             struct ut_ancillary_record *header = (void *)(ancillary->buf + i);
 
-            if (!header->type)
+            /* The size is written last, with release semantics */
+            if (!ut_load_acquire(&header->size))
                 break;
 
             switch (header->type) {
@@ -392,11 +831,60 @@ _js_client_append_ancillary_data(JsonNode *js_client, struct ut_client *client)
                     JsonNode *js_record = json_mkobject();
                     JsonNode *js_record_type = json_mkstring("task-desc");
                     JsonNode *js_task_name = json_mkstring(desc->name);
-                    JsonNode *js_task_id = json_mknumber(task_desc_index++);
+                    JsonNode *js_task_id = json_mknumber(desc->idx);
+                    JsonNode *js_category =
+                        json_mkstring(ut_get_category_name(desc->category));
+                    JsonNode *js_wait_reason =
+                        json_mkstring(ut_get_wait_reason_name(desc->wait_reason));
 
                     json_append_member(js_record, "type", js_record_type);
                     json_append_member(js_record, "name", js_task_name);
                     json_append_member(js_record, "index", js_task_id);
+                    json_append_member(js_record, "category", js_category);
+                    json_append_member(js_record, "wait_reason",
+                                       js_wait_reason);
+                    json_append_element(js_ancillary, js_record);
+                    break;
+                }
+                case UT_ANCILLARY_TASK_HISTOGRAM: {
+                    struct ut_shared_task_histogram *histogram =
+                        (void *)(header + 1);
+
+                    json_append_element(js_ancillary,
+                                        _js_task_histogram(histogram));
+                    break;
+                }
+                case UT_ANCILLARY_FD_NAME: {
+                    struct ut_shared_fd_name *fd_name = (void *)(header + 1);
+                    JsonNode *js_record = json_mkobject();
+
+                    json_append_member(js_record, "type",
+                                       json_mkstring("fd-name"));
+                    json_append_member(js_record, "fd",
+                                       json_mknumber(fd_name->fd));
+                    json_append_member(js_record, "name",
+                                       fd_name->name[0] ?
+                                       json_mkstring(fd_name->name) :
+                                       json_mknull());
+                    json_append_element(js_ancillary, js_record);
+                    break;
+                }
+                case UT_ANCILLARY_TASK_ARG_NAMES: {
+                    struct ut_shared_task_arg_names *arg_names =
+                        (void *)(header + 1);
+                    JsonNode *js_record = json_mkobject();
+                    JsonNode *js_names = json_mkarray();
+
+                    for (int j = 0; j < arg_names->n_args; j++) {
+                        json_append_element(js_names,
+                                            json_mkstring(arg_names->names[j]));
+                    }
+
+                    json_append_member(js_record, "type",
+                                       json_mkstring("task-arg-names"));
+                    json_append_member(js_record, "task",
+                                       json_mknumber(arg_names->task_desc_idx));
+                    json_append_member(js_record, "names", js_names);
                     json_append_element(js_ancillary, js_record);
                     break;
                 }
@@ -409,74 +897,2550 @@ _js_client_append_ancillary_data(JsonNode *js_client, struct ut_client *client)
     json_append_member(js_client, "ancillary", js_ancillary);
 }
 
+/* Reads any new samples from a ring in lossless mode and then advances the
+ * client's read cursor, waking the client up if it's waiting for space.
+ *
+ * If the client timed out waiting for us and fell back to overwrite mode
+ * then we can only safely read the rest of its samples while it's stopped,
+ * skipping any that it has already overwritten.
+ */
 static void
-_js_client_append_samples(JsonNode *js_client,
-                          struct ut_client *client,
-                          uint64_t *epoch)
+ring_drain(struct ut_ring *ring, bool stopped)
 {
-    uint32_t n_samples = client->info->n_samples_written;
-    uint32_t max_samples = client->buf_size / client->info->sample_size;
-    struct ut_sample *samples = (void *)client->buf;
-    JsonNode *js_samples;
-
-    uint32_t tail;
-
-    if (n_samples >= max_samples) {
-        /* XXX: +1 to skip the oldest sample which client might be in
-         * the middle of overwriting... */
-        tail = n_samples - max_samples + 1;
-        tail %= max_samples;
-        n_samples %= max_samples;
-    } else
-        tail = 0;
+    volatile struct ut_info_page *info = ring->info;
+    uint64_t max_samples = ring->buf_size / info->sample_size;
+    uint32_t n_unsafe = MAX(info->commit_batch, 1);
+    bool lossless = info->ring_mode == UT_RING_LOSSLESS;
+    uint64_t n_written;
 
-    js_samples = json_mkarray();
+    if (!lossless && (!ring->drained.elem_size || !stopped))
+        return;
 
-    for (int i = 0; i < n_samples; i++) {
-        uint32_t pos = (tail + i) % max_samples;
-        struct ut_sample *sample = &samples[pos];
-        JsonNode *js_sample, *js_type, *js_cpu, *js_stack_depth, *js_task;
-        JsonNode *js_timestamp;
-        uint64_t progress_ns;
-        double progress_sec;
+    if (!ring->drained.elem_size)
+        array_init(&ring->drained, sizeof(struct ut_sample), 4096);
 
-        if (*epoch == 0)
-            *epoch = sample->timestamp;
+    n_written = ut_load_acquire(&info->n_samples_written);
+    if (n_written == ring->drain_pos)
+        return;
 
-        if (sample->timestamp < *epoch)
-            continue;
+    if (!lossless && n_written - ring->drain_pos > max_samples - n_unsafe)
+        ring->drain_pos = n_written - max_samples + n_unsafe;
 
-        js_sample = json_mkobject();
+    for (uint64_t i = ring->drain_pos; i < n_written; i++) {
+        struct ut_sample *sample = (void *)&ring->buf[i % max_samples];
 
-        progress_ns = sample->timestamp - *epoch;
-        progress_sec = (double)progress_ns / 1000000000.0;
+        if (ring->drained.len < drain_limit)
+            array_append_val_at(&ring->drained, struct ut_sample, sample);
+        else {
+            memcpy(array_element_at(&ring->drained, struct ut_sample,
+                                    ring->n_drained % drain_limit),
+                   sample, sizeof(*sample));
+            ring->n_drain_discarded++;
+        }
+        ring->n_drained++;
+    }
+    ring->drain_pos = n_written;
 
-        js_type = json_mknumber(sample->type);
-        js_timestamp = json_mknumber(progress_sec);
-        js_cpu = json_mknumber(sample->cpu);
-        js_stack_depth = json_mknumber(sample->stack_pointer);
-        js_task = json_mknumber(sample->task_desc_index);
+    if (!lossless)
+        return;
 
-        json_append_member(js_sample, "type", js_type);
-        json_append_member(js_sample, "timestamp", js_timestamp);
-        json_append_member(js_sample, "cpu", js_cpu);
-        json_append_member(js_sample, "stack_depth", js_stack_depth);
-        json_append_member(js_sample, "task", js_task);
+    /* Paired with the client checking n_samples_read before overwriting a
+     * sample and checking for new space after incrementing n_waiters
+     */
+    __atomic_store_n(&info->n_samples_read, n_written, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&info->read_futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&info->n_waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &info->read_futex, FUTEX_WAKE, INT_MAX,
+                NULL, NULL, 0);
+}
 
-        json_append_element(js_samples, js_sample);
-    }
+static void
+client_drain(struct ut_client *client, bool stopped)
+{
+    if (!client->writable)
+        return;
 
-    json_append_member(js_client, "samples", js_samples);
+    for (int i = 0; i < client->n_rings; i++)
+        ring_drain(&client->rings[i], stopped);
 }
 
 static void
-capture_data(void)
+drain_timer_cb(uv_timer_t *timer)
 {
-    struct ut_client *stopped_clients[all_clients.len];
+    for (int i = 0; i < all_clients.len; i++)
+        client_drain(array_value_at(&all_clients, struct ut_client *, i),
+                     false);
+}
+
+/* Checkpoints of a deep task stack are split over multiple consecutive
+ * samples and we only output a checkpoint once we've seen all of its
+ * entries, since the first samples may have been overwritten.
+ */
+struct checkpoint_state {
+    JsonNode *js_checkpoint;
+    JsonNode *js_stack;
+    int n_entries;
+};
+
+/* For iterating the samples of a ring that are safe to read, which for a
+ * lossless ring are the samples we've drained so far and otherwise are in
+ * the circular buffer, starting from the oldest sample.
+ */
+struct ring_cursor {
+    struct ut_sample *samples;
+    uint64_t max_samples;
+    uint64_t pos;
+    uint64_t n_remaining;
+
+    /* The timestamp of the most recent sample with a timestamp, used to
+     * order samples without one (e.g. backtraces) when merging rings
+     */
+    uint64_t timestamp;
+};
+
+/* Determines the position of the oldest sample in the ring (or in the
+ * samples drained from it in lossless mode) that can be trusted, and how
+ * many samples can be read from there.
+ */
+static void
+ring_cursor_init(struct ring_cursor *cursor, struct ut_ring *ring)
+{
+    uint64_t n_samples = ut_load_acquire(&ring->info->n_samples_written);
+    uint64_t max_samples = ring->buf_size / ring->info->sample_size;
+    uint32_t n_unsafe = MAX(ring->info->commit_batch, 1);
+
+    memset(cursor, 0, sizeof(*cursor));
+
+    if (ring->drained.elem_size) {
+        cursor->samples = ring->drained.data;
+        cursor->max_samples = ring->drained.len;
+        cursor->n_remaining = ring->drained.len;
+        if (ring->n_drain_discarded)
+            cursor->pos = ring->n_drained % ring->drained.len;
+        return;
+    }
+
+    cursor->samples = (void *)ring->buf;
+    cursor->max_samples = max_samples;
+
+    if (n_samples >= max_samples) {
+        /* XXX: skip the oldest samples which client might be in the middle
+         * of overwriting... */
+        cursor->pos = (n_samples - max_samples + n_unsafe) % max_samples;
+        cursor->n_remaining = max_samples - n_unsafe;
+    } else
+        cursor->n_remaining = n_samples;
+}
+
+static struct ut_sample *
+ring_cursor_get(struct ring_cursor *cursor)
+{
+    return cursor->n_remaining ? &cursor->samples[cursor->pos] : NULL;
+}
+
+/* Note: not all sample types have a timestamp, in which case this returns
+ * 0
+ */
+static uint64_t
+_sample_timestamp(struct ut_sample *sample)
+{
+    switch (sample->type) {
+    case UT_SAMPLE_TASK_PUSH:
+    case UT_SAMPLE_TASK_POP:
+        return sample->timestamp;
+    case UT_SAMPLE_TASK_CHECKPOINT:
+        return sample->checkpoint.timestamp;
+    case UT_SAMPLE_LOCK_HOLD:
+        return sample->lock_hold.timestamp;
+    default:
+        return 0;
+    }
+}
+
+static void
+ring_cursor_next(struct ring_cursor *cursor)
+{
+    uint64_t timestamp = _sample_timestamp(ring_cursor_get(cursor));
+
+    if (timestamp)
+        cursor->timestamp = timestamp;
+
+    cursor->n_remaining--;
+    if (++cursor->pos >= cursor->max_samples)
+        cursor->pos = 0;
+}
+
+/* Returns the key for ordering the current sample of a cursor relative to
+ * other rings
+ */
+static uint64_t
+ring_cursor_sort_key(struct ring_cursor *cursor)
+{
+    uint64_t timestamp = _sample_timestamp(ring_cursor_get(cursor));
+
+    return timestamp ? timestamp : cursor->timestamp;
+}
+
+static uint64_t
+_ring_oldest_timestamp(struct ut_ring *ring)
+{
+    struct ring_cursor cursor;
+    struct ut_sample *sample;
+
+    ring_cursor_init(&cursor, ring);
+
+    for (; (sample = ring_cursor_get(&cursor)); ring_cursor_next(&cursor)) {
+        uint64_t timestamp = _sample_timestamp(sample);
+        if (timestamp)
+            return timestamp;
+    }
+
+    return 0;
+}
+
+static uint64_t
+_client_oldest_timestamp(struct ut_client *client)
+{
+    uint64_t oldest = 0;
+
+    for (int i = 0; i < client->n_rings; i++) {
+        uint64_t timestamp = _ring_oldest_timestamp(&client->rings[i]);
+
+        if (timestamp && (!oldest || timestamp < oldest))
+            oldest = timestamp;
+    }
+
+    return oldest;
+}
+
+static void
+_js_client_append_lost_data_stats(JsonNode *js_client,
+                                  struct ut_client *client,
+                                  struct ut_ring *ring,
+                                  const char *name)
+{
+    JsonNode *js_lost = json_mkobject();
+    uint64_t max_samples = ring->buf_size / ring->info->sample_size;
+    uint64_t n_written = ring->info->n_samples_written;
+    uint64_t n_overwritten = ring->info->n_samples_overwritten;
+    uint64_t n_dropped = ring->info->n_samples_dropped;
+    uint32_t n_ancillary_failures = ring->info->n_ancillary_alloc_failures;
+    uint64_t n_stalls = ring->info->n_stalls;
+    uint64_t stall_ns = ring->info->stall_ns;
+    uint32_t n_timeouts = ring->info->n_lossless_timeouts;
+    uint64_t n_discarded = ring->n_drain_discarded;
+
+    json_append_member(js_lost, "written", json_mknumber(n_written));
+    json_append_member(js_lost, "overwritten", json_mknumber(n_overwritten));
+    json_append_member(js_lost, "dropped", json_mknumber(n_dropped));
+    json_append_member(js_lost, "ancillary_alloc_failures",
+                       json_mknumber(n_ancillary_failures));
+    json_append_member(js_lost, "ring_capacity", json_mknumber(max_samples));
+    json_append_member(js_lost, "lossless_stalls", json_mknumber(n_stalls));
+    json_append_member(js_lost, "lossless_stall_ms",
+                       json_mknumber((double)stall_ns / 1000000.0));
+    json_append_member(js_lost, "lossless_timeouts", json_mknumber(n_timeouts));
+    json_append_member(js_lost, "drain_discarded", json_mknumber(n_discarded));
+
+    json_append_member(js_client, name, js_lost);
+
+    if (n_overwritten || n_dropped || n_ancillary_failures) {
+        fprintf(stderr, "%s:%s: %s data: %llu samples overwritten, "
+                "%llu samples dropped, %u ancillary allocation failures "
+                "(ring capacity = %llu samples)\n",
+                client->process_name, client->thread_name, name,
+                (unsigned long long)n_overwritten,
+                (unsigned long long)n_dropped,
+                n_ancillary_failures,
+                (unsigned long long)max_samples);
+    }
+
+    if (n_stalls) {
+        fprintf(stderr, "%s:%s: %s: stalled %llu times waiting for space "
+                "(total = %.3f ms)\n",
+                client->process_name, client->thread_name, name,
+                (unsigned long long)n_stalls,
+                (double)stall_ns / 1000000.0);
+    }
+
+    if (n_timeouts) {
+        fprintf(stderr, "%s:%s: %s: timed out waiting for space and fell "
+                "back to overwriting old samples\n",
+                client->process_name, client->thread_name, name);
+    }
+
+    if (n_discarded) {
+        fprintf(stderr, "%s:%s: %s: discarded the oldest %llu drained "
+                "samples (drain limit = %d samples)\n",
+                client->process_name, client->thread_name, name,
+                (unsigned long long)n_discarded, drain_limit);
+    }
+}
+
+/* Reports libut's own overhead on a thread, as measured by the client */
+static void
+_js_client_append_overhead_stats(JsonNode *js_client, struct ut_client *client)
+{
+    volatile struct ut_info_page *info = client->info;
+    JsonNode *js_overhead = json_mkobject();
+    double event_ms = info->event_overhead_ns / 1000000.0;
+    double registration_ms = info->registration_overhead_ns / 1000000.0;
+    double allocation_ms = info->allocation_overhead_ns / 1000000.0;
+    double total_ms = event_ms + registration_ms + allocation_ms;
+
+    json_append_member(js_overhead, "sample_period",
+                       json_mknumber(info->overhead_sample_period));
+    json_append_member(js_overhead, "timed_events",
+                       json_mknumber(info->n_timed_events));
+    json_append_member(js_overhead, "event_ms", json_mknumber(event_ms));
+    json_append_member(js_overhead, "registrations",
+                       json_mknumber(info->n_registrations));
+    json_append_member(js_overhead, "registration_ms",
+                       json_mknumber(registration_ms));
+    json_append_member(js_overhead, "allocations",
+                       json_mknumber(info->n_allocations));
+    json_append_member(js_overhead, "allocation_ms",
+                       json_mknumber(allocation_ms));
+    json_append_member(js_overhead, "total_ms", json_mknumber(total_ms));
+
+    json_append_member(js_client, "overhead", js_overhead);
+
+    if (verbose) {
+        fprintf(stderr, "%s:%s: libut overhead: %.3f ms (events ~%.3f ms, "
+                "%llu registrations %.3f ms, %llu allocations %.3f ms)\n",
+                client->process_name, client->thread_name,
+                total_ms,
+                event_ms,
+                (unsigned long long)info->n_registrations,
+                registration_ms,
+                (unsigned long long)info->n_allocations,
+                allocation_ms);
+    }
+}
+
+static JsonNode *
+_js_task_sample(struct ut_sample *sample, uint64_t epoch)
+{
+    JsonNode *js_sample = json_mkobject();
+    uint64_t progress_ns = sample->timestamp - epoch;
+    double progress_sec = (double)progress_ns / 1000000000.0;
+
+    json_append_member(js_sample, "type", json_mknumber(sample->type));
+    json_append_member(js_sample, "timestamp", json_mknumber(progress_sec));
+    json_append_member(js_sample, "cpu", json_mknumber(sample->cpu));
+    json_append_member(js_sample, "stack_depth",
+                       json_mknumber(sample->stack_pointer));
+    json_append_member(js_sample, "task",
+                       json_mknumber(sample->task_desc_index));
+    if (sample->period_log2) {
+        json_append_member(js_sample, "period",
+                           json_mknumber(1ULL << sample->period_log2));
+    }
+
+    return js_sample;
+}
+
+static void
+_js_append_checkpoint_sample(JsonNode *js_samples,
+                             struct checkpoint_state *state,
+                             struct ut_sample *sample,
+                             uint64_t epoch)
+{
+    if (state->js_checkpoint &&
+        sample->checkpoint.first_entry != state->n_entries) {
+        json_delete(state->js_checkpoint);
+        state->js_checkpoint = NULL;
+    }
+
+    if (!state->js_checkpoint) {
+        double progress_sec;
+
+        if (sample->checkpoint.first_entry != 0)
+            return;
+
+        progress_sec = (double)(int64_t)(sample->checkpoint.timestamp - epoch) /
+                       1000000000.0;
+        state->js_checkpoint = json_mkobject();
+        state->js_stack = json_mkarray();
+        state->n_entries = 0;
+        json_append_member(state->js_checkpoint, "type",
+                           json_mknumber(sample->type));
+        json_append_member(state->js_checkpoint, "timestamp",
+                           json_mknumber(progress_sec));
+        json_append_member(state->js_checkpoint, "stack", state->js_stack);
+    }
+
+    for (int i = 0; i < sample->checkpoint.n_entries; i++) {
+        JsonNode *js_entry = json_mkobject();
+        uint64_t start = sample->checkpoint.start_times[i];
+
+        json_append_member(js_entry, "task",
+                           json_mknumber(sample->checkpoint.task_desc_indices[i]));
+
+        /* Note: the start time may predate the epoch, or may be unknown if
+         * the push sample had to be dropped
+         */
+        if (start) {
+            double start_sec = (double)(int64_t)(start - epoch) / 1000000000.0;
+            json_append_member(js_entry, "start", json_mknumber(start_sec));
+        } else
+            json_append_member(js_entry, "start", json_mknull());
+
+        json_append_element(state->js_stack, js_entry);
+    }
+    state->n_entries += sample->checkpoint.n_entries;
+
+    if (state->n_entries >= sample->checkpoint.stack_depth) {
+        json_append_element(js_samples, state->js_checkpoint);
+        state->js_checkpoint = NULL;
+    }
+}
+
+typedef void (*sample_cb_t)(struct ut_sample *sample, void *data);
+
+/* Iterates the samples from all of a client's rings, merged in timestamp
+ * order
+ */
+static void
+client_for_each_sample(struct ut_client *client, sample_cb_t cb, void *data)
+{
+    struct ring_cursor cursors[ARRAY_SIZE(client->rings)];
+
+    for (int i = 0; i < client->n_rings; i++)
+        ring_cursor_init(&cursors[i], &client->rings[i]);
+
+    while (true) {
+        struct ring_cursor *next = NULL;
+        uint64_t next_key = 0;
+
+        /* Note: ties go to the main ring, which keeps the samples of a
+         * checkpoint together
+         */
+        for (int i = 0; i < client->n_rings; i++) {
+            uint64_t key;
+
+            if (!ring_cursor_get(&cursors[i]))
+                continue;
+
+            key = ring_cursor_sort_key(&cursors[i]);
+            if (!next || key < next_key) {
+                next = &cursors[i];
+                next_key = key;
+            }
+        }
+        if (!next)
+            break;
+
+        cb(ring_cursor_get(next), data);
+        ring_cursor_next(next);
+    }
+}
+
+/* Note: args is the UT_SAMPLE_TASK_ARGS sample for the task instance, if
+ * any values were recorded via ut_pop_task_args(), or NULL
+ */
+typedef void (*task_cb_t)(struct ut_sample *push,
+                          struct ut_sample *pop,
+                          struct ut_sample *args,
+                          void *data);
+
+/* For pairing up the push and pop samples of each task instance */
+struct task_pairing {
+    struct array stack; /* struct ut_sample * by stack depth */
+    task_cb_t cb;
+    void *data;
+
+    /* The most recently paired task, which is only passed to cb once we
+     * know whether the next sample has its args
+     */
+    struct ut_sample *pending_push;
+    struct ut_sample *pending_pop;
+};
+
+static void
+task_pairing_flush(struct task_pairing *pairing, struct ut_sample *args)
+{
+    if (!pairing->pending_pop)
+        return;
+
+    pairing->cb(pairing->pending_push, pairing->pending_pop, args,
+                pairing->data);
+    pairing->pending_push = NULL;
+    pairing->pending_pop = NULL;
+}
+
+static void
+task_pairing_sample_cb(struct ut_sample *sample, void *data)
+{
+    struct task_pairing *pairing = data;
+    struct array *stack = &pairing->stack;
+    int depth = sample->stack_pointer;
+    int len = stack->len;
+
+    if (sample->type == UT_SAMPLE_TASK_ARGS) {
+        if (pairing->pending_pop &&
+            pairing->pending_pop->task_desc_index ==
+            sample->args.task_desc_index)
+            task_pairing_flush(pairing, sample);
+        return;
+    }
+
+    task_pairing_flush(pairing, NULL);
+
+    switch (sample->type) {
+    case UT_SAMPLE_TASK_PUSH:
+        array_set_len(stack, depth + 1);
+        for (int i = len; i < depth; i++)
+            *array_element_at(stack, struct ut_sample *, i) = NULL;
+        *array_element_at(stack, struct ut_sample *, depth) = sample;
+        break;
+    case UT_SAMPLE_TASK_POP: {
+        struct ut_sample *push;
+
+        /* Note: the stack depth of a pop includes the task being popped */
+        depth--;
+        if (depth < 0 || depth >= len)
+            break;
+
+        push = array_value_at(stack, struct ut_sample *, depth);
+        if (push && push->task_desc_index == sample->task_desc_index) {
+            pairing->pending_push = push;
+            pairing->pending_pop = sample;
+        }
+
+        stack->len = depth;
+        break;
+    }
+    }
+}
+
+/* Calls cb for each task instance that we have both the push and pop
+ * samples for
+ */
+static void
+client_for_each_task(struct ut_client *client, task_cb_t cb, void *data)
+{
+    struct task_pairing pairing = { .cb = cb, .data = data };
+
+    array_init(&pairing.stack, sizeof(struct ut_sample *), 64);
+    client_for_each_sample(client, task_pairing_sample_cb, &pairing);
+    task_pairing_flush(&pairing, NULL);
+    array_free(&pairing.stack);
+}
+
+struct js_samples_state {
+    JsonNode *js_samples;
+    struct checkpoint_state checkpoint;
+    uint64_t epoch;
+
+    struct array arg_names;
+
+    /* The last pop sample we output, for associating args with */
+    JsonNode *js_pop;
+    uint16_t pop_task_desc_index;
+};
+
+static void
+_js_append_task_args(struct js_samples_state *state, struct ut_sample *sample)
+{
+    struct ut_shared_task_arg_names *names = NULL;
+    int task = sample->args.task_desc_index;
+    JsonNode *js_args;
+
+    if (!state->js_pop || state->pop_task_desc_index != task)
+        return;
+
+    if (task < state->arg_names.len) {
+        names = array_value_at(&state->arg_names,
+                               struct ut_shared_task_arg_names *, task);
+    }
+
+    js_args = json_mkobject();
+    for (int i = 0; i < sample->args.n_args && i < UT_MAX_TASK_ARGS; i++) {
+        char unnamed[16];
+        const char *name = unnamed;
+
+        if (names && i < names->n_args)
+            name = names->names[i];
+        else
+            snprintf(unnamed, sizeof(unnamed), "arg%d", i);
+
+        json_append_member(js_args, name,
+                           json_mknumber(sample->args.values[i]));
+    }
+
+    json_append_member(state->js_pop, "args", js_args);
+}
+
+static void
+_js_append_sample_cb(struct ut_sample *sample, void *data)
+{
+    struct js_samples_state *state = data;
+    JsonNode *js_sample;
+
+    if (sample->type == UT_SAMPLE_TASK_ARGS) {
+        _js_append_task_args(state, sample);
+        return;
+    }
+
+    state->js_pop = NULL;
+
+    switch (sample->type) {
+    case UT_SAMPLE_TASK_PUSH:
+    case UT_SAMPLE_TASK_POP:
+        if (sample->timestamp < state->epoch)
+            return;
+        js_sample = _js_task_sample(sample, state->epoch);
+        json_append_element(state->js_samples, js_sample);
+        if (sample->type == UT_SAMPLE_TASK_POP) {
+            state->js_pop = js_sample;
+            state->pop_task_desc_index = sample->task_desc_index;
+        }
+        break;
+    case UT_SAMPLE_TASK_CHECKPOINT:
+        _js_append_checkpoint_sample(state->js_samples, &state->checkpoint,
+                                     sample, state->epoch);
+        break;
+    default:
+        /* TODO: output backtraces */
+        break;
+    }
+}
+
+static void
+_js_client_append_samples(JsonNode *js_client,
+                          struct ut_client *client,
+                          uint64_t epoch)
+{
+    struct js_samples_state state = {
+        .js_samples = json_mkarray(),
+        .epoch = epoch,
+    };
+
+    client_get_task_arg_names(client, &state.arg_names);
+    client_for_each_sample(client, _js_append_sample_cb, &state);
+    array_free(&state.arg_names);
+
+    if (state.checkpoint.js_checkpoint)
+        json_delete(state.checkpoint.js_checkpoint);
+
+    json_append_member(js_client, "samples", state.js_samples);
+}
+
+/* Per-task statistics for the task instances we have samples for, where
+ * counts and durations are scaled up by the period of tasks that were
+ * sampled under an event budget (see UT_EVENT_BUDGET)
+ */
+struct task_stats {
+    uint64_t n_recorded;
+    uint64_t estimated_count;
+    uint64_t estimated_total_ns;
+    uint64_t max_ns;
+};
+
+static void
+task_stats_cb(struct ut_sample *push,
+              struct ut_sample *pop,
+              struct ut_sample *args,
+              void *data)
+{
+    struct array *all_stats = data;
+    struct task_stats *stats;
+    uint64_t period = 1ULL << push->period_log2;
+    uint64_t duration = pop->timestamp - push->timestamp;
+    int len = all_stats->len;
+
+    if (push->task_desc_index >= len) {
+        array_set_len(all_stats, push->task_desc_index + 1);
+        memset(all_stats->bytes + len * all_stats->elem_size, 0,
+               (all_stats->len - len) * all_stats->elem_size);
+    }
+
+    stats = array_element_at(all_stats, struct task_stats,
+                             push->task_desc_index);
+    stats->n_recorded++;
+    stats->estimated_count += period;
+    stats->estimated_total_ns += duration * period;
+    stats->max_ns = MAX(stats->max_ns, duration);
+}
+
+static void
+_js_client_append_task_stats(JsonNode *js_client, struct ut_client *client)
+{
+    JsonNode *js_task_stats = json_mkarray();
+    struct array all_stats;
+
+    array_init(&all_stats, sizeof(struct task_stats), 64);
+
+    client_for_each_task(client, task_stats_cb, &all_stats);
+
+    for (int i = 0; i < all_stats.len; i++) {
+        struct task_stats *stats = array_element_at(&all_stats,
+                                                    struct task_stats, i);
+        JsonNode *js_stats;
+
+        if (!stats->n_recorded)
+            continue;
+
+        js_stats = json_mkobject();
+        json_append_member(js_stats, "task", json_mknumber(i));
+        json_append_member(js_stats, "recorded",
+                           json_mknumber(stats->n_recorded));
+        json_append_member(js_stats, "count",
+                           json_mknumber(stats->estimated_count));
+        json_append_member(js_stats, "total_ms",
+                           json_mknumber(stats->estimated_total_ns / 1e6));
+        json_append_member(js_stats, "max_ms",
+                           json_mknumber(stats->max_ns / 1e6));
+        json_append_element(js_task_stats, js_stats);
+    }
+
+    array_free(&all_stats);
+
+    json_append_member(js_client, "task_stats", js_task_stats);
+}
+
+/* Per file descriptor statistics, for each task that records an "fd" value
+ * via ut_pop_task_args() (see gen_api_wrappers.py), scaled up by the sampling
+ * period like struct task_stats.
+ *
+ * Negative "bytes" or "ret" values are errors (-errno) and a short transfer is
+ * one that returned fewer "bytes" than the requested "size".
+ */
+struct fd_stats {
+    uint64_t n_recorded;
+    uint64_t estimated_count;
+    uint64_t estimated_total_ns;
+    uint64_t estimated_bytes;
+    uint64_t estimated_short;
+    uint64_t estimated_errors;
+
+    /* When the first instance started and the last finished */
+    uint64_t first_ns;
+    uint64_t last_ns;
+};
+
+#define MAX_FD_STATS_FD 65535
+
+struct fd_stats_state {
+    struct array arg_names;
+
+    /* A struct array of struct fd_stats indexed by fd, per task_desc
+     * index
+     */
+    struct array by_task;
+};
+
+static struct fd_stats *
+get_fd_stats(struct fd_stats_state *state, int task_desc_idx, int fd)
+{
+    struct array *by_task = &state->by_task;
+    struct array *by_fd;
+    int len = by_task->len;
+
+    if (task_desc_idx >= len) {
+        array_set_len(by_task, task_desc_idx + 1);
+        memset(by_task->bytes + len * by_task->elem_size, 0,
+               (by_task->len - len) * by_task->elem_size);
+    }
+
+    by_fd = array_element_at(by_task, struct array, task_desc_idx);
+    if (!by_fd->elem_size)
+        array_init(by_fd, sizeof(struct fd_stats), 16);
+
+    len = by_fd->len;
+    if (fd >= len) {
+        array_set_len(by_fd, fd + 1);
+        memset(by_fd->bytes + len * by_fd->elem_size, 0,
+               (by_fd->len - len) * by_fd->elem_size);
+    }
+
+    return array_element_at(by_fd, struct fd_stats, fd);
+}
+
+static void
+fd_stats_cb(struct ut_sample *push,
+            struct ut_sample *pop,
+            struct ut_sample *args,
+            void *data)
+{
+    struct fd_stats_state *state = data;
+    struct array *arg_names = &state->arg_names;
+    int task = push->task_desc_index;
+    uint64_t period = 1ULL << push->period_log2;
+    int fd_idx, size_idx, bytes_idx, ret_idx;
+    struct fd_stats *stats;
+    int64_t fd;
+
+    if (!args)
+        return;
+
+    fd_idx = find_task_arg(arg_names, task, "fd");
+    if (fd_idx < 0 || fd_idx >= args->args.n_args)
+        return;
+
+    fd = args->args.values[fd_idx];
+    if (fd < 0 || fd > MAX_FD_STATS_FD)
+        return;
+
+    stats = get_fd_stats(state, task, fd);
+    if (!stats->n_recorded)
+        stats->first_ns = push->timestamp;
+    stats->last_ns = pop->timestamp;
+    stats->n_recorded++;
+    stats->estimated_count += period;
+    stats->estimated_total_ns += (pop->timestamp - push->timestamp) * period;
+
+    size_idx = find_task_arg(arg_names, task, "size");
+    bytes_idx = find_task_arg(arg_names, task, "bytes");
+    ret_idx = find_task_arg(arg_names, task, "ret");
+
+    if (bytes_idx >= 0 && bytes_idx < args->args.n_args) {
+        int64_t bytes = args->args.values[bytes_idx];
+
+        if (bytes < 0)
+            stats->estimated_errors += period;
+        else {
+            stats->estimated_bytes += bytes * period;
+            if (size_idx >= 0 && size_idx < args->args.n_args &&
+                bytes < args->args.values[size_idx])
+                stats->estimated_short += period;
+        }
+    } else if (ret_idx >= 0 && ret_idx < args->args.n_args) {
+        if (args->args.values[ret_idx] < 0)
+            stats->estimated_errors += period;
+    }
+}
+
+static JsonNode *
+_js_fd_stats(int task, int fd, struct fd_stats *stats)
+{
+    JsonNode *js_stats = json_mkobject();
+    double span_sec = (stats->last_ns - stats->first_ns) / 1e9;
+    double count = stats->estimated_count;
+
+    json_append_member(js_stats, "fd", json_mknumber(fd));
+    json_append_member(js_stats, "task", json_mknumber(task));
+    json_append_member(js_stats, "recorded", json_mknumber(stats->n_recorded));
+    json_append_member(js_stats, "count", json_mknumber(count));
+    json_append_member(js_stats, "total_ms",
+                       json_mknumber(stats->estimated_total_ns / 1e6));
+    json_append_member(js_stats, "span_ms", json_mknumber(span_sec * 1e3));
+    json_append_member(js_stats, "bytes",
+                       json_mknumber(stats->estimated_bytes));
+    json_append_member(js_stats, "mb_per_sec",
+                       json_mknumber(span_sec > 0 ?
+                                     stats->estimated_bytes / 1e6 / span_sec :
+                                     0));
+    json_append_member(js_stats, "short",
+                       json_mknumber(stats->estimated_short));
+    json_append_member(js_stats, "short_rate",
+                       json_mknumber(stats->estimated_short / count));
+    json_append_member(js_stats, "errors",
+                       json_mknumber(stats->estimated_errors));
+    json_append_member(js_stats, "error_rate",
+                       json_mknumber(stats->estimated_errors / count));
+
+    return js_stats;
+}
+
+static void
+_js_client_append_fd_stats(JsonNode *js_client, struct ut_client *client)
+{
+    JsonNode *js_fd_stats = json_mkarray();
+    struct fd_stats_state state;
+
+    client_get_task_arg_names(client, &state.arg_names);
+    array_init(&state.by_task, sizeof(struct array), 64);
+
+    client_for_each_task(client, fd_stats_cb, &state);
+
+    for (int task = 0; task < state.by_task.len; task++) {
+        struct array *by_fd = array_element_at(&state.by_task, struct array,
+                                               task);
+
+        if (!by_fd->elem_size)
+            continue;
+
+        for (int fd = 0; fd < by_fd->len; fd++) {
+            struct fd_stats *stats = array_element_at(by_fd, struct fd_stats,
+                                                      fd);
+
+            if (stats->n_recorded) {
+                json_append_element(js_fd_stats,
+                                    _js_fd_stats(task, fd, stats));
+            }
+        }
+
+        array_free(by_fd);
+    }
+
+    array_free(&state.by_task);
+    array_free(&state.arg_names);
+
+    json_append_member(js_client, "fd_stats", js_fd_stats);
+}
+
+/* A name for a file descriptor, from a UT_ANCILLARY_FD_NAME record */
+struct fd_name {
+    int fd;
+    uint64_t timestamp;
+    const char *name;
+};
+
+static int
+fd_name_cmp_cb(const void *v0, const void *v1)
+{
+    const struct fd_name *name0 = v0;
+    const struct fd_name *name1 = v1;
+
+    if (name0->fd != name1->fd)
+        return name0->fd < name1->fd ? -1 : 1;
+    if (name0->timestamp != name1->timestamp)
+        return name0->timestamp < name1->timestamp ? -1 : 1;
+    return 0;
+}
+
+/* Collects the fd names recorded by all the clients of a process, since file
+ * descriptors are shared by all of its threads, sorted by fd and then time
+ */
+static void
+get_process_fd_names(int pid, struct array *fd_names)
+{
+    array_init(fd_names, sizeof(struct fd_name), 64);
+
+    for (int i = 0; i < all_clients.len; i++) {
+        struct ut_client *client = array_value_at(&all_clients,
+                                                  struct ut_client *, i);
+        struct ut_ancillary_buffer *ancillary;
+
+        if (!client->info || client->info->pid != pid)
+            continue;
+
+        gputop_list_for_each(ancillary, &client->ancillary_buffers, link) {
+            for (size_t j = 0; j < ancillary->buf_size; ) {
+                struct ut_ancillary_record *header =
+                    (void *)(ancillary->buf + j);
+                struct ut_shared_fd_name *shared = (void *)(header + 1);
+                struct fd_name name;
+
+                if (!ut_load_acquire(&header->size))
+                    break;
+                j += header->size;
+
+                if (header->type != UT_ANCILLARY_FD_NAME)
+                    continue;
+
+                name.fd = shared->fd;
+                name.timestamp = shared->timestamp;
+                name.name = shared->name;
+                array_append_val(fd_names, struct fd_name, name);
+            }
+        }
+    }
+
+    qsort(fd_names->data, fd_names->len, sizeof(struct fd_name),
+          fd_name_cmp_cb);
+}
+
+/* Finds the name an fd had at the given time, or NULL if it wasn't named (or
+ * its name had been cleared)
+ */
+static const char *
+lookup_fd_name(struct array *fd_names, int fd, uint64_t timestamp)
+{
+    struct fd_name key = { .fd = fd, .timestamp = timestamp };
+    int lo = 0, hi = fd_names->len;
+
+    /* Find the first name that's after the key, the previous one of which is
+     * the latest name for the fd, if it's for the same fd
+     */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct fd_name *name = array_element_at(fd_names, struct fd_name, mid);
+
+        if (fd_name_cmp_cb(name, &key) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0) {
+        struct fd_name *name = array_element_at(fd_names, struct fd_name,
+                                                lo - 1);
+        if (name->fd == fd && name->name[0])
+            return name->name;
+    }
+
+    return NULL;
+}
+
+/* Per file/socket statistics, like struct fd_stats but attributed by the fd's
+ * name at the time (see ut_set_fd_name()), including a histogram of
+ * latencies. File descriptors that weren't named are reported as "fd:<N>".
+ */
+struct io_stats {
+    char name[UT_FD_NAME_MAX];
+    uint64_t n_recorded;
+    uint64_t estimated_bytes;
+    uint64_t estimated_errors;
+    struct ut_shared_task_histogram histogram;
+};
+
+struct io_stats_state {
+    struct array arg_names;
+    struct array fd_names;
+    struct array all_stats; /* struct io_stats * */
+};
+
+static struct io_stats *
+get_io_stats(struct io_stats_state *state, const char *name)
+{
+    struct io_stats *stats;
+
+    for (int i = 0; i < state->all_stats.len; i++) {
+        stats = array_value_at(&state->all_stats, struct io_stats *, i);
+        if (strcmp(stats->name, name) == 0)
+            return stats;
+    }
+
+    stats = xmalloc0(sizeof(*stats));
+    snprintf(stats->name, sizeof(stats->name), "%s", name);
+    stats->histogram.min_ns = UINT64_MAX;
+    array_append_val(&state->all_stats, struct io_stats *, stats);
+
+    return stats;
+}
+
+static void
+io_stats_cb(struct ut_sample *push,
+            struct ut_sample *pop,
+            struct ut_sample *args,
+            void *data)
+{
+    struct io_stats_state *state = data;
+    struct array *arg_names = &state->arg_names;
+    int task = push->task_desc_index;
+    uint64_t period = 1ULL << push->period_log2;
+    uint64_t duration = pop->timestamp - push->timestamp;
+    int fd_idx, bytes_idx, ret_idx;
+    struct io_stats *stats;
+    char unnamed[32];
+    const char *name;
+    int64_t fd;
+
+    if (!args)
+        return;
+
+    fd_idx = find_task_arg(arg_names, task, "fd");
+    if (fd_idx < 0 || fd_idx >= args->args.n_args)
+        return;
+
+    fd = args->args.values[fd_idx];
+    if (fd < 0 || fd > INT32_MAX)
+        return;
+
+    name = lookup_fd_name(&state->fd_names, fd, pop->timestamp);
+    if (!name) {
+        snprintf(unnamed, sizeof(unnamed), "fd:%d", (int)fd);
+        name = unnamed;
+    }
+
+    stats = get_io_stats(state, name);
+    stats->n_recorded++;
+
+    histogram_add(&stats->histogram, duration, period);
+
+    bytes_idx = find_task_arg(arg_names, task, "bytes");
+    ret_idx = find_task_arg(arg_names, task, "ret");
+
+    if (bytes_idx >= 0 && bytes_idx < args->args.n_args) {
+        int64_t bytes = args->args.values[bytes_idx];
+
+        if (bytes < 0)
+            stats->estimated_errors += period;
+        else
+            stats->estimated_bytes += bytes * period;
+    } else if (ret_idx >= 0 && ret_idx < args->args.n_args) {
+        if (args->args.values[ret_idx] < 0)
+            stats->estimated_errors += period;
+    }
+}
+
+static int
+io_stats_cmp_cb(const void *v0, const void *v1)
+{
+    const struct io_stats *stats0 = *(struct io_stats **)v0;
+    const struct io_stats *stats1 = *(struct io_stats **)v1;
+    uint64_t total0 = stats0->histogram.total_ns;
+    uint64_t total1 = stats1->histogram.total_ns;
+
+    return total0 > total1 ? -1 : total0 < total1 ? 1 : 0;
+}
+
+#define IO_STATS_SUMMARY_LEN 5
+
+/* Reports the I/O of a client per file/socket, ordered by the total time
+ * spent, so it's easy to find what's behind slow I/O
+ */
+static void
+_js_client_append_io_stats(JsonNode *js_client, struct ut_client *client)
+{
+    JsonNode *js_io_stats = json_mkarray();
+    struct io_stats_state state;
+
+    client_get_task_arg_names(client, &state.arg_names);
+    get_process_fd_names(client->info->pid, &state.fd_names);
+    array_init(&state.all_stats, sizeof(struct io_stats *), 16);
+
+    client_for_each_task(client, io_stats_cb, &state);
+
+    qsort(state.all_stats.data, state.all_stats.len, sizeof(struct io_stats *),
+          io_stats_cmp_cb);
+
+    for (int i = 0; i < state.all_stats.len; i++) {
+        struct io_stats *stats = array_value_at(&state.all_stats,
+                                                struct io_stats *, i);
+        struct ut_shared_task_histogram *histogram = &stats->histogram;
+        JsonNode *js_stats = json_mkobject();
+
+        json_append_member(js_stats, "name", json_mkstring(stats->name));
+        json_append_member(js_stats, "recorded",
+                           json_mknumber(stats->n_recorded));
+        json_append_member(js_stats, "bytes",
+                           json_mknumber(stats->estimated_bytes));
+        json_append_member(js_stats, "errors",
+                           json_mknumber(stats->estimated_errors));
+        _js_append_histogram_summary(js_stats, histogram);
+        json_append_element(js_io_stats, js_stats);
+
+        if (verbose && i < IO_STATS_SUMMARY_LEN) {
+            fprintf(stderr, "%s:%s: I/O on %s: %llu calls, %.3f ms "
+                    "(p99 = %.3f ms, max = %.3f ms)\n",
+                    client->process_name, client->thread_name,
+                    stats->name,
+                    (unsigned long long)histogram->count,
+                    histogram->total_ns / 1e6,
+                    histogram_percentile(histogram, 99) / 1e6,
+                    histogram->max_ns / 1e6);
+        }
+
+        free(stats);
+    }
+
+    array_free(&state.all_stats);
+    array_free(&state.fd_names);
+    array_free(&state.arg_names);
+
+    json_append_member(js_client, "io_stats", js_io_stats);
+}
+
+/* A wait for events (e.g. epoll_wait), recorded as a task with an "events"
+ * value (see gen_api_wrappers.py), that bounds the iterations of an event
+ * loop
+ */
+struct event_wait {
+    uint64_t start;
+    uint64_t end;
+    int64_t events;
+    int64_t timeout_ms; /* or -1 if unknown/infinite */
+    bool sampled;
+};
+
+/* An iteration of an event loop, from a wait for events returning until the
+ * next wait
+ */
+struct event_loop_iteration {
+    uint64_t start;
+    uint64_t work_ns;
+    int64_t events;
+};
+
+struct event_loop_state {
+    struct array arg_names;
+    struct array waits; /* struct event_wait */
+    struct array task_starts; /* uint64_t push timestamps of other tasks */
+};
+
+/* Threads that wait for events less often aren't considered event loops */
+#define EVENT_LOOP_MIN_ITERATIONS 10
+
+/* Iterations that take longer than this delay the handling of any other
+ * events that are ready and are reported as long iterations
+ */
+#define EVENT_LOOP_LONG_ITERATION_NS 10000000
+
+#define EVENT_LOOP_LONGEST_ITERATIONS_LEN 5
+
+static void
+event_loop_cb(struct ut_sample *push,
+              struct ut_sample *pop,
+              struct ut_sample *args,
+              void *data)
+{
+    struct event_loop_state *state = data;
+    int task = push->task_desc_index;
+    struct event_wait wait;
+    int events_idx, timeout_idx;
+
+    events_idx = args ? find_task_arg(&state->arg_names, task, "events") : -1;
+    if (events_idx < 0 || events_idx >= args->args.n_args) {
+        array_append_val(&state->task_starts, uint64_t, push->timestamp);
+        return;
+    }
+
+    timeout_idx = find_task_arg(&state->arg_names, task, "timeout");
+
+    wait.start = push->timestamp;
+    wait.end = pop->timestamp;
+    wait.events = args->args.values[events_idx];
+    wait.timeout_ms = -1;
+    if (timeout_idx >= 0 && timeout_idx < args->args.n_args)
+        wait.timeout_ms = args->args.values[timeout_idx];
+    wait.sampled = push->period_log2 > 0;
+
+    array_append_val(&state->waits, struct event_wait, wait);
+}
+
+static int
+uint64_cmp_cb(const void *v0, const void *v1)
+{
+    uint64_t value0 = *(const uint64_t *)v0;
+    uint64_t value1 = *(const uint64_t *)v1;
+
+    return value0 < value1 ? -1 : value0 > value1 ? 1 : 0;
+}
+
+static int
+event_loop_iteration_cmp_cb(const void *v0, const void *v1)
+{
+    const struct event_loop_iteration *iteration0 = v0;
+    const struct event_loop_iteration *iteration1 = v1;
+
+    if (iteration0->work_ns != iteration1->work_ns)
+        return iteration0->work_ns > iteration1->work_ns ? -1 : 1;
+    return 0;
+}
+
+/* Finds the first task that started in [start, end), so we can tell how long
+ * it took to dispatch the events returned by a wait
+ */
+static bool
+find_first_task_start(struct array *task_starts,
+                      uint64_t start,
+                      uint64_t end,
+                      uint64_t *timestamp)
+{
+    int lo = 0, hi = task_starts->len;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (array_value_at(task_starts, uint64_t, mid) < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == task_starts->len ||
+        array_value_at(task_starts, uint64_t, lo) >= end)
+        return false;
+
+    *timestamp = array_value_at(task_starts, uint64_t, lo);
+    return true;
+}
+
+/* Reports the iterations of a thread's event loop, if it has one, bounded by
+ * its waits for events. Utilization is the fraction of the time spent
+ * handling events rather than waiting for them, where an event loop that's
+ * close to 100% can't keep up with any more events. The dispatch delay is
+ * from a wait returning with events until the first task of the iteration
+ * starts and the timer lateness is how late a wait that timed out returned.
+ */
+static void
+_js_client_append_event_loop_stats(JsonNode *js_client,
+                                   struct ut_client *client,
+                                   uint64_t epoch)
+{
+    JsonNode *js_event_loop, *js_longest;
+    struct event_loop_state state;
+    struct array iterations;
+    struct ut_shared_task_histogram work = { .min_ns = UINT64_MAX };
+    struct ut_shared_task_histogram dispatch = { .min_ns = UINT64_MAX };
+    struct ut_shared_task_histogram lateness = { .min_ns = UINT64_MAX };
+    uint64_t busy_ns = 0, waiting_ns = 0, n_long = 0;
+
+    client_get_task_arg_names(client, &state.arg_names);
+    array_init(&state.waits, sizeof(struct event_wait), 64);
+    array_init(&state.task_starts, sizeof(uint64_t), 256);
+    array_init(&iterations, sizeof(struct event_loop_iteration), 64);
+
+    client_for_each_task(client, event_loop_cb, &state);
+
+    if (state.waits.len <= EVENT_LOOP_MIN_ITERATIONS)
+        goto done;
+
+    qsort(state.task_starts.data, state.task_starts.len, sizeof(uint64_t),
+          uint64_cmp_cb);
+
+    for (int i = 0; i < state.waits.len; i++) {
+        struct event_wait *wait = array_element_at(&state.waits,
+                                                   struct event_wait, i);
+        struct event_wait *next = NULL;
+        struct event_loop_iteration iteration;
+        uint64_t wait_ns = wait->end - wait->start;
+        uint64_t dispatch_start;
+
+        if (wait->events == 0 && wait->timeout_ms > 0 &&
+            wait_ns > wait->timeout_ms * 1000000ULL)
+            histogram_add(&lateness, wait_ns - wait->timeout_ms * 1000000ULL, 1);
+
+        if (i + 1 < state.waits.len)
+            next = array_element_at(&state.waits, struct event_wait, i + 1);
+
+        /* If some waits weren't recorded, due to sampling, we can't tell
+         * where the iterations between the recorded waits start and end
+         */
+        if (!next || wait->sampled || next->sampled ||
+            next->start < wait->end)
+            continue;
+
+        iteration.start = wait->end;
+        iteration.work_ns = next->start - wait->end;
+        iteration.events = wait->events;
+        array_append_val(&iterations, struct event_loop_iteration, iteration);
+        histogram_add(&work, iteration.work_ns, 1);
+        busy_ns += iteration.work_ns;
+        waiting_ns += wait_ns;
+        if (iteration.work_ns > EVENT_LOOP_LONG_ITERATION_NS)
+            n_long++;
+
+        if (wait->events > 0 &&
+            find_first_task_start(&state.task_starts, wait->end, next->start,
+                                  &dispatch_start))
+            histogram_add(&dispatch, dispatch_start - wait->end, 1);
+    }
+
+    if (iterations.len < EVENT_LOOP_MIN_ITERATIONS)
+        goto done;
+
+    js_event_loop = json_mkobject();
+    json_append_member(js_event_loop, "iterations",
+                       json_mknumber(iterations.len));
+    json_append_member(js_event_loop, "utilization",
+                       json_mknumber((double)busy_ns / (busy_ns + waiting_ns)));
+    json_append_member(js_event_loop, "busy_ms", json_mknumber(busy_ns / 1e6));
+    json_append_member(js_event_loop, "waiting_ms",
+                       json_mknumber(waiting_ns / 1e6));
+    json_append_member(js_event_loop, "iteration",
+                       _js_histogram_summary(&work));
+    json_append_member(js_event_loop, "long_iterations",
+                       json_mknumber(n_long));
+    json_append_member(js_event_loop, "dispatch_delay",
+                       _js_histogram_summary(&dispatch));
+    json_append_member(js_event_loop, "timer_lateness",
+                       _js_histogram_summary(&lateness));
+
+    qsort(iterations.data, iterations.len, sizeof(struct event_loop_iteration),
+          event_loop_iteration_cmp_cb);
+
+    js_longest = json_mkarray();
+    for (int i = 0;
+         i < iterations.len && i < EVENT_LOOP_LONGEST_ITERATIONS_LEN;
+         i++) {
+        struct event_loop_iteration *iteration =
+            array_element_at(&iterations, struct event_loop_iteration, i);
+        JsonNode *js_iteration = json_mkobject();
+
+        json_append_member(js_iteration, "start_sec",
+                           json_mknumber((double)(int64_t)(iteration->start -
+                                                           epoch) / 1e9));
+        json_append_member(js_iteration, "duration_ms",
+                           json_mknumber(iteration->work_ns / 1e6));
+        json_append_member(js_iteration, "events",
+                           json_mknumber(iteration->events));
+        json_append_element(js_longest, js_iteration);
+    }
+    json_append_member(js_event_loop, "longest_iterations", js_longest);
+
+    json_append_member(js_client, "event_loop", js_event_loop);
+
+    if (verbose) {
+        fprintf(stderr, "%s:%s: event loop: %d iterations, %.1f%% "
+                "utilization, iteration p99 = %.3f ms, max = %.3f ms, "
+                "%llu long\n",
+                client->process_name, client->thread_name,
+                iterations.len,
+                100.0 * busy_ns / (busy_ns + waiting_ns),
+                histogram_percentile(&work, 99) / 1e6,
+                work.max_ns / 1e6,
+                (unsigned long long)n_long);
+    }
+
+done:
+    array_free(&iterations);
+    array_free(&state.task_starts);
+    array_free(&state.waits);
+    array_free(&state.arg_names);
+}
+
+/* An allocation or free, recorded as a task with an "alloc" (the size) or
+ * "free" value by the malloc() family wrappers (see ut-api-wrappers.c)
+ */
+struct alloc_event {
+    uint64_t timestamp;
+    uint64_t period;
+    uint64_t duration;
+    uint64_t bytes;
+    bool is_free;
+};
+
+/* Running totals of allocations, estimated from the sampling periods, so the
+ * allocations during any interval can be found from the difference between
+ * the totals at the start and end
+ */
+struct alloc_totals {
+    uint64_t n_allocs;
+    uint64_t n_frees;
+    uint64_t bytes;
+    uint64_t ns;
+};
+
+/* A task instance that might have allocated, other than an allocator task */
+struct alloc_task {
+    uint16_t task_desc_idx;
+    uint64_t start;
+    uint64_t end;
+    uint64_t period;
+};
+
+/* The allocations made while running each task (including any tasks it
+ * called), indexed by task_desc index
+ */
+struct task_alloc_stats {
+    int task_desc_idx;
+    uint64_t count;
+    uint64_t task_ns;
+    struct alloc_totals totals;
+};
+
+struct alloc_stats_state {
+    struct array arg_names;
+    struct array events; /* struct alloc_event */
+    struct array tasks; /* struct alloc_task */
+};
+
+static void
+alloc_stats_cb(struct ut_sample *push,
+               struct ut_sample *pop,
+               struct ut_sample *args,
+               void *data)
+{
+    struct alloc_stats_state *state = data;
+    int task = push->task_desc_index;
+    uint64_t period = 1ULL << push->period_log2;
+    int alloc_idx = -1, free_idx = -1;
+
+    if (args) {
+        alloc_idx = find_task_arg(&state->arg_names, task, "alloc");
+        free_idx = find_task_arg(&state->arg_names, task, "free");
+    }
+
+    if ((alloc_idx >= 0 && alloc_idx < args->args.n_args) ||
+        (free_idx >= 0 && free_idx < args->args.n_args)) {
+        struct alloc_event event = {
+            .timestamp = push->timestamp,
+            .period = period,
+            .duration = pop->timestamp - push->timestamp,
+            .is_free = alloc_idx < 0,
+        };
+
+        if (alloc_idx >= 0)
+            event.bytes = args->args.values[alloc_idx];
+
+        array_append_val(&state->events, struct alloc_event, event);
+    } else {
+        struct alloc_task instance = {
+            .task_desc_idx = task,
+            .start = push->timestamp,
+            .end = pop->timestamp,
+            .period = period,
+        };
+
+        array_append_val(&state->tasks, struct alloc_task, instance);
+    }
+}
+
+static int
+alloc_event_cmp_cb(const void *v0, const void *v1)
+{
+    const struct alloc_event *event0 = v0;
+    const struct alloc_event *event1 = v1;
+
+    if (event0->timestamp != event1->timestamp)
+        return event0->timestamp < event1->timestamp ? -1 : 1;
+    return 0;
+}
+
+static int
+task_alloc_stats_cmp_cb(const void *v0, const void *v1)
+{
+    const struct task_alloc_stats *stats0 = v0;
+    const struct task_alloc_stats *stats1 = v1;
+
+    if (stats0->totals.ns != stats1->totals.ns)
+        return stats0->totals.ns > stats1->totals.ns ? -1 : 1;
+    return 0;
+}
+
+/* Returns the index of the first event at or after timestamp */
+static int
+find_alloc_event(struct array *events, uint64_t timestamp)
+{
+    int lo = 0, hi = events->len;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (array_element_at(events, struct alloc_event, mid)->timestamp <
+            timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static void
+_js_append_alloc_totals(JsonNode *js_object, struct alloc_totals *totals)
+{
+    json_append_member(js_object, "allocations",
+                       json_mknumber(totals->n_allocs));
+    json_append_member(js_object, "frees", json_mknumber(totals->n_frees));
+    json_append_member(js_object, "bytes", json_mknumber(totals->bytes));
+    json_append_member(js_object, "allocator_ms",
+                       json_mknumber(totals->ns / 1e6));
+}
+
+#define ALLOC_STATS_SUMMARY_LEN 5
+
+/* Reports the allocations of a thread, and how many bytes each task
+ * allocated and how much of its time was spent in the allocator, so it's
+ * easy to find tasks that are slowed down by allocating
+ */
+static void
+_js_client_append_alloc_stats(JsonNode *js_client, struct ut_client *client)
+{
+    JsonNode *js_alloc_stats, *js_by_task;
+    struct alloc_stats_state state;
+    struct array totals; /* struct alloc_totals, running */
+    struct array by_task; /* struct task_alloc_stats */
+    struct array task_descs;
+    struct alloc_totals *total;
+    int n_summarized = 0;
+
+    client_get_task_arg_names(client, &state.arg_names);
+    array_init(&state.events, sizeof(struct alloc_event), 256);
+    array_init(&state.tasks, sizeof(struct alloc_task), 64);
+
+    client_for_each_task(client, alloc_stats_cb, &state);
+
+    if (!state.events.len) {
+        array_free(&state.tasks);
+        array_free(&state.events);
+        array_free(&state.arg_names);
+        return;
+    }
+
+    qsort(state.events.data, state.events.len, sizeof(struct alloc_event),
+          alloc_event_cmp_cb);
+
+    array_init(&totals, sizeof(struct alloc_totals), state.events.len + 1);
+    array_set_len(&totals, state.events.len + 1);
+    memset(totals.data, 0, sizeof(struct alloc_totals));
+
+    for (int i = 0; i < state.events.len; i++) {
+        struct alloc_event *event = array_element_at(&state.events,
+                                                     struct alloc_event, i);
+        struct alloc_totals *prev = array_element_at(&totals,
+                                                     struct alloc_totals, i);
+        struct alloc_totals *next = array_element_at(&totals,
+                                                     struct alloc_totals,
+                                                     i + 1);
+
+        *next = *prev;
+        if (event->is_free)
+            next->n_frees += event->period;
+        else {
+            next->n_allocs += event->period;
+            next->bytes += event->bytes * event->period;
+        }
+        next->ns += event->duration * event->period;
+    }
+
+    array_init(&by_task, sizeof(struct task_alloc_stats), 64);
+
+    for (int i = 0; i < state.tasks.len; i++) {
+        struct alloc_task *instance = array_element_at(&state.tasks,
+                                                       struct alloc_task, i);
+        int start = find_alloc_event(&state.events, instance->start);
+        int end = find_alloc_event(&state.events, instance->end);
+        struct alloc_totals *start_totals =
+            array_element_at(&totals, struct alloc_totals, start);
+        struct alloc_totals *end_totals =
+            array_element_at(&totals, struct alloc_totals, end);
+        struct task_alloc_stats *stats;
+        int len = by_task.len;
+
+        if (instance->task_desc_idx >= len) {
+            array_set_len(&by_task, instance->task_desc_idx + 1);
+            memset(by_task.bytes + len * by_task.elem_size, 0,
+                   (by_task.len - len) * by_task.elem_size);
+        }
+        stats = array_element_at(&by_task, struct task_alloc_stats,
+                                 instance->task_desc_idx);
+        stats->task_desc_idx = instance->task_desc_idx;
+        stats->count += instance->period;
+        stats->task_ns += (instance->end - instance->start) * instance->period;
+
+        /* Note: the allocations of a sampled task instance are assumed to be
+         * representative of the instances that weren't recorded
+         */
+        stats->totals.n_allocs += (end_totals->n_allocs -
+                                   start_totals->n_allocs) * instance->period;
+        stats->totals.n_frees += (end_totals->n_frees -
+                                  start_totals->n_frees) * instance->period;
+        stats->totals.bytes += (end_totals->bytes -
+                                start_totals->bytes) * instance->period;
+        stats->totals.ns += (end_totals->ns -
+                             start_totals->ns) * instance->period;
+    }
+
+    qsort(by_task.data, by_task.len, sizeof(struct task_alloc_stats),
+          task_alloc_stats_cmp_cb);
+
+    client_get_task_descs(client, &task_descs);
+
+    js_alloc_stats = json_mkobject();
+    total = array_element_at(&totals, struct alloc_totals, state.events.len);
+    _js_append_alloc_totals(js_alloc_stats, total);
+
+    js_by_task = json_mkarray();
+    for (int i = 0; i < by_task.len; i++) {
+        struct task_alloc_stats *stats =
+            array_element_at(&by_task, struct task_alloc_stats, i);
+        const char *name = find_task_name(&task_descs, stats->task_desc_idx);
+        JsonNode *js_stats;
+
+        if (!stats->totals.n_allocs && !stats->totals.n_frees)
+            break;
+
+        js_stats = json_mkobject();
+        json_append_member(js_stats, "task",
+                           json_mknumber(stats->task_desc_idx));
+        json_append_member(js_stats, "name", json_mkstring(name));
+        json_append_member(js_stats, "count", json_mknumber(stats->count));
+        _js_append_alloc_totals(js_stats, &stats->totals);
+        json_append_member(js_stats, "allocator_fraction",
+                           json_mknumber(stats->task_ns ?
+                                         (double)stats->totals.ns /
+                                         stats->task_ns : 0));
+        json_append_element(js_by_task, js_stats);
+
+        /* Note: tasks that only free what was allocated elsewhere aren't
+         * interesting to summarize
+         */
+        if (verbose && stats->totals.n_allocs &&
+            n_summarized++ < ALLOC_STATS_SUMMARY_LEN) {
+            fprintf(stderr, "%s:%s: %s: %llu allocations (%.1f KB), %.3f ms "
+                    "in the allocator (%.1f%% of its time)\n",
+                    client->process_name, client->thread_name, name,
+                    (unsigned long long)stats->totals.n_allocs,
+                    stats->totals.bytes / 1024.0,
+                    stats->totals.ns / 1e6,
+                    stats->task_ns ?
+                    100.0 * stats->totals.ns / stats->task_ns : 0);
+        }
+    }
+    json_append_member(js_alloc_stats, "by_task", js_by_task);
+
+    json_append_member(js_client, "alloc_stats", js_alloc_stats);
+
+    array_free(&task_descs);
+    array_free(&by_task);
+    array_free(&totals);
+    array_free(&state.tasks);
+    array_free(&state.events);
+    array_free(&state.arg_names);
+}
+
+/* The time spent blocked in one api for one reason */
+struct off_cpu_api {
+    uint64_t count;
+    uint64_t total_ns;
+};
+
+struct off_cpu_reason {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    struct array apis; /* struct off_cpu_api, indexed by task_desc index */
+};
+
+struct off_cpu_state {
+    struct array task_descs;
+    struct array arg_names;
+    struct array fd_names;
+    uint64_t start;
+    uint64_t end;
+    struct off_cpu_reason reasons[UT_N_WAIT_REASONS];
+};
+
+/* Whether an fd name (see ut_name_socket_fd()) is for a socket */
+static bool
+is_socket_name(const char *name)
+{
+    return (strncmp(name, "tcp:", 4) == 0 ||
+            strncmp(name, "udp:", 4) == 0 ||
+            strncmp(name, "unix:", 5) == 0);
+}
+
+static void
+off_cpu_cb(struct ut_sample *push,
+           struct ut_sample *pop,
+           struct ut_sample *args,
+           void *data)
+{
+    struct off_cpu_state *state = data;
+    int task = push->task_desc_index;
+    uint64_t period = 1ULL << push->period_log2;
+    uint64_t duration = pop->timestamp - push->timestamp;
+    struct ut_shared_task_desc *desc = NULL;
+    struct off_cpu_reason *reason;
+    struct off_cpu_api *api;
+    int wait_reason, len;
+
+    state->start = MIN(state->start, push->timestamp);
+    state->end = MAX(state->end, pop->timestamp);
+
+    if (task < state->task_descs.len)
+        desc = array_value_at(&state->task_descs,
+                              struct ut_shared_task_desc *, task);
+    if (!desc || desc->wait_reason == UT_WAIT_NONE ||
+        desc->wait_reason >= UT_N_WAIT_REASONS)
+        return;
+
+    wait_reason = desc->wait_reason;
+
+    /* read(), write() etc. on a socket are waiting for the network */
+    if (wait_reason == UT_WAIT_IO && args) {
+        int fd_idx = find_task_arg(&state->arg_names, task, "fd");
+
+        if (fd_idx >= 0 && fd_idx < args->args.n_args) {
+            const char *name = lookup_fd_name(&state->fd_names,
+                                              args->args.values[fd_idx],
+                                              pop->timestamp);
+            if (name && is_socket_name(name))
+                wait_reason = UT_WAIT_NETWORK;
+        }
+    }
+
+    reason = &state->reasons[wait_reason];
+    reason->count += period;
+    reason->total_ns += duration * period;
+    reason->max_ns = MAX(reason->max_ns, duration);
+
+    len = reason->apis.len;
+    if (task >= len) {
+        array_set_len(&reason->apis, task + 1);
+        memset(reason->apis.bytes + len * reason->apis.elem_size, 0,
+               (reason->apis.len - len) * reason->apis.elem_size);
+    }
+    api = array_element_at(&reason->apis, struct off_cpu_api, task);
+    api->count += period;
+    api->total_ns += duration * period;
+}
+
+#define OFF_CPU_TOP_APIS 3
+
+/* Reports how much of the time a thread spent blocked in the wrapped apis,
+ * broken down by the reason the apis block (see enum ut_wait_reason), and
+ * the apis it was blocked in most for each reason.
+ *
+ * Note: this is the wall clock time spent in blocking calls, which is only
+ * an approximation of the time spent off-CPU, since calls don't always
+ * block (e.g. reading cached files) and may spin before blocking
+ */
+static void
+_js_client_append_off_cpu_stats(JsonNode *js_client, struct ut_client *client)
+{
+    struct off_cpu_state state = { .start = UINT64_MAX };
+    int order[UT_N_WAIT_REASONS];
+    uint64_t blocked_ns = 0, window_ns;
+    JsonNode *js_off_cpu, *js_by_reason;
+    char summary[256];
+    int n_order = 0, summary_len;
+
+    client_get_task_descs(client, &state.task_descs);
+    client_get_task_arg_names(client, &state.arg_names);
+    get_process_fd_names(client->info->pid, &state.fd_names);
+    for (int i = 0; i < UT_N_WAIT_REASONS; i++)
+        array_init(&state.reasons[i].apis, sizeof(struct off_cpu_api), 16);
+
+    client_for_each_task(client, off_cpu_cb, &state);
+
+    /* Order the reasons by the time spent blocked for them */
+    for (int i = 0; i < UT_N_WAIT_REASONS; i++) {
+        int j;
+
+        if (!state.reasons[i].count)
+            continue;
+
+        blocked_ns += state.reasons[i].total_ns;
+        for (j = n_order; j > 0 &&
+             state.reasons[order[j - 1]].total_ns < state.reasons[i].total_ns;
+             j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+        n_order++;
+    }
+
+    if (!n_order)
+        goto done;
+
+    window_ns = state.end - state.start;
+
+    js_off_cpu = json_mkobject();
+    json_append_member(js_off_cpu, "window_ms", json_mknumber(window_ns / 1e6));
+    json_append_member(js_off_cpu, "blocked_ms",
+                       json_mknumber(blocked_ns / 1e6));
+    json_append_member(js_off_cpu, "blocked_fraction",
+                       json_mknumber((double)blocked_ns / window_ns));
+
+    summary_len = snprintf(summary, sizeof(summary),
+                           "%s:%s: blocked for %.1f%% of %.3f ms:",
+                           client->process_name, client->thread_name,
+                           100.0 * blocked_ns / window_ns, window_ns / 1e6);
+
+    js_by_reason = json_mkarray();
+    for (int i = 0; i < n_order; i++) {
+        struct off_cpu_reason *reason = &state.reasons[order[i]];
+        const char *name = ut_get_wait_reason_name(order[i]);
+        JsonNode *js_reason = json_mkobject();
+        JsonNode *js_apis = json_mkarray();
+
+        json_append_member(js_reason, "reason", json_mkstring(name));
+        json_append_member(js_reason, "count", json_mknumber(reason->count));
+        json_append_member(js_reason, "total_ms",
+                           json_mknumber(reason->total_ns / 1e6));
+        json_append_member(js_reason, "fraction",
+                           json_mknumber((double)reason->total_ns /
+                                         window_ns));
+        json_append_member(js_reason, "max_ms",
+                           json_mknumber(reason->max_ns / 1e6));
+
+        /* Note: the apis are cleared as they're reported */
+        for (int j = 0; j < OFF_CPU_TOP_APIS; j++) {
+            struct off_cpu_api *top = NULL;
+            JsonNode *js_api;
+            int top_idx = 0;
+
+            for (int k = 0; k < reason->apis.len; k++) {
+                struct off_cpu_api *api =
+                    array_element_at(&reason->apis, struct off_cpu_api, k);
+
+                if (api->count && (!top || api->total_ns > top->total_ns)) {
+                    top = api;
+                    top_idx = k;
+                }
+            }
+            if (!top)
+                break;
+
+            js_api = json_mkobject();
+            json_append_member(js_api, "name",
+                               json_mkstring(find_task_name(&state.task_descs,
+                                                            top_idx)));
+            json_append_member(js_api, "count", json_mknumber(top->count));
+            json_append_member(js_api, "total_ms",
+                               json_mknumber(top->total_ns / 1e6));
+            json_append_element(js_apis, js_api);
+            top->count = 0;
+        }
+        json_append_member(js_reason, "apis", js_apis);
+        json_append_element(js_by_reason, js_reason);
+
+        if (summary_len < sizeof(summary)) {
+            summary_len += snprintf(summary + summary_len,
+                                    sizeof(summary) - summary_len,
+                                    "%s %s %.1f%%", i ? "," : "", name,
+                                    100.0 * reason->total_ns / window_ns);
+        }
+    }
+    json_append_member(js_off_cpu, "by_reason", js_by_reason);
+
+    json_append_member(js_client, "off_cpu", js_off_cpu);
+
+    if (verbose)
+        fprintf(stderr, "%s\n", summary);
+
+done:
+    for (int i = 0; i < UT_N_WAIT_REASONS; i++)
+        array_free(&state.reasons[i].apis);
+    array_free(&state.fd_names);
+    array_free(&state.arg_names);
+    array_free(&state.task_descs);
+}
+
+/* Per-thread statistics for waiting for or holding a lock */
+struct lock_thread_stats {
+    struct ut_client *client;
+    uint64_t count;
+    uint64_t n_contended; /* holds while another thread was waiting */
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/* Lock contention statistics for a lock (e.g. a mutex address) across all the
+ * threads of a process, where contended acquisitions are recorded as tasks
+ * with a "mutex" value (see gen_api_wrappers.py) and holds are recorded as
+ * UT_SAMPLE_LOCK_HOLD samples
+ */
+struct lock_stats {
+    uint64_t lock;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    struct array waiters; /* struct lock_thread_stats */
+    struct array holders; /* struct lock_thread_stats */
+};
+
+struct lock_contention_state {
+    struct ut_client *client;
+    struct array arg_names;
+    struct array all_stats; /* struct lock_stats * */
+};
+
+static struct lock_stats *
+get_lock_stats(struct lock_contention_state *state, uint64_t lock)
+{
+    struct lock_stats *stats;
+
+    for (int i = 0; i < state->all_stats.len; i++) {
+        stats = array_value_at(&state->all_stats, struct lock_stats *, i);
+        if (stats->lock == lock)
+            return stats;
+    }
+
+    stats = xmalloc0(sizeof(*stats));
+    stats->lock = lock;
+    array_init(&stats->waiters, sizeof(struct lock_thread_stats), 4);
+    array_init(&stats->holders, sizeof(struct lock_thread_stats), 4);
+    array_append_val(&state->all_stats, struct lock_stats *, stats);
+
+    return stats;
+}
+
+static struct lock_thread_stats *
+get_lock_thread_stats(struct array *threads, struct ut_client *client)
+{
+    struct lock_thread_stats new_stats = { .client = client };
+
+    for (int i = 0; i < threads->len; i++) {
+        struct lock_thread_stats *stats =
+            array_element_at(threads, struct lock_thread_stats, i);
+
+        if (stats->client == client)
+            return stats;
+    }
+
+    array_append_val(threads, struct lock_thread_stats, new_stats);
+
+    return array_element_at(threads, struct lock_thread_stats,
+                            threads->len - 1);
+}
+
+static void
+lock_wait_cb(struct ut_sample *push,
+             struct ut_sample *pop,
+             struct ut_sample *args,
+             void *data)
+{
+    struct lock_contention_state *state = data;
+    uint64_t period = 1ULL << push->period_log2;
+    uint64_t duration = pop->timestamp - push->timestamp;
+    struct lock_thread_stats *waiter;
+    struct lock_stats *stats;
+    int idx;
+
+    if (!args)
+        return;
+
+    idx = find_task_arg(&state->arg_names, push->task_desc_index, "mutex");
+    if (idx < 0 || idx >= args->args.n_args)
+        return;
+
+    stats = get_lock_stats(state, args->args.values[idx]);
+    stats->wait_ns += duration * period;
+
+    waiter = get_lock_thread_stats(&stats->waiters, state->client);
+    waiter->count += period;
+    waiter->total_ns += duration * period;
+    waiter->max_ns = MAX(waiter->max_ns, duration);
+}
+
+static void
+lock_hold_cb(struct ut_sample *sample, void *data)
+{
+    struct lock_contention_state *state = data;
+    uint64_t duration;
+    struct lock_thread_stats *holder;
+    struct lock_stats *stats;
+
+    if (sample->type != UT_SAMPLE_LOCK_HOLD)
+        return;
+
+    duration = sample->lock_hold.timestamp - sample->lock_hold.acquire_timestamp;
+
+    stats = get_lock_stats(state, sample->lock_hold.lock);
+    stats->hold_ns += duration;
+
+    holder = get_lock_thread_stats(&stats->holders, state->client);
+    holder->count++;
+    if (sample->lock_hold.contended)
+        holder->n_contended++;
+    holder->total_ns += duration;
+    holder->max_ns = MAX(holder->max_ns, duration);
+}
+
+static int
+lock_stats_cmp_cb(const void *v0, const void *v1)
+{
+    const struct lock_stats *stats0 = *(struct lock_stats **)v0;
+    const struct lock_stats *stats1 = *(struct lock_stats **)v1;
+
+    if (stats0->wait_ns != stats1->wait_ns)
+        return stats0->wait_ns > stats1->wait_ns ? -1 : 1;
+    if (stats0->hold_ns != stats1->hold_ns)
+        return stats0->hold_ns > stats1->hold_ns ? -1 : 1;
+    return 0;
+}
+
+static int
+lock_thread_stats_cmp_cb(const void *v0, const void *v1)
+{
+    const struct lock_thread_stats *stats0 = v0;
+    const struct lock_thread_stats *stats1 = v1;
+
+    if (stats0->total_ns != stats1->total_ns)
+        return stats0->total_ns > stats1->total_ns ? -1 : 1;
+    return 0;
+}
+
+static JsonNode *
+_js_lock_threads(struct array *threads, bool holders)
+{
+    JsonNode *js_threads = json_mkarray();
+
+    qsort(threads->data, threads->len, sizeof(struct lock_thread_stats),
+          lock_thread_stats_cmp_cb);
+
+    for (int i = 0; i < threads->len; i++) {
+        struct lock_thread_stats *stats =
+            array_element_at(threads, struct lock_thread_stats, i);
+        JsonNode *js_thread = json_mkobject();
+
+        json_append_member(js_thread, "thread_name",
+                           json_mkstring(stats->client->thread_name));
+        json_append_member(js_thread, "tid",
+                           json_mknumber(stats->client->info->tid));
+        json_append_member(js_thread, "count", json_mknumber(stats->count));
+        if (holders) {
+            json_append_member(js_thread, "contended",
+                               json_mknumber(stats->n_contended));
+        }
+        json_append_member(js_thread, holders ? "hold_ms" : "wait_ms",
+                           json_mknumber(stats->total_ns / 1e6));
+        json_append_member(js_thread, holders ? "max_hold_ms" : "max_wait_ms",
+                           json_mknumber(stats->max_ns / 1e6));
+        json_append_element(js_threads, js_thread);
+    }
+
+    return js_threads;
+}
+
+#define LOCK_CONTENTION_SUMMARY_LEN 5
+
+/* Reports lock contention across all the threads of a process, ranked by
+ * the total time spent waiting, with the threads that waited for and held
+ * each lock
+ */
+static JsonNode *
+_js_process_lock_contention(struct ut_client **clients, int n_clients, int pid)
+{
+    JsonNode *js_locks = json_mkarray();
+    struct lock_contention_state state;
+
+    array_init(&state.all_stats, sizeof(struct lock_stats *), 16);
+
+    for (int i = 0; i < n_clients; i++) {
+        if (clients[i]->info->pid != pid)
+            continue;
+
+        state.client = clients[i];
+        client_get_task_arg_names(clients[i], &state.arg_names);
+        client_for_each_task(clients[i], lock_wait_cb, &state);
+        client_for_each_sample(clients[i], lock_hold_cb, &state);
+        array_free(&state.arg_names);
+    }
+
+    qsort(state.all_stats.data, state.all_stats.len,
+          sizeof(struct lock_stats *), lock_stats_cmp_cb);
+
+    for (int i = 0; i < state.all_stats.len; i++) {
+        struct lock_stats *stats = array_value_at(&state.all_stats,
+                                                  struct lock_stats *, i);
+        JsonNode *js_lock = json_mkobject();
+        uint64_t n_contended = 0;
+        uint64_t max_wait_ns = 0;
+        char address[32];
+
+        for (int j = 0; j < stats->waiters.len; j++) {
+            struct lock_thread_stats *waiter =
+                array_element_at(&stats->waiters, struct lock_thread_stats, j);
+
+            n_contended += waiter->count;
+            max_wait_ns = MAX(max_wait_ns, waiter->max_ns);
+        }
+
+        snprintf(address, sizeof(address), "0x%llx",
+                 (unsigned long long)stats->lock);
+        json_append_member(js_lock, "lock", json_mkstring(address));
+        json_append_member(js_lock, "contended", json_mknumber(n_contended));
+        json_append_member(js_lock, "wait_ms",
+                           json_mknumber(stats->wait_ns / 1e6));
+        json_append_member(js_lock, "max_wait_ms",
+                           json_mknumber(max_wait_ns / 1e6));
+        json_append_member(js_lock, "hold_ms",
+                           json_mknumber(stats->hold_ns / 1e6));
+        json_append_member(js_lock, "waiters",
+                           _js_lock_threads(&stats->waiters, false));
+        json_append_member(js_lock, "holders",
+                           _js_lock_threads(&stats->holders, true));
+        json_append_element(js_locks, js_lock);
+
+        if (verbose && i < LOCK_CONTENTION_SUMMARY_LEN && n_contended) {
+            struct lock_thread_stats *holder = NULL;
+
+            if (stats->holders.len) {
+                holder = array_element_at(&stats->holders,
+                                          struct lock_thread_stats, 0);
+            }
+
+            fprintf(stderr, "pid %d: lock %s: contended %llu times, waited "
+                    "%.3f ms (max = %.3f ms), top holder = %s (%.3f ms)\n",
+                    pid, address,
+                    (unsigned long long)n_contended,
+                    stats->wait_ns / 1e6,
+                    max_wait_ns / 1e6,
+                    holder ? holder->client->thread_name : "unknown",
+                    holder ? holder->total_ns / 1e6 : 0);
+        }
+
+        array_free(&stats->waiters);
+        array_free(&stats->holders);
+        free(stats);
+    }
+
+    array_free(&state.all_stats);
+
+    return js_locks;
+}
+
+/* The signals/broadcasts of condition variables and the wakeups of waiters,
+ * which record the sequence number of the latest signal of the condition
+ * variable before and after waiting (see gen_api_wrappers.py)
+ */
+struct cond_signal {
+    uint64_t cond;
+    uint64_t seq;
+    uint64_t timestamp;
+    bool broadcast;
+    bool claimed;
+};
+
+struct cond_wakeup {
+    uint64_t cond;
+    uint64_t seq_before;
+    uint64_t seq;
+    uint64_t timestamp;
+};
+
+struct cond_stats {
+    uint64_t cond;
+    uint64_t n_signals;
+    uint64_t n_wakeups;
+    uint64_t n_paired;
+    struct ut_shared_task_histogram latency;
+};
+
+struct cond_wakeup_state {
+    struct array arg_names;
+    struct array signals; /* struct cond_signal */
+    struct array wakeups; /* struct cond_wakeup */
+    struct array all_stats; /* struct cond_stats * */
+};
+
+static int64_t
+_task_arg(struct cond_wakeup_state *state,
+          struct ut_sample *args,
+          const char *name,
+          bool *found)
+{
+    int idx = find_task_arg(&state->arg_names, args->args.task_desc_index,
+                            name);
+
+    *found = idx >= 0 && idx < args->args.n_args;
+
+    return *found ? args->args.values[idx] : 0;
+}
+
+static void
+cond_wakeup_cb(struct ut_sample *push,
+               struct ut_sample *pop,
+               struct ut_sample *args,
+               void *data)
+{
+    struct cond_wakeup_state *state = data;
+    bool has_cond, has_seq, has_seq_before, has_broadcast, has_ret;
+    uint64_t cond, seq, seq_before;
+    int64_t ret;
+
+    if (!args)
+        return;
+
+    cond = _task_arg(state, args, "cond", &has_cond);
+    seq = _task_arg(state, args, "seq", &has_seq);
+    if (!has_cond || !has_seq)
+        return;
+
+    seq_before = _task_arg(state, args, "seq_before", &has_seq_before);
+    _task_arg(state, args, "broadcast", &has_broadcast);
+    ret = _task_arg(state, args, "ret", &has_ret);
+
+    if (has_seq_before) {
+        struct cond_wakeup wakeup = {
+            .cond = cond,
+            .seq_before = seq_before,
+            .seq = seq,
+            .timestamp = pop->timestamp,
+        };
+
+        /* e.g. timed out, so wasn't woken by a signal */
+        if (ret != 0)
+            return;
+
+        array_append_val(&state->wakeups, struct cond_wakeup, wakeup);
+    } else {
+        struct cond_signal signal = {
+            .cond = cond,
+            .seq = seq,
+            .timestamp = push->timestamp,
+            .broadcast = has_broadcast,
+        };
+
+        array_append_val(&state->signals, struct cond_signal, signal);
+    }
+}
+
+static int
+cond_signal_cmp_cb(const void *v0, const void *v1)
+{
+    const struct cond_signal *signal0 = v0;
+    const struct cond_signal *signal1 = v1;
+
+    if (signal0->cond != signal1->cond)
+        return signal0->cond < signal1->cond ? -1 : 1;
+    if (signal0->seq != signal1->seq)
+        return signal0->seq < signal1->seq ? -1 : 1;
+    return 0;
+}
+
+static int
+cond_wakeup_cmp_cb(const void *v0, const void *v1)
+{
+    const struct cond_wakeup *wakeup0 = v0;
+    const struct cond_wakeup *wakeup1 = v1;
+
+    if (wakeup0->timestamp != wakeup1->timestamp)
+        return wakeup0->timestamp < wakeup1->timestamp ? -1 : 1;
+    return 0;
+}
+
+static struct cond_stats *
+get_cond_stats(struct cond_wakeup_state *state, uint64_t cond)
+{
+    struct cond_stats *stats;
+
+    for (int i = 0; i < state->all_stats.len; i++) {
+        stats = array_value_at(&state->all_stats, struct cond_stats *, i);
+        if (stats->cond == cond)
+            return stats;
+    }
+
+    stats = xmalloc0(sizeof(*stats));
+    stats->cond = cond;
+    stats->latency.min_ns = UINT64_MAX;
+    array_append_val(&state->all_stats, struct cond_stats *, stats);
+
+    return stats;
+}
+
+/* Pairs a wakeup with the oldest signal that it could have been woken by
+ * that hasn't already woken another waiter (broadcasts can wake any number),
+ * returning NULL if we don't have the signal (e.g. if it was overwritten)
+ */
+static struct cond_signal *
+pair_cond_wakeup(struct array *signals, struct cond_wakeup *wakeup)
+{
+    struct cond_signal key = { .cond = wakeup->cond,
+                               .seq = wakeup->seq_before + 1 };
+    int lo = 0, hi = signals->len;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct cond_signal *signal =
+            array_element_at(signals, struct cond_signal, mid);
+
+        if (cond_signal_cmp_cb(signal, &key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (int i = lo; i < signals->len; i++) {
+        struct cond_signal *signal =
+            array_element_at(signals, struct cond_signal, i);
+
+        if (signal->cond != wakeup->cond || signal->seq > wakeup->seq)
+            break;
+
+        if (signal->broadcast || !signal->claimed) {
+            signal->claimed = true;
+            return signal;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+cond_stats_cmp_cb(const void *v0, const void *v1)
+{
+    const struct cond_stats *stats0 = *(struct cond_stats **)v0;
+    const struct cond_stats *stats1 = *(struct cond_stats **)v1;
+    uint64_t total0 = stats0->latency.total_ns;
+    uint64_t total1 = stats1->latency.total_ns;
+
+    return total0 > total1 ? -1 : total0 < total1 ? 1 : 0;
+}
+
+#define COND_WAKEUP_SUMMARY_LEN 5
+
+/* Reports the latency from condition variables being signalled until the
+ * waiters they woke up were running (i.e. returned from waiting, having
+ * reacquired the mutex), across all the threads of a process
+ */
+static JsonNode *
+_js_process_cond_wakeups(struct ut_client **clients, int n_clients, int pid)
+{
+    JsonNode *js_conds = json_mkarray();
+    struct cond_wakeup_state state;
+
+    array_init(&state.signals, sizeof(struct cond_signal), 64);
+    array_init(&state.wakeups, sizeof(struct cond_wakeup), 64);
+    array_init(&state.all_stats, sizeof(struct cond_stats *), 16);
+
+    for (int i = 0; i < n_clients; i++) {
+        if (clients[i]->info->pid != pid)
+            continue;
+
+        client_get_task_arg_names(clients[i], &state.arg_names);
+        client_for_each_task(clients[i], cond_wakeup_cb, &state);
+        array_free(&state.arg_names);
+    }
+
+    qsort(state.signals.data, state.signals.len, sizeof(struct cond_signal),
+          cond_signal_cmp_cb);
+    qsort(state.wakeups.data, state.wakeups.len, sizeof(struct cond_wakeup),
+          cond_wakeup_cmp_cb);
+
+    for (int i = 0; i < state.signals.len; i++) {
+        struct cond_signal *signal =
+            array_element_at(&state.signals, struct cond_signal, i);
+
+        get_cond_stats(&state, signal->cond)->n_signals++;
+    }
+
+    for (int i = 0; i < state.wakeups.len; i++) {
+        struct cond_wakeup *wakeup =
+            array_element_at(&state.wakeups, struct cond_wakeup, i);
+        struct cond_stats *stats = get_cond_stats(&state, wakeup->cond);
+        struct cond_signal *signal = pair_cond_wakeup(&state.signals, wakeup);
+
+        stats->n_wakeups++;
+        if (!signal || signal->timestamp > wakeup->timestamp)
+            continue;
+
+        stats->n_paired++;
+        histogram_add(&stats->latency,
+                      wakeup->timestamp - signal->timestamp, 1);
+    }
+
+    qsort(state.all_stats.data, state.all_stats.len,
+          sizeof(struct cond_stats *), cond_stats_cmp_cb);
+
+    for (int i = 0; i < state.all_stats.len; i++) {
+        struct cond_stats *stats = array_value_at(&state.all_stats,
+                                                  struct cond_stats *, i);
+        struct ut_shared_task_histogram *latency = &stats->latency;
+        JsonNode *js_cond = json_mkobject();
+        char address[32];
+
+        snprintf(address, sizeof(address), "0x%llx",
+                 (unsigned long long)stats->cond);
+        json_append_member(js_cond, "cond", json_mkstring(address));
+        json_append_member(js_cond, "signals", json_mknumber(stats->n_signals));
+        json_append_member(js_cond, "wakeups", json_mknumber(stats->n_wakeups));
+        json_append_member(js_cond, "paired", json_mknumber(stats->n_paired));
+
+        json_append_member(js_cond, "latency",
+                           _js_histogram_summary(latency));
+
+        if (verbose && latency->count && i < COND_WAKEUP_SUMMARY_LEN) {
+            fprintf(stderr, "pid %d: cond %s: %llu wakeups, signal to run "
+                    "latency p50 = %.3f ms, p99 = %.3f ms, max = %.3f ms\n",
+                    pid, address,
+                    (unsigned long long)stats->n_paired,
+                    histogram_percentile(latency, 50) / 1e6,
+                    histogram_percentile(latency, 99) / 1e6,
+                    latency->max_ns / 1e6);
+        }
+
+        json_append_element(js_conds, js_cond);
+        free(stats);
+    }
+
+    array_free(&state.all_stats);
+    array_free(&state.wakeups);
+    array_free(&state.signals);
+
+    return js_conds;
+}
+
+/* Reports analysis that spans all the threads of each process */
+static void
+append_process_reports(JsonNode *top, struct ut_client **clients, int n_clients)
+{
+    for (int i = 0; i < n_clients; i++) {
+        int pid = clients[i]->info->pid;
+        JsonNode *js_process;
+        bool seen = false;
+
+        for (int j = 0; j < i && !seen; j++)
+            seen = clients[j]->info->pid == pid;
+        if (seen)
+            continue;
+
+        js_process = json_mkobject();
+        json_append_member(js_process, "type", json_mkstring("process"));
+        json_append_member(js_process, "name",
+                           json_mkstring(clients[i]->process_name));
+        json_append_member(js_process, "pid", json_mknumber(pid));
+        json_append_member(js_process, "lock_contention",
+                           _js_process_lock_contention(clients, n_clients,
+                                                       pid));
+        json_append_member(js_process, "cond_wakeups",
+                           _js_process_cond_wakeups(clients, n_clients, pid));
+        json_append_element(top, js_process);
+    }
+}
+
+/* Parses a cpulist as found in sysfs, e.g. "0-3,8-11" */
+static bool
+parse_cpulist(const char *str, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+
+    while (*str) {
+        char *end;
+        long first = strtol(str, &end, 10);
+        long last = first;
+
+        if (end == str)
+            return false;
+
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str)
+                return false;
+        }
+
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, set);
+
+        str = end;
+        if (*str == ',')
+            str++;
+        else if (*str != '\0')
+            return false;
+    }
+
+    return true;
+}
+
+/* Migrate to the CPUs of the given NUMA node so that we read the circular
+ * buffers that clients bound to that node without crossing sockets.
+ */
+static bool
+pin_to_numa_node(int node)
+{
+    char filename[64];
+    char cpulist[256];
+    cpu_set_t set;
+
+    snprintf(filename, sizeof(filename),
+             "/sys/devices/system/node/node%d/cpulist", node);
+    if (!ut_read_file_string(filename, cpulist, sizeof(cpulist)) ||
+        !parse_cpulist(cpulist, &set) ||
+        CPU_COUNT(&set) == 0)
+    {
+        dbg("Failed to determine CPUs for NUMA node %d\n", node);
+        return false;
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        dbg("Failed to pin to NUMA node %d: %m\n", node);
+        return false;
+    }
+
+    return true;
+}
+
+static void
+capture_data(void)
+{
+    struct ut_client *stopped_clients[all_clients.len];
+    JsonNode *js_clients[all_clients.len];
     int n_stopped_clients = 0;
+    cpu_set_t orig_affinity;
     JsonNode *top;
+    char *json;
     uint64_t epoch = 0;
     struct ancillary_buffer *ancillary;
+    uint64_t start_time = uv_hrtime();
+    uint64_t stopped_time, decoded_time, encoded_time, written_time;
 
     for (int i = 0; i < all_clients.len; i++) {
         struct ut_client *client = array_value_at(&all_clients, struct ut_client *, i);
@@ -491,7 +3455,11 @@ capture_data(void)
 
         dbg("> client thread id = %d\n", client->info->tid);
 
-        update_client_names(client);
+        /* Note: a client we already know has exited (e.g. loaded from a crash
+         * dump) may have had its pid/tid reused so we mustn't touch it
+         */
+        if (!client->exited)
+            update_client_names(client);
         dbg("> client thread name = \"%s\"\n", client->thread_name);
 
         /* PTRACE_SEIZE + _INTERRUPT gives as a no-side-effect way of stopping
@@ -500,7 +3468,7 @@ capture_data(void)
          * threads too.
          */
         err = 0;
-        ret = ptrace(PTRACE_SEIZE, client->info->tid, 0, 0);
+        ret = client->exited ? 0 : ptrace(PTRACE_SEIZE, client->info->tid, 0, 0);
         if (ret < 0) {
             err = errno;
             if (err == ESRCH) {
@@ -538,37 +3506,113 @@ capture_data(void)
     }
 
     dbg("All clients stopped; ready to read data\n");
+    stopped_time = uv_hrtime();
+
+    for (int i = 0; i < n_stopped_clients; i++)
+        client_drain(stopped_clients[i], true);
 
     qsort(stopped_clients, n_stopped_clients, sizeof(void *),
           sort_clients_cb);
 
+    for (int i = 0; i < n_stopped_clients && epoch == 0; i++)
+        epoch = _client_oldest_timestamp(stopped_clients[i]);
+
+    /* On NUMA systems we read the clients bound to each node in turn while
+     * pinned to that node, and otherwise we just have one pass for all
+     * clients (node -1)
+     */
+    if (n_numa_nodes > 1)
+        sched_getaffinity(0, sizeof(orig_affinity), &orig_affinity);
+
+    for (int node = -1; node < n_numa_nodes; node++) {
+        bool pinned = false;
+
+        for (int i = 0; i < n_stopped_clients; i++) {
+            struct ut_client *client = stopped_clients[i];
+            int client_node = n_numa_nodes > 1 ? client->info->numa_node : -1;
+            JsonNode *js_client;
+            JsonNode *js_process_name, *js_thread_name;
+            JsonNode *js_client_type;
+
+            if (client_node < -1 || client_node >= n_numa_nodes)
+                client_node = -1;
+            if (client_node != node)
+                continue;
+
+            if (node >= 0 && !pinned) {
+                dbg("reading clients bound to NUMA node %d\n", node);
+                pinned = pin_to_numa_node(node);
+            }
+
+            js_client = json_mkobject();
+
+            js_client_type = json_mkstring("thread");
+            json_append_member(js_client, "type", js_client_type);
+
+            js_process_name = json_mkstring(client->process_name);
+            json_append_member(js_client, "name", js_process_name);
+
+            js_thread_name = json_mkstring(client->thread_name);
+            json_append_member(js_client, "thread_name", js_thread_name);
+
+            dbg("client %s:%s n_samples = %llu\n",
+                client->process_name,
+                client->thread_name,
+                (unsigned long long)ut_load_acquire(&client->info->n_samples_written));
+
+            _js_client_append_ancillary_data(js_client, client);
+            _js_client_append_lost_data_stats(js_client, client,
+                                              &client->rings[0], "lost");
+            if (client->n_rings > 1) {
+                _js_client_append_lost_data_stats(js_client, client,
+                                                  &client->rings[1],
+                                                  "priority_lost");
+            }
+            _js_client_append_overhead_stats(js_client, client);
+            _js_client_append_samples(js_client, client, epoch);
+            _js_client_append_task_stats(js_client, client);
+            _js_client_append_fd_stats(js_client, client);
+            _js_client_append_io_stats(js_client, client);
+            _js_client_append_event_loop_stats(js_client, client, epoch);
+            _js_client_append_alloc_stats(js_client, client);
+            _js_client_append_off_cpu_stats(js_client, client);
+            js_clients[i] = js_client;
+        }
+    }
+
+    if (n_numa_nodes > 1)
+        sched_setaffinity(0, sizeof(orig_affinity), &orig_affinity);
+
     top = json_mkarray();
 
-    for (int i = 0; i < n_stopped_clients; i++) {
-        struct ut_client *client = stopped_clients[i];
-        JsonNode *js_client = json_mkobject();
-        JsonNode *js_process_name, *js_thread_name;
-        JsonNode *js_client_type = json_mkstring("thread");
+    for (int i = 0; i < n_stopped_clients; i++)
+        json_append_element(top, js_clients[i]);
 
-        json_append_member(js_client, "type", js_client_type);
+    append_process_reports(top, stopped_clients, n_stopped_clients);
 
-        js_process_name = json_mkstring(client->process_name);
-        json_append_member(js_client, "name", js_process_name);
+    decoded_time = uv_hrtime();
 
-        js_thread_name = json_mkstring(client->thread_name);
-        json_append_member(js_client, "thread_name", js_thread_name);
+    json = json_encode(top);
+    encoded_time = uv_hrtime();
 
-        dbg("client %s:%s n_samples = %d\n",
-            client->process_name,
-            client->thread_name,
-            client->info->n_samples_written);
+    fprintf(stdout, "%s", json);
+    fflush(stdout);
+    written_time = uv_hrtime();
 
-        _js_client_append_ancillary_data(js_client, client);
-        _js_client_append_samples(js_client, client, &epoch);
-        json_append_element(top, js_client);
+    if (bench_mode) {
+        fprintf(stderr, "capture: clients=%d stop_ms=%.3f decode_ms=%.3f "
+                "encode_ms=%.3f write_ms=%.3f total_ms=%.3f "
+                "output_bytes=%zu\n",
+                n_stopped_clients,
+                (stopped_time - start_time) / 1e6,
+                (decoded_time - stopped_time) / 1e6,
+                (encoded_time - decoded_time) / 1e6,
+                (written_time - encoded_time) / 1e6,
+                (written_time - start_time) / 1e6,
+                strlen(json));
     }
 
-    fprintf(stdout, "%s", json_encode(top));
+    free(json);
     json_delete(top);
 
     /* don't explicitly detach from ptrace, since we're about to exit anyway */
@@ -582,14 +3626,283 @@ signal_cb(uv_poll_t *handle, int status, int events)
     exit(0);
 }
 
+/* Loads a dump written by libut's crash handler, which contains a copy of all
+ * the circular buffers and ancillary data for a process.
+ */
+static bool
+load_crash_dump(const char *filename)
+{
+    struct ut_dump_header *header;
+    struct stat sb;
+    struct ut_client *current_client = NULL;
+    uint8_t *buf;
+    size_t offset;
+    int fd;
+
+    fd = open(filename, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open crash dump %s: %m\n", filename);
+        return false;
+    }
+
+    fstat(fd, &sb);
+    buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to mmap crash dump: %m\n");
+        return false;
+    }
+
+    header = (void *)buf;
+    if (sb.st_size < sizeof(*header) || header->magic != UT_DUMP_MAGIC) {
+        fprintf(stderr, "%s is not a libut crash dump\n", filename);
+        return false;
+    }
+    if (header->abi_version != UT_ABI_VERSION) {
+        fprintf(stderr, "Incompatible crash dump ABI version\n");
+        return false;
+    }
+
+    fprintf(stderr, "Loading crash dump for pid %u (thread %u received "
+            "signal %u)\n", header->pid, header->crashed_tid, header->signal);
+
+    for (offset = sizeof(*header); offset + sizeof(struct ut_dump_record) <= sb.st_size; ) {
+        struct ut_dump_record *record = (void *)(buf + offset);
+        uint8_t *data = buf + offset + sizeof(*record);
+        struct ut_client *client;
+
+        offset += sizeof(*record) + record->size;
+        if (offset > sb.st_size) {
+            fprintf(stderr, "Truncated crash dump\n");
+            break;
+        }
+
+        switch (record->type) {
+        case UT_DUMP_CIRCULAR_BUFFER:
+            if (record->size <= header->page_size) {
+                fprintf(stderr, "Spurious circular buffer in crash dump\n");
+                current_client = NULL;
+                break;
+            }
+            client = create_client_for_buffer(data, record->size,
+                                              header->page_size);
+            snprintf(client->process_name, sizeof(client->process_name),
+                     "%d", client->info->pid);
+            snprintf(client->thread_name, sizeof(client->thread_name),
+                     "%d", client->info->tid);
+
+            /* Note: the tid may well have been reused since the crash, so
+             * make sure we don't try to stop it
+             */
+            client->exited = true;
+            current_client = client;
+            break;
+        case UT_DUMP_ANCILLARY:
+            /* Ancillary data belongs to the preceding circular buffer */
+            if (current_client && current_client->info->tid == record->tid)
+                client_add_ancillary_data(current_client, -1, data,
+                                          record->size);
+            else
+                fprintf(stderr, "Spurious ancillary data for thread %u in "
+                        "crash dump\n", record->tid);
+            break;
+        default:
+            fprintf(stderr, "Unknown crash dump record type %u\n", record->type);
+            break;
+        }
+    }
+
+    return all_clients.len > 0;
+}
+
+static void
+update_category_masks(void)
+{
+    for (int i = 0; i < all_clients.len; i++) {
+        struct ut_client *client = array_value_at(&all_clients, struct ut_client *, i);
+
+        if (client->writable && !client->exited)
+            client->info->category_mask = category_mask;
+    }
+
+    fprintf(stderr, "Enabled task categories:");
+    for (int i = 0; i < UT_N_CATEGORIES; i++) {
+        if (category_mask & (1ULL << i))
+            fprintf(stderr, " %s", ut_get_category_name(i));
+    }
+    fprintf(stderr, "\n");
+}
+
+/* Handles commands for changing the enabled task categories of running
+ * clients, one per line:
+ *
+ *   categories <list>  - enable only the given categories
+ *   enable <list>      - enable the given categories
+ *   disable <list>     - disable the given categories
+ *
+ * where <list> is a comma separated list of category names, or "all".
+ */
+static void
+handle_command(char *line)
+{
+    char *cmd = strtok(line, " \t");
+    char *arg = strtok(NULL, " \t");
+    uint64_t mask;
+
+    if (!cmd)
+        return;
+
+    if (!arg || !ut_parse_category_mask(arg, &mask)) {
+        fprintf(stderr, "Usage: categories|enable|disable <category,...>\n");
+        return;
+    }
+
+    if (strcmp(cmd, "categories") == 0)
+        category_mask = mask;
+    else if (strcmp(cmd, "enable") == 0)
+        category_mask |= mask;
+    else if (strcmp(cmd, "disable") == 0)
+        category_mask &= ~mask;
+    else {
+        fprintf(stderr, "Unknown command \"%s\"\n", cmd);
+        return;
+    }
+
+    category_mask_set = true;
+    update_category_masks();
+}
+
+static void
+stdin_cb(uv_poll_t *handle, int status, int events)
+{
+    static char buf[1024];
+    static int len;
+    char *newline;
+    ssize_t ret;
+
+    ret = read(STDIN_FILENO, buf + len, sizeof(buf) - len - 1);
+    if (ret <= 0) {
+        uv_poll_stop(handle);
+        return;
+    }
+    len += ret;
+    buf[len] = '\0';
+
+    while ((newline = strchr(buf, '\n'))) {
+        *newline = '\0';
+        handle_command(buf);
+        len -= newline + 1 - buf;
+        memmove(buf, newline + 1, len + 1);
+    }
+
+    /* discard overly long lines */
+    if (len == sizeof(buf) - 1)
+        len = 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: ut-server [options]\n"
+            "\n"
+            "  -a, --attach=INDEX   Capture the file-backed buffers of a process\n"
+            "                       running in flight-recorder mode, e.g.\n"
+            "                       /dev/shm/ut-<pid>.index, and exit\n"
+            "  -l, --load-dump=FILE Capture the contents of a crash dump written\n"
+            "                       by libut (see UT_CRASH_DUMP), and exit\n"
+            "  -c, --categories=LIST\n"
+            "                       Only trace the given comma separated task\n"
+            "                       categories (app, io, locks, gl, memory,\n"
+            "                       wait or all). The categories can\n"
+            "                       also be changed while running, via\n"
+            "                       'categories|enable|disable LIST' commands\n"
+            "                       on stdin\n"
+            "  -b, --bench          Report how long each phase of a capture\n"
+            "                       takes (on stderr)\n"
+            "  -v, --verbose        Also summarize the statistics of each\n"
+            "                       thread and process (on stderr)\n"
+            "  -d, --drain-limit=N  Keep at most the most recent N samples\n"
+            "                       drained from each lossless buffer\n"
+            "                       (default 1048576)\n"
+            "  -h, --help           Display this help\n");
+}
+
 int
 main(int argc, char **argv)
 {
     uv_loop_t *loop = uv_default_loop();
     sigset_t mask;
+    const char *attach_index = NULL;
+    const char *dump_filename = NULL;
+    int opt;
+
+    static const struct option long_options[] = {
+        { "attach", required_argument, 0, 'a' },
+        { "load-dump", required_argument, 0, 'l' },
+        { "categories", required_argument, 0, 'c' },
+        { "bench", no_argument, 0, 'b' },
+        { "verbose", no_argument, 0, 'v' },
+        { "drain-limit", required_argument, 0, 'd' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "a:l:c:bvd:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            attach_index = optarg;
+            break;
+        case 'l':
+            dump_filename = optarg;
+            break;
+        case 'c':
+            if (!ut_parse_category_mask(optarg, &category_mask))
+                exit(1);
+            category_mask_set = true;
+            break;
+        case 'b':
+            bench_mode = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'd': {
+            char *end;
+            long limit;
+
+            errno = 0;
+            limit = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || errno == ERANGE ||
+                limit < 1 || limit > INT_MAX) {
+                fprintf(stderr, "Invalid drain limit %s\n", optarg);
+                exit(1);
+            }
+            drain_limit = limit;
+            break;
+        }
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
 
     array_init(&all_clients, sizeof(void *), 128);
 
+    n_numa_nodes = ut_get_numa_node_count();
+
+    if (attach_index || dump_filename) {
+        if (attach_index && !attach_flight_recorder(attach_index))
+            exit(1);
+        if (dump_filename && !load_crash_dump(dump_filename))
+            exit(1);
+        capture_data();
+        exit(0);
+    }
+
     listener_fd = listen_on_abstract_socket("ut-conductor");
 
     uv_poll_init(loop, &listener_poll, listener_fd);
@@ -609,6 +3922,14 @@ main(int argc, char **argv)
     uv_poll_init(loop, &signal_poll, signal_poll_fd);
     uv_poll_start(&signal_poll, UV_READABLE, signal_cb);
 
+    /* Note: this fails if stdin is a regular file, e.g. /dev/null */
+    if (uv_poll_init(loop, &stdin_poll, STDIN_FILENO) == 0)
+        uv_poll_start(&stdin_poll, UV_READABLE, stdin_cb);
+
+    uv_timer_init(loop, &drain_timer);
+    uv_timer_start(&drain_timer, drain_timer_cb,
+                   DRAIN_INTERVAL_MS, DRAIN_INTERVAL_MS);
+
     fprintf(stderr, "%d listening for clients\n", (int)getpid());
     uv_run(loop, 0);
 }
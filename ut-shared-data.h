@@ -16,12 +16,19 @@
 #include "ut.h"
 
 
-#define UT_ABI_VERSION 0xf00baaa1
+#define UT_ABI_VERSION 0xf00baab1
+
+#define ut_load_acquire(PTR) __atomic_load_n(PTR, __ATOMIC_ACQUIRE)
 
 
 /*
  * A header page infront of each circular buffer of sample data
  */
+enum ut_ring_mode {
+    UT_RING_OVERWRITE = 0, /* overwrite the oldest samples when full */
+    UT_RING_LOSSLESS,
+};
+
 struct ut_info_page {
     uint32_t abi_version;
 
@@ -29,16 +36,103 @@ struct ut_info_page {
     uint32_t tid;
 
     uint32_t sample_size;
-    uint32_t n_samples_written;
+
+    /* Note: 64bit so that this never wraps for long running processes.
+     *
+     * Written by the client with release semantics, so should be read with
+     * acquire semantics (see ut_load_acquire())
+     */
+    uint64_t n_samples_written;
+
+    /* The client only publishes n_samples_written every commit_batch samples
+     * and when the buffer is full may be in the middle of overwriting this
+     * many of the oldest samples.
+     */
+    uint32_t commit_batch;
+
+    /* The NUMA node the buffer was bound to when allocated, or -1 if
+     * unknown/not bound (e.g. on single node systems)
+     */
+    int32_t numa_node;
+
+    /* Only emit a backtrace at the end of a task if its duration was
+     * greater than backtrace_delta_threshold nanoseconds
+     */
+    uint32_t backtrace_n_frames;
+    uint64_t backtrace_delta_threshold;
+
+    /* Accounting for data that was lost, so the server can report how
+     * much history a capture is missing...
+     */
+    uint64_t n_samples_overwritten; /* older samples overwritten after wrapping */
+    uint64_t n_samples_dropped; /* samples that couldn't be recorded at all */
+    uint32_t n_ancillary_alloc_failures; /* e.g. task descriptions lost */
+
+    /* In lossless mode the client never overwrites samples that the server
+     * hasn't read yet. The server periodically drains the buffer and
+     * advances n_samples_read, and increments read_futex to wake up any
+     * client waiting for space.
+     */
+    uint32_t ring_mode; /* enum ut_ring_mode */
+    uint32_t read_futex;
+    uint64_t n_samples_read; /* written by the server */
+    uint32_t n_waiters;
+
+    /* The number of times the client had to wait for the server to make
+     * space in the buffer and the total time spent waiting
+     */
+    uint64_t n_stalls;
+    uint64_t stall_ns;
+
+    /* The number of times the client gave up waiting for space, after
+     * which it falls back to overwrite mode
+     */
+    uint32_t n_lossless_timeouts;
+
+    /* Samples for high priority tasks are written to a separate, smaller
+     * ring which directly follows the main ring in the same mapping and has
+     * its own info page. The offset is relative to the start of this info
+     * page and the size includes the second info page.
+     *
+     * Both are zero for the info page of the priority ring itself.
+     */
+    uint64_t priority_ring_offset;
+    uint64_t priority_ring_size;
+
+    /* A bitmask of enabled task categories (1 << enum ut_task_category),
+     * which the server may update at any time. Only the main ring's info
+     * page is checked.
+     */
+    uint64_t category_mask;
+
+    /* libut's own overhead on this thread. The time spent in
+     * ut_push/pop_task() is estimated by timing 1 in overhead_sample_period
+     * calls (see UT_OVERHEAD_SAMPLE_PERIOD) and is scaled up accordingly,
+     * while registering task descriptions and allocating buffers are always
+     * timed, and are excluded from the event overhead.
+     *
+     * Only updated in the main ring's info page.
+     */
+    uint32_t overhead_sample_period;
+    uint64_t n_timed_events;
+    uint64_t event_overhead_ns;
+    uint64_t n_registrations;
+    uint64_t registration_overhead_ns;
+    uint64_t n_allocations;
+    uint64_t allocation_overhead_ns;
 };
 
 enum ut_sample_type {
     UT_SAMPLE_TASK_PUSH = 1,
     UT_SAMPLE_TASK_POP,
-    UT_SAMPLE_TASK_BACKTRACE
+    UT_SAMPLE_TASK_BACKTRACE,
+    UT_SAMPLE_TASK_CHECKPOINT,
+    UT_SAMPLE_TASK_ARGS,
+    UT_SAMPLE_LOCK_HOLD,
 };
 
 #define MAX_BACKTRACE_SIZE 10
+#define UT_CHECKPOINT_ENTRIES 6
 
 /* Note: all samples in the circular buffer have the same size which allows us
  * to safely overwrite old data without damaging the integrity of old
@@ -68,18 +162,66 @@ struct ut_sample {
              */
             uint16_t stack_pointer;
             uint8_t cpu;
-            uint8_t padding;
+
+            /* With adaptive sampling (see UT_EVENT_BUDGET) only 1 in
+             * (1 << period_log2) instances of a task may be recorded, which
+             * the server accounts for in its statistics
+             */
+            uint8_t period_log2;
 
             //uint64_t tsc;
             uint64_t timestamp;
         };
         void *addresses[MAX_BACKTRACE_SIZE];
+
+        /* A snapshot of the thread's task stack that's periodically written
+         * so that tasks which were started before the oldest sample retained
+         * in the circular buffer can still be reconstructed after the buffer
+         * has wrapped. A deep stack is split across multiple consecutive
+         * samples with the same timestamp.
+         */
+        struct {
+            uint16_t stack_depth;
+            uint16_t first_entry; /* stack index of task_desc_indices[0] */
+            uint16_t n_entries;
+            uint16_t padding;
+            uint64_t timestamp;
+            uint16_t task_desc_indices[UT_CHECKPOINT_ENTRIES];
+            uint16_t padding2[2];
+            uint64_t start_times[UT_CHECKPOINT_ENTRIES];
+        } checkpoint;
+
+        /* Values recorded via ut_pop_task_args(), which directly follow the
+         * pop sample of the same task instance (named by a
+         * UT_ANCILLARY_TASK_ARG_NAMES record)
+         */
+        struct {
+            uint16_t task_desc_index;
+            uint16_t n_args;
+            uint32_t padding;
+            int64_t values[UT_MAX_TASK_ARGS];
+        } args;
+
+        /* A lock that was held from acquire_timestamp until timestamp (see
+         * ut_lock_released()), if another thread was waiting for it or it
+         * was held for longer than UT_LOCK_HOLD_THRESHOLD_NS
+         */
+        struct {
+            uint16_t contended;
+            uint16_t padding[3];
+            uint64_t lock; /* address */
+            uint64_t acquire_timestamp;
+            uint64_t timestamp;
+        } lock_hold;
     };
 } __attribute__((aligned(8)));
 
 
 enum ut_ancillary_record_type {
     UT_ANCILLARY_TASK_DESC = 1,
+    UT_ANCILLARY_TASK_HISTOGRAM,
+    UT_ANCILLARY_TASK_ARG_NAMES,
+    UT_ANCILLARY_FD_NAME,
 };
 
 struct ut_ancillary_record {
@@ -90,9 +232,159 @@ struct ut_ancillary_record {
 
 struct ut_shared_task_desc {
     uint16_t idx;
-    char name[62];
+    uint8_t category;
+    uint8_t wait_reason;
+    char name[60];
+}__attribute__((aligned(8)));
+
+/* The names of the values recorded for a task via ut_pop_task_args(), written
+ * along with its task description if task_desc->args is set
+ */
+#define UT_TASK_ARG_NAME_LEN 16
+
+struct ut_shared_task_arg_names {
+    uint16_t task_desc_idx;
+    uint16_t n_args;
+    uint32_t padding;
+    char names[UT_MAX_TASK_ARGS][UT_TASK_ARG_NAME_LEN];
+}__attribute__((aligned(8)));
+
+/* Names a file descriptor from the given timestamp onwards (see
+ * ut_set_fd_name()). Since file descriptors are shared by all threads, the
+ * server looks up names across all the clients of a process. The record is
+ * sized to fit the nul terminated name, which is empty if the name has been
+ * cleared (e.g. when the fd is closed).
+ */
+#define UT_FD_NAME_MAX 256
+
+struct ut_shared_fd_name {
+    int32_t fd;
+    uint32_t padding;
+    uint64_t timestamp;
+    char name[];
+}__attribute__((aligned(8)));
+
+/* With UT_HISTOGRAMS=1 the client keeps a histogram of the durations of
+ * each task, per-thread, which it updates in place whenever a task is
+ * popped. Unlike the samples in the circular buffer these are never
+ * overwritten so the server can report statistics over the lifetime of
+ * the thread.
+ *
+ * Durations (in nanoseconds) are counted in log-linear buckets (like an
+ * HDR histogram): values below (1 << UT_HISTOGRAM_SUB_BUCKET_BITS) each have
+ * their own bucket and above that each power of two range is split into
+ * (1 << UT_HISTOGRAM_SUB_BUCKET_BITS) linear sub-buckets, so the width of a
+ * bucket is at most 1/8 of its lower bound. Durations of
+ * (1 << UT_HISTOGRAM_MAX_LOG2) nanoseconds (~18 minutes) or more are counted
+ * in the last bucket.
+ *
+ * Tasks that were sampled (see UT_EVENT_BUDGET) are counted with a weight of
+ * their sampling period.
+ */
+#define UT_HISTOGRAM_SUB_BUCKET_BITS 3
+#define UT_HISTOGRAM_MAX_LOG2 40
+#define UT_HISTOGRAM_N_BUCKETS \
+    ((UT_HISTOGRAM_MAX_LOG2 - UT_HISTOGRAM_SUB_BUCKET_BITS + 1) << \
+     UT_HISTOGRAM_SUB_BUCKET_BITS)
+
+struct ut_shared_task_histogram {
+    uint16_t task_desc_idx;
+    uint16_t padding[3];
+
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+
+    uint64_t buckets[UT_HISTOGRAM_N_BUCKETS];
 }__attribute__((aligned(8)));
 
+static inline int
+ut_histogram_bucket_index(uint64_t value)
+{
+    const int sub_bits = UT_HISTOGRAM_SUB_BUCKET_BITS;
+    int log2;
+
+    if (value < (1ULL << sub_bits))
+        return value;
+    if (value >= (1ULL << UT_HISTOGRAM_MAX_LOG2))
+        return UT_HISTOGRAM_N_BUCKETS - 1;
+
+    log2 = 63 - __builtin_clzll(value);
+
+    return (((log2 - sub_bits + 1) << sub_bits) +
+            ((value >> (log2 - sub_bits)) & ((1 << sub_bits) - 1)));
+}
 
+/* The smallest value that's counted in the given bucket */
+static inline uint64_t
+ut_histogram_bucket_start(int index)
+{
+    const int sub_bits = UT_HISTOGRAM_SUB_BUCKET_BITS;
+    int log2;
 
+    if (index < (1 << sub_bits))
+        return index;
 
+    log2 = (index >> sub_bits) + sub_bits - 1;
+
+    return (((1ULL << sub_bits) | (index & ((1 << sub_bits) - 1))) <<
+            (log2 - sub_bits));
+}
+
+
+/*
+ * In serverless, flight-recorder mode the circular buffers and ancillary
+ * data buffers are backed by files (e.g. under /dev/shm) and each process
+ * maintains an index file named ut-<pid>.index in the same directory which
+ * lists all the buffers for all of its threads.
+ *
+ * The index is an append-only sequence of fixed size entries, where
+ * filenames are relative to the directory of the index.
+ */
+enum ut_index_entry_type {
+    UT_INDEX_CIRCULAR_BUFFER = 1,
+    UT_INDEX_ANCILLARY,
+};
+
+struct ut_index_entry {
+    uint32_t type;
+    uint32_t tid;
+    uint32_t serial; /* distinguishes threads that reuse the same tid */
+    char filename[244];
+};
+
+
+/*
+ * If enabled, libut writes a crash dump from a fatal signal handler with the
+ * contents of all circular buffers and ancillary data buffers for all
+ * threads, which ut-server --load-dump can read like a normal capture.
+ *
+ * A dump is a struct ut_dump_header followed by a sequence of records, each
+ * with a struct ut_dump_record header followed by record->size bytes of
+ * data. For UT_DUMP_CIRCULAR_BUFFER records the data is laid out as it is in
+ * memory with a page_size info page followed by the samples. Each thread's
+ * UT_DUMP_ANCILLARY records directly follow its UT_DUMP_CIRCULAR_BUFFER
+ * record (the tid alone is ambiguous since tids may be reused).
+ */
+#define UT_DUMP_MAGIC 0x504d4455 /* "UDMP" */
+
+struct ut_dump_header {
+    uint32_t magic;
+    uint32_t abi_version;
+    uint32_t pid;
+    uint32_t page_size;
+    uint32_t signal;
+    uint32_t crashed_tid;
+};
+
+enum ut_dump_record_type {
+    UT_DUMP_CIRCULAR_BUFFER = 1,
+    UT_DUMP_ANCILLARY,
+};
+
+struct ut_dump_record {
+    uint32_t type;
+    uint32_t tid;
+    uint64_t size;
+};
@@ -32,6 +32,7 @@
 #include <fcntl.h>
 
 #include "ut-utils.h"
+#include "ut-shared-data.h"
 
 #define UT_API_WRAPPER_DSO_NAME "libut-sysapiwrappers.so"
 
@@ -95,6 +96,16 @@ ut_untraced_read(int fd, void *buf, size_t count)
     return real_read(fd, buf, count);
 }
 
+ssize_t
+ut_untraced_write(int fd, const void *buf, size_t count)
+{
+    static ssize_t (*real_write)(int fd, const void *buf, size_t count);
+
+    FIND_UNTRACED_SYM(write);
+
+    return real_write(fd, buf, count);
+}
+
 void *
 ut_untraced_malloc(size_t size)
 {
@@ -145,6 +156,59 @@ ut_untraced_recvmsg(int socket, void * msg, int flags)
     return real_recvmsg(socket, msg, flags);
 }
 
+int
+ut_untraced_connect(int sockfd, const void *addr, int addrlen)
+{
+    static int (*real_connect)(int sockfd, const void *addr, int addrlen);
+
+    FIND_UNTRACED_SYM(connect);
+
+    return real_connect(sockfd, addr, addrlen);
+}
+
+int
+ut_untraced_socket(int domain, int type, int protocol)
+{
+    static int (*real_socket)(int domain, int type, int protocol);
+
+    FIND_UNTRACED_SYM(socket);
+
+    return real_socket(domain, type, protocol);
+}
+
+int
+ut_untraced_close(int fd)
+{
+    static int (*real_close)(int fd);
+
+    FIND_UNTRACED_SYM(close);
+
+    return real_close(fd);
+}
+
+/* Note: libut's own locks mustn't be traced, otherwise the pthread_mutex_lock
+ * wrapper would recurse into libut while it's holding the lock
+ */
+int
+ut_untraced_pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    static int (*real_pthread_mutex_lock)(pthread_mutex_t *mutex);
+
+    FIND_UNTRACED_SYM(pthread_mutex_lock);
+
+    return real_pthread_mutex_lock(mutex);
+}
+
+int
+ut_untraced_pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    static int (*real_pthread_mutex_unlock)(pthread_mutex_t *mutex);
+
+    FIND_UNTRACED_SYM(pthread_mutex_unlock);
+
+    return real_pthread_mutex_unlock(mutex);
+}
+
 void
 ut_send_fd(int socket_fd, int fd)
 {
@@ -178,16 +242,34 @@ ut_send_fd(int socket_fd, int fd)
         dbg("Passed file descriptor: %d\n", fd);
 }
 
+/* Note: the index file is opened with O_APPEND and entries are small enough
+ * that each write is atomic, so multiple threads can append entries without
+ * any other synchronization.
+ */
+void
+ut_write_index_entry(int index_fd, const struct ut_index_entry *entry)
+{
+    if (ut_untraced_write(index_fd, entry, sizeof(*entry)) != sizeof(*entry))
+        dbg("Failed to write flight recorder index entry: %m\n");
+}
+
 uint8_t *
 ut_mmap_memfd_fd(int mem_fd, size_t size, int prot)
 {
-    ftruncate(mem_fd, size);
+    uint8_t *mem;
+
+    if (ftruncate(mem_fd, size) < 0) {
+        dbg("Failed to resize memfd to %zu bytes: %m\n", size);
+        return NULL;
+    }
 #ifndef ENABLE_VALGRIND_MEMFD_WORKAROUND
     fcntl(mem_fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL);
 #endif
 
     dbg("mmap...\n");
-    return ut_untraced_mmap(NULL, size, prot, MAP_SHARED, mem_fd, 0);
+    mem = ut_untraced_mmap(NULL, size, prot, MAP_SHARED, mem_fd, 0);
+
+    return mem == MAP_FAILED ? NULL : mem;
 }
 
 bool
@@ -213,6 +295,66 @@ ut_get_bool_env(const char *var)
     return false;
 }
 
+/* Parses a size in bytes with an optional K, M or G suffix */
+size_t
+ut_get_size_env(const char *var, size_t default_size)
+{
+    char *val = getenv(var);
+    char *end;
+    unsigned long long size;
+    size_t multiplier = 1;
+    size_t ret;
+
+    if (!val)
+        return default_size;
+
+    errno = 0;
+    size = strtoull(val, &end, 10);
+    switch (*end) {
+    case 'G': case 'g':
+        multiplier *= 1024;
+        /* fallthrough */
+    case 'M': case 'm':
+        multiplier *= 1024;
+        /* fallthrough */
+    case 'K': case 'k':
+        multiplier *= 1024;
+        end++;
+        break;
+    }
+
+    if (end == val || *end != '\0' || size == 0 || errno == ERANGE ||
+        __builtin_mul_overflow(size, multiplier, &ret)) {
+        fprintf(stderr, "unrecognised size for variable %s\n", var);
+        return default_size;
+    }
+
+    return ret;
+}
+
+/* Parses a plain decimal integer, such as a count or a time in ns, where
+ * unlike ut_get_size_env() 0 is a valid value
+ */
+uint64_t
+ut_get_uint_env(const char *var, uint64_t default_value)
+{
+    char *val = getenv(var);
+    char *end;
+    unsigned long long value;
+
+    if (!val)
+        return default_value;
+
+    errno = 0;
+    value = strtoull(val, &end, 10);
+    if (end == val || *end != '\0' || val[0] == '-' || errno == ERANGE) {
+        fprintf(stderr, "unrecognised value for variable %s\n", var);
+        return default_value;
+    }
+
+    return value;
+}
+
 int
 ut_read_file(const char *filename, void *buf, int max)
 {
@@ -228,7 +370,7 @@ ut_read_file(const char *filename, void *buf, int max)
 
     while ((n = read(fd, buf, max - 1)) < 0 && errno == EINTR)
         ;
-    close(fd);
+    ut_untraced_close(fd);
     if (n < 0)
         return 0;
 
@@ -243,14 +385,17 @@ ut_read_file_string(const char *filename, char *buf, int buf_len)
 
     memset(buf, 0, buf_len);
 
-    while ((fd = open(filename, 0)) < 0 && errno == EINTR)
+    /* Note: libut reads sysfs while initializing, so this mustn't be traced
+     * if the system api wrappers are preloaded
+     */
+    while ((fd = ut_untraced_open(filename, 0, 0)) < 0 && errno == EINTR)
         ;
     if (fd < 0)
         return false;
 
-    while ((n = read(fd, buf, buf_len - 1)) < 0 && errno == EINTR)
+    while ((n = ut_untraced_read(fd, buf, buf_len - 1)) < 0 && errno == EINTR)
         ;
-    close(fd);
+    ut_untraced_close(fd);
     if (n <= 0)
         return false;
 
@@ -271,7 +416,7 @@ ut_read_file_uint64(const char *filename)
 
     while ((n = read(fd, buf, sizeof(buf) - 1)) < 0 && errno == EINTR)
         ;
-    close(fd);
+    ut_untraced_close(fd);
     if (n < 0)
         return 0;
 
@@ -279,3 +424,102 @@ ut_read_file_uint64(const char *filename)
     return strtoull(buf, 0, 0);
 }
 
+
+/* Returns the number of NUMA nodes the kernel could ever bring online,
+ * which is 1 for non-NUMA machines or kernels built without NUMA support.
+ */
+int
+ut_get_numa_node_count(void)
+{
+    char buf[64];
+    char *last;
+
+    if (!ut_read_file_string("/sys/devices/system/node/possible",
+                             buf, sizeof(buf)))
+        return 1;
+
+    /* e.g. "0" or "0-1" or "0,2-3" or "0-1,3", where the highest node is
+     * the last one listed, or the upper bound of the last range
+     */
+    last = strrchr(buf, ',');
+    last = last ? last + 1 : buf;
+    if (strchr(last, '-'))
+        last = strchr(last, '-') + 1;
+
+    return strtol(last, NULL, 10) + 1;
+}
+
+static const char *category_names[] = {
+    [UT_CATEGORY_APP] = "app",
+    [UT_CATEGORY_IO] = "io",
+    [UT_CATEGORY_LOCKS] = "locks",
+    [UT_CATEGORY_GL] = "gl",
+    [UT_CATEGORY_MEMORY] = "memory",
+    [UT_CATEGORY_WAIT] = "wait",
+};
+
+static const char *wait_reason_names[] = {
+    [UT_WAIT_NONE] = "none",
+    [UT_WAIT_LOCK] = "lock",
+    [UT_WAIT_IO] = "io",
+    [UT_WAIT_NETWORK] = "network",
+    [UT_WAIT_SLEEP] = "sleep",
+    [UT_WAIT_POLL] = "poll",
+};
+
+const char *
+ut_get_category_name(int category)
+{
+    if (category < 0 || category >= ARRAY_SIZE(category_names))
+        return "unknown";
+
+    return category_names[category];
+}
+
+const char *
+ut_get_wait_reason_name(int wait_reason)
+{
+    if (wait_reason < 0 || wait_reason >= ARRAY_SIZE(wait_reason_names))
+        return "unknown";
+
+    return wait_reason_names[wait_reason];
+}
+
+/* Parses a comma separated list of category names, e.g. "io,locks", or
+ * "all" into a mask of (1 << enum ut_task_category) bits
+ */
+bool
+ut_parse_category_mask(const char *str, uint64_t *mask_ret)
+{
+    uint64_t mask = 0;
+
+    while (*str) {
+        size_t len = strcspn(str, ",");
+        bool found = false;
+
+        if (len == 3 && strncmp(str, "all", 3) == 0) {
+            mask = ~0ULL;
+            found = true;
+        }
+
+        for (int i = 0; !found && i < ARRAY_SIZE(category_names); i++) {
+            if (strlen(category_names[i]) == len &&
+                strncmp(str, category_names[i], len) == 0) {
+                mask |= 1ULL << i;
+                found = true;
+            }
+        }
+
+        if (!found) {
+            fprintf(stderr, "Unknown task category \"%.*s\"\n", (int)len, str);
+            return false;
+        }
+
+        str += len;
+        if (*str == ',')
+            str++;
+    }
+
+    *mask_ret = mask;
+    return true;
+}
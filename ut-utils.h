@@ -35,7 +35,9 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
+#define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(x, 0)
 
 #define MIN(a, b) ({ __typeof__ (a) _a_tmp = (a); \
@@ -64,11 +66,17 @@
 void *ut_untraced_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 int ut_untraced_open(const char *pathname, int flags, mode_t mode);
 ssize_t ut_untraced_read(int fd, void *buf, size_t count);
+ssize_t ut_untraced_write(int fd, const void *buf, size_t count);
 //void *ut_untraced_malloc(size_t size);
 //void *ut_untraced_realloc(void * ptr, size_t size);
 //void ut_untraced_free(void * ptr);
 ssize_t ut_untraced_sendmsg(int sockfd, const void * msg, int flags);
 ssize_t ut_untraced_recvmsg(int socket, void * msg, int flags);
+int ut_untraced_connect(int sockfd, const void *addr, int addrlen);
+int ut_untraced_socket(int domain, int type, int protocol);
+int ut_untraced_close(int fd);
+int ut_untraced_pthread_mutex_lock(pthread_mutex_t *mutex);
+int ut_untraced_pthread_mutex_unlock(pthread_mutex_t *mutex);
 
 static inline void *
 xmalloc(size_t size)
@@ -195,9 +203,20 @@ uint8_t *ut_mmap_memfd_fd(int mem_fd, size_t size, int prot);
 
 void ut_send_fd(int socket_fd, int fd);
 
+struct ut_index_entry;
+void ut_write_index_entry(int index_fd, const struct ut_index_entry *entry);
+
 bool ut_get_bool_env(const char *var);
+size_t ut_get_size_env(const char *var, size_t default_size);
+uint64_t ut_get_uint_env(const char *var, uint64_t default_value);
 
 int ut_read_file(const char *filename, void *buf, int max);
 bool ut_read_file_string(const char *filename, char *buf, int buf_len);
 uint64_t ut_read_file_uint64(const char *file);
 
+int ut_get_numa_node_count(void);
+
+const char *ut_get_category_name(int category);
+const char *ut_get_wait_reason_name(int wait_reason);
+bool ut_parse_category_mask(const char *str, uint64_t *mask_ret);
+
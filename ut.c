@@ -41,6 +41,12 @@
 #include <dlfcn.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <execinfo.h>
+#include <signal.h>
+
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
 
 #include "ut-utils.h"
 
@@ -51,16 +57,6 @@
 #include "ut-memfd-array.h"
 
 
-#if defined(__i386__)
-#define rmb()           __asm__ volatile("lock; addl $0,0(%%esp)" ::: "memory")
-#define mb()            __asm__ volatile("lock; addl $0,0(%%esp)" ::: "memory")
-#endif
-
-#if defined(__x86_64__)
-#define rmb()           __asm__ volatile("lfence" ::: "memory")
-#define mb()            __asm__ volatile("mfence" ::: "memory")
-#endif
-
 /* For internal use, to avoid recursion through traced hooks */
 void *ut_mmap_real(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 int ut_open_real(const char *pathname, int flags, mode_t mode);
@@ -74,15 +70,40 @@ ssize_t ut_real_recvmsg(int socket, void * msg, int flags);
 
 struct task_stack_entry {
     uint16_t task_desc_idx;
+
+    /* Whether a push sample was written, and so a pop should be too, which
+     * might not be the case if the task's category is disabled or if we had
+     * to drop the sample
+     */
+    bool emitted;
+    bool dropped;
+
+    uint8_t period_log2;
+
     uint64_t start_time;
 };
 
-struct thread_state {
-    /* A stack of uint16_t task_desc indices */
-    struct array stack;
+/* A lock currently held by the thread (see ut_lock_acquired()) */
+struct held_lock {
+    void *lock;
+    uint64_t acquire_time;
 
-    //int stack_pointer;
+    /* Reacquired after waiting on a condition variable (see
+     * ut_lock_reacquired())
+     */
+    bool reacquired;
+};
 
+/* Adaptive sampling state for a task_desc, per-thread */
+struct task_sampling {
+    uint8_t period_log2;
+    uint32_t countdown;
+
+    /* The number of instances recorded in the current window */
+    uint32_t n_recorded;
+};
+
+struct ring {
     /* A header page for the shared circular buffer, including
      * the number of samples currently written to the buffer
      */
@@ -93,29 +114,216 @@ struct thread_state {
 
     /* The size of the circular buffer */
     size_t buf_size;
+    uint64_t max_samples;
+
+    /* The index of the next sample to write in the circular buffer, which
+     * we track separately to avoid a 64bit modulo per sample
+     */
+    uint64_t write_idx;
+
+    /* Our private count of samples written, which is only published via
+     * info->n_samples_written once per commit_batch samples
+     */
+    uint64_t n_samples_written;
+    int commit_countdown;
+
+    /* Whether we have to wait for the server to read samples before they
+     * can be overwritten (see UT_LOSSLESS)
+     */
+    bool lossless;
+
+    /* If we stopped waiting for the server in lossless mode, how many
+     * samples it had read, since those can't be counted as overwritten
+     */
+    uint64_t n_samples_read_at_fallback;
+};
+
+struct thread_state {
+    /* A stack of uint16_t task_desc indices */
+    struct array stack;
 
-    /* For samples we want to to use 16bit indices to map back to
-     * the task description structures...
+    //int stack_pointer;
+
+    /* Unique per process, unlike tids which may be reused after a thread
+     * exits
+     */
+    uint32_t serial;
+
+    /* The main ring that most samples are written to */
+    struct ring ring;
+
+    /* A smaller ring for UT_PRIORITY_HIGH tasks, so that rare but
+     * important tasks aren't quickly overwritten by a flood of other
+     * samples, such as for wrapped syscalls.
+     *
+     * Both rings are allocated together, with the priority ring following
+     * the main ring (see info->priority_ring_offset)
+     */
+    struct ring priority_ring;
+    size_t mapping_size;
+
+    /* The value of n_samples_written at which to next write a checkpoint of
+     * the task stack
+     */
+    uint64_t checkpoint_interval;
+    uint64_t next_checkpoint;
+
+    /* A bitmask of the task_desc indices that we've written a task
+     * description for in our shared ancillary data
+     */
+    struct array shared_task_descs;
+
+    /* Per task_desc struct task_sampling, indexed by task_desc index, and
+     * the current window for measuring the rate of recorded tasks, if
+     * adaptive sampling is enabled
+     */
+    struct array task_sampling;
+    uint64_t sampling_window_start;
+    uint32_t sampling_window_n_recorded;
+
+    /* Pointers to each task's histogram in our shared ancillary data,
+     * indexed by task_desc index, if UT_HISTOGRAMS is enabled. Allocated the
+     * first time each task is popped.
      */
-    struct array task_desc_registry;
+    struct array task_histograms;
+    bool histogram_alloc_failed;
+
+    /* The locks currently held, in the order they were acquired */
+    struct array held_locks;
+
+    /* For measuring our own overhead (see overhead_sample_period) */
+    uint32_t overhead_countdown;
+    uint64_t slow_path_ns; /* registration + allocation time */
 
     /* Task descriptions are shared via ancillary data records written to
      * anonymous memory, shared with the server by passing a memfd file
      * descriptor which the server can mmap.
      */
     struct ut_memfd_stack shared_ancillary;
+
+    /* Linked into all_thread_states */
+    struct thread_state *next;
 };
 
 
 static pthread_once_t init_tls_once = PTHREAD_ONCE_INIT;
 static pthread_key_t tls_key;
 
+/* Set while a thread is running libut's entry points, so that if libut (or
+ * libc on its behalf) calls a traced api, such as malloc() while allocating
+ * the thread's state, the nested tracepoint is ignored instead of recursing
+ * into libut
+ *
+ * Note: initial-exec since this is checked on the hot path
+ */
+static __thread bool in_libut __attribute__((tls_model("initial-exec")));
+
+/* For samples we want to to use 16bit indices to map back to the task
+ * description structures. The indices are process-wide, so that a task_desc
+ * used by multiple threads has the same index for all of them.
+ */
+static pthread_mutex_t task_desc_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct array task_desc_registry;
+
+/* With UT_EVENT_BUDGET=<tasks per second> we adapt the sampling period of
+ * each task_desc to try and keep the number of tasks recorded per thread
+ * within the budget, by only recording 1 in N instances of the most
+ * frequent tasks.
+ */
+static uint64_t event_budget;
+
+#define UT_SAMPLING_WINDOW_NS 100000000ULL /* 100ms */
+#define UT_MAX_SAMPLING_PERIOD_LOG2 20
+
+/* See struct ut_shared_task_histogram */
+static bool histograms_enabled;
+
+/* The initial backtrace configuration (see struct ut_info_page) */
+static uint32_t backtrace_n_frames;
+static uint64_t backtrace_delta_threshold;
+
+/* We time 1 in overhead_sample_period push/pop calls to estimate our own
+ * overhead (0 disables this)
+ */
+#define UT_OVERHEAD_SAMPLE_PERIOD 128
+static uint32_t overhead_sample_period;
+
+/* Lock holds are recorded if another thread was waiting for the lock when
+ * it was released, or if it was held for longer than this
+ */
+#define UT_LOCK_HOLD_THRESHOLD_NS 1000000ULL /* 1ms */
+static uint64_t lock_hold_threshold;
+
+#define UT_MAX_HELD_LOCKS 64
+
+/* The initial category mask for new threads, which the server can change */
+static uint64_t initial_category_mask = ~0ULL;
+
 static size_t page_size;
 
-static struct array thread_state_index;
+static int n_numa_nodes;
+
+/* All thread states, most recent first, so the crash handler can find
+ * them. This is only ever pushed to, atomically, so it can be walked from
+ * a signal handler without locking.
+ */
+static struct thread_state *all_thread_states;
+static uint32_t next_thread_serial;
 
 #define SZ_2M (2 * 1024 * 1024)
-#define UT_CIRCULAR_BUFFER_SIZE SZ_2M /* XXX: must be a power of two */
+#define UT_CIRCULAR_BUFFER_SIZE SZ_2M /* default, can be overridden via
+                                         UT_BUFFER_SIZE */
+
+static size_t circular_buffer_size;
+
+#define UT_PRIORITY_BUFFER_SIZE (256 * 1024) /* default, can be overridden
+                                                via UT_PRIORITY_BUFFER_SIZE */
+static size_t priority_buffer_size;
+
+/* The number of samples written between publishing info->n_samples_written.
+ * Batching > 1 samples also enables non-temporal stores for writing samples
+ * to avoid evicting the application's own data from the cache, which is
+ * amortized by only needing one store fence per batch.
+ */
+static int commit_batch = 1;
+
+#define UT_MAX_COMMIT_BATCH 64
+
+/* The number of samples written between checkpoints of the task stack,
+ * which determines how much of the oldest data in a wrapped circular buffer
+ * might have an incomplete record of the tasks that were running. 0 means
+ * to default to an eighth of the circular buffer.
+ */
+static uint64_t checkpoint_interval;
+
+/* For complete traces (e.g. for benchmarking) UT_LOSSLESS=1 makes clients
+ * wait for the server to drain the circular buffer instead of overwriting
+ * old samples. To avoid deadlocking the application if the server stalls,
+ * we only wait up to UT_LOSSLESS_TIMEOUT_MS before dropping the sample.
+ */
+static bool lossless_mode;
+static uint64_t lossless_timeout_ns;
+
+#define UT_LOSSLESS_SPIN_COUNT 1000
+
+/* Serverless, flight-recorder mode state */
+static char *flight_recorder_dir;
+static char flight_recorder_index_path[PATH_MAX];
+static int flight_recorder_index_fd = -1;
+
+/* Crash dump state */
+static char crash_dump_path[PATH_MAX];
+static struct sigaction crash_prev_actions[NSIG];
+
+static void init_crash_handler(void);
+static void setup_crash_handler_stack(void);
+
+/* Tracepoint (UT_PUSH_TASK/UT_POP_TASK) state, see ut.h */
+int ut_tracing_enabled_flag;
+static pthread_mutex_t jump_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct array jump_tables;
+
+static void init_tracepoints(void);
 
 #if 0
 static void
@@ -142,7 +350,7 @@ connect_to_abstract_socket(const char *socket_name)
     int name_size;
     int flags;
 
-    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    fd = ut_untraced_socket(AF_UNIX, SOCK_STREAM, 0);
     if (fd == -1) {
         dbg("Failed to create PF_LOCAL socket fd\n");
         return -1;
@@ -169,30 +377,146 @@ connect_to_abstract_socket(const char *socket_name)
     if (name_size > sizeof(addr.sun_path)) {
         dbg("socket path \"\\0%s\" plus null terminator"
             " exceeds %d bytes\n", socket_name, sizeof(addr.sun_path));
-        close(fd);
+        ut_untraced_close(fd);
         return -1;
     };
 
     size = offsetof(struct sockaddr_un, sun_path) + name_size;
 
-    if (connect(fd, (struct sockaddr *)&addr, size) < 0) {
+    if (ut_untraced_connect(fd, (struct sockaddr *)&addr, size) < 0) {
         const char *msg = strerror(errno);
         dbg("Failed to connect to abstract socket: %s\n", msg);
-        close(fd);
+        ut_untraced_close(fd);
         return -1;
     }
 
     return fd;
 }
 
+static void
+flight_recorder_cleanup(void)
+{
+    struct ut_index_entry entry;
+    char filename[PATH_MAX];
+    int fd;
+
+    /* Read back the index to find all our files... */
+    fd = ut_untraced_open(flight_recorder_index_path, O_RDONLY|O_CLOEXEC, 0);
+    if (fd < 0)
+        return;
+
+    while (ut_untraced_read(fd, &entry, sizeof(entry)) == sizeof(entry)) {
+        entry.filename[sizeof(entry.filename) - 1] = '\0';
+        snprintf(filename, sizeof(filename), "%s/%s",
+                 flight_recorder_dir, entry.filename);
+        unlink(filename);
+    }
+
+    ut_untraced_close(fd);
+    unlink(flight_recorder_index_path);
+}
+
+static void
+init_flight_recorder(void)
+{
+    const char *dir = getenv("UT_FLIGHT_RECORDER_DIR");
+
+    if (!dir) {
+        if (!ut_get_bool_env("UT_FLIGHT_RECORDER"))
+            return;
+        dir = "/dev/shm";
+    }
+
+    flight_recorder_dir = strdup(dir);
+    snprintf(flight_recorder_index_path, sizeof(flight_recorder_index_path),
+             "%s/ut-%d.index", flight_recorder_dir, (int)getpid());
+
+    flight_recorder_index_fd = ut_untraced_open(flight_recorder_index_path,
+                                                O_WRONLY|O_CREAT|O_TRUNC|
+                                                O_APPEND|O_CLOEXEC,
+                                                0600);
+    if (flight_recorder_index_fd < 0) {
+        fprintf(stderr, "Failed to create flight recorder index %s: %m\n",
+                flight_recorder_index_path);
+        return;
+    }
+
+    fprintf(stderr, "flight recorder index: %s\n", flight_recorder_index_path);
+
+    /* By default the files are only left behind if we crash, so they can
+     * still be inspected post-mortem
+     */
+    if (!ut_get_bool_env("UT_FLIGHT_RECORDER_KEEP"))
+        atexit(flight_recorder_cleanup);
+}
+
 static void
 init_tls_state(void)
 {
     pthread_key_create(&tls_key, NULL);
 
-    array_init(&thread_state_index, sizeof(void *), 20);
+
+    array_init(&task_desc_registry, sizeof(void *), 256);
+    array_append_val(&task_desc_registry,
+                     struct ut_task_desc *, NULL); /* index 0 reserved */
 
     page_size = sysconf(_SC_PAGE_SIZE);
+
+    n_numa_nodes = ut_get_numa_node_count();
+
+    /* Note: very large buffers are supported (> 4GB) for long running
+     * flight-recorder style tracing to catch rare events.
+     */
+    circular_buffer_size = ut_get_size_env("UT_BUFFER_SIZE",
+                                           UT_CIRCULAR_BUFFER_SIZE);
+    circular_buffer_size -= circular_buffer_size % sizeof(struct ut_sample);
+    if (circular_buffer_size < 2 * sizeof(struct ut_sample))
+        circular_buffer_size = UT_CIRCULAR_BUFFER_SIZE;
+
+    priority_buffer_size = ut_get_size_env("UT_PRIORITY_BUFFER_SIZE",
+                                           UT_PRIORITY_BUFFER_SIZE);
+    priority_buffer_size -= priority_buffer_size % sizeof(struct ut_sample);
+    if (priority_buffer_size < 2 * sizeof(struct ut_sample))
+        priority_buffer_size = UT_PRIORITY_BUFFER_SIZE;
+
+    commit_batch = ut_get_size_env("UT_COMMIT_BATCH", 1);
+    commit_batch = MIN(commit_batch, UT_MAX_COMMIT_BATCH);
+    if (commit_batch * 2 > priority_buffer_size / sizeof(struct ut_sample))
+        commit_batch = 1;
+
+    checkpoint_interval = ut_get_uint_env("UT_CHECKPOINT_INTERVAL", 0);
+
+    /* Note: the per window counts of recorded events are 32bit */
+    event_budget = MIN(ut_get_uint_env("UT_EVENT_BUDGET", 0), UINT32_MAX);
+
+    histograms_enabled = ut_get_bool_env("UT_HISTOGRAMS");
+
+    backtrace_n_frames = MIN(ut_get_uint_env("UT_BACKTRACE_FRAMES", 0),
+                             MAX_BACKTRACE_SIZE);
+    backtrace_delta_threshold = ut_get_uint_env("UT_BACKTRACE_THRESHOLD_NS", 0);
+
+    overhead_sample_period = MIN(ut_get_uint_env("UT_OVERHEAD_SAMPLE_PERIOD",
+                                                 UT_OVERHEAD_SAMPLE_PERIOD),
+                                 UINT32_MAX);
+
+    lock_hold_threshold = ut_get_uint_env("UT_LOCK_HOLD_THRESHOLD_NS",
+                                          UT_LOCK_HOLD_THRESHOLD_NS);
+
+    /* Mainly for flight-recorder mode, where there's no server to configure
+     * the categories
+     */
+    if (getenv("UT_CATEGORIES") &&
+        !ut_parse_category_mask(getenv("UT_CATEGORIES"),
+                                &initial_category_mask))
+        initial_category_mask = ~0ULL;
+
+    lossless_mode = ut_get_bool_env("UT_LOSSLESS");
+    lossless_timeout_ns = MIN(ut_get_uint_env("UT_LOSSLESS_TIMEOUT_MS", 100),
+                              UINT64_MAX / 1000000ULL) * 1000000ULL;
+
+    init_flight_recorder();
+    init_crash_handler();
+    init_tracepoints();
 }
 
 static int
@@ -201,6 +525,184 @@ get_tid(void)
     return syscall(SYS_gettid);
 }
 
+static int
+get_numa_node(void)
+{
+    unsigned cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+        return -1;
+
+    return node;
+}
+
+/* Prefer to allocate the pages for a thread's circular buffer on the NUMA
+ * node the thread is currently running on, otherwise the pages end up
+ * wherever they happen to be first touched.
+ *
+ * This needs to be called before anything is written to the buffer and
+ * is a NOP for single node systems.
+ */
+static int
+bind_to_local_numa_node(void *mem, size_t size)
+{
+    unsigned long nodemask[16] = { 0 };
+    int node;
+
+    if (n_numa_nodes <= 1)
+        return -1;
+
+    node = get_numa_node();
+    if (node < 0 || node >= sizeof(nodemask) * 8)
+        return -1;
+
+    nodemask[node / (sizeof(long) * 8)] |= 1UL << (node % (sizeof(long) * 8));
+
+    /* Note: we use MPOL_PREFERRED so we can fall back to other nodes if the
+     * local node is out of memory.
+     */
+    if (syscall(SYS_mbind, mem, size, MPOL_PREFERRED,
+                nodemask, sizeof(nodemask) * 8, 0) < 0) {
+        dbg("Failed to bind circular buffer to NUMA node %d: %m\n", node);
+        return -1;
+    }
+
+    return node;
+}
+
+static void
+init_ring(struct ring *ring, uint8_t *mem, size_t buf_size, int numa_node)
+{
+    ring->info = (void *)mem;
+
+    ring->info->abi_version = UT_ABI_VERSION;
+    ring->info->pid = getpid();
+    ring->info->tid = get_tid();
+    ring->info->sample_size = sizeof(struct ut_sample);
+    ring->info->n_samples_written = 0;
+    ring->info->commit_batch = commit_batch;
+    ring->info->numa_node = numa_node;
+
+    ring->buf = mem + page_size;
+    ring->buf_size = buf_size;
+    ring->max_samples = buf_size / sizeof(struct ut_sample);
+    ring->commit_countdown = commit_batch;
+}
+
+static void
+init_circular_buffer(struct thread_state *state, uint8_t *mem, int numa_node)
+{
+    size_t priority_ring_offset = page_size + circular_buffer_size;
+
+    init_ring(&state->ring, mem, circular_buffer_size, numa_node);
+    init_ring(&state->priority_ring, mem + priority_ring_offset,
+              priority_buffer_size, numa_node);
+
+    state->ring.info->priority_ring_offset = priority_ring_offset;
+    state->ring.info->priority_ring_size = page_size + priority_buffer_size;
+    state->ring.info->category_mask = initial_category_mask;
+    state->ring.info->backtrace_n_frames = backtrace_n_frames;
+    state->ring.info->backtrace_delta_threshold = backtrace_delta_threshold;
+}
+
+static bool
+map_circular_buffer(struct thread_state *state, int fd)
+{
+    uint8_t *mem;
+    int numa_node;
+
+    dbg("mapping circular buffer with size = %zu\n", state->mapping_size);
+
+    mem = ut_mmap_memfd_fd(fd, state->mapping_size, PROT_READ|PROT_WRITE);
+    if (!mem) {
+        fprintf(stderr, "Failed to mmap shared circular buffer\n");
+        return false;
+    }
+
+    numa_node = bind_to_local_numa_node(mem, state->mapping_size);
+    init_circular_buffer(state, mem, numa_node);
+
+    return true;
+}
+
+/* Without a server to pass memfd file descriptors to, we can instead back
+ * the buffers with files which can be found via the index and read by
+ * ut-server --attach at any time, even after the process has crashed.
+ */
+static bool
+setup_flight_recorder_buffers(struct thread_state *state)
+{
+    struct ut_index_entry entry = { .type = UT_INDEX_CIRCULAR_BUFFER };
+    char filename[PATH_MAX];
+    int pid = getpid();
+    int tid = get_tid();
+    int fd;
+
+    /* Include the serial since a tid may be reused after a thread exits and
+     * we mustn't clobber the buffer it left behind
+     */
+    snprintf(filename, sizeof(filename), "%s/ut-%d-%d-%u.buffer",
+             flight_recorder_dir, pid, tid, state->serial);
+
+    fd = ut_untraced_open(filename, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create flight recorder buffer %s: %m\n",
+                filename);
+        return false;
+    }
+
+    if (!map_circular_buffer(state, fd)) {
+        ut_untraced_close(fd);
+        unlink(filename);
+        return false;
+    }
+    ut_untraced_close(fd);
+
+    entry.tid = tid;
+    entry.serial = state->serial;
+    snprintf(entry.filename, sizeof(entry.filename), "ut-%d-%d-%u.buffer",
+             pid, tid, state->serial);
+    ut_write_index_entry(flight_recorder_index_fd, &entry);
+
+    snprintf(filename, sizeof(filename), "%s/ut-%d-%d-%u.ancillary",
+             flight_recorder_dir, pid, tid, state->serial);
+    ut_memfd_stack_init_files(&state->shared_ancillary,
+                              filename,
+                              flight_recorder_index_fd,
+                              tid,
+                              state->serial);
+
+    return true;
+}
+
+static uint64_t
+read_monotonic_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+account_allocation_overhead(struct thread_state *state, uint64_t start)
+{
+    uint64_t elapsed = read_monotonic_clock() - start;
+
+    state->slow_path_ns += elapsed;
+    state->ring.info->n_allocations++;
+    state->ring.info->allocation_overhead_ns += elapsed;
+}
+
+static void
+account_registration_overhead(struct thread_state *state, uint64_t start)
+{
+    uint64_t elapsed = read_monotonic_clock() - start;
+
+    state->slow_path_ns += elapsed;
+    state->ring.info->n_registrations++;
+    state->ring.info->registration_overhead_ns += elapsed;
+}
+
 static struct thread_state *
 get_thread_state(void)
 {
@@ -211,15 +713,35 @@ get_thread_state(void)
     state = pthread_getspecific(tls_key);
 
     if (unlikely(!state)) {
+        uint64_t start = read_monotonic_clock();
         int conductor_fd = -1;
+        uint64_t max_samples;
 
         fprintf(stderr, "allocate thread state\n");
         state = xmalloc0(sizeof(*state));
-        array_init(&state->task_desc_registry, sizeof(void *), 50);
+        state->serial = __atomic_fetch_add(&next_thread_serial, 1,
+                                           __ATOMIC_RELAXED);
+        state->overhead_countdown = overhead_sample_period;
+        array_init(&state->shared_task_descs, sizeof(uint8_t), 64);
+        memset(state->shared_task_descs.data, 0, 64);
+        array_set_len(&state->shared_task_descs, 64);
+        array_init(&state->task_sampling, sizeof(struct task_sampling), 64);
+        array_init(&state->task_histograms,
+                   sizeof(volatile struct ut_shared_task_histogram *), 64);
         array_init(&state->stack, sizeof(struct task_stack_entry), 50);
+        array_init(&state->held_locks, sizeof(struct held_lock), 8);
         pthread_setspecific(tls_key, state);
 
-        state->buf_size = UT_CIRCULAR_BUFFER_SIZE;
+        state->mapping_size = 2 * page_size + circular_buffer_size +
+                              priority_buffer_size;
+
+        max_samples = circular_buffer_size / sizeof(struct ut_sample);
+        if (checkpoint_interval)
+            state->checkpoint_interval = MIN(checkpoint_interval,
+                                             max_samples / 2);
+        else
+            state->checkpoint_interval = MAX(max_samples / 8, 1);
+        state->next_checkpoint = state->checkpoint_interval;
 
         conductor_fd = connect_to_abstract_socket("ut-conductor");
         if (conductor_fd >= 0) {
@@ -230,59 +752,67 @@ get_thread_state(void)
             snprintf(shm_name, sizeof(shm_name), "ut-buffer-%s", thread_name);
 
             int mem_fd = memfd_create(shm_name, MFD_CLOEXEC|MFD_ALLOW_SEALING);
-            if (mem_fd >= 0) {
-                dbg("mapping circular buffer with size = %d\n",
-                    state->buf_size + page_size);
-
-                uint8_t *mem = ut_mmap_memfd_fd(mem_fd,
-                                                state->buf_size + page_size,
-                                                PROT_READ|PROT_WRITE);
-                {
-                    struct stat sb;
-                    int ret = fstat(mem_fd, &sb);
-                    if (ret < 0) {
-                        dbg("Failed to stat memfd file descriptor\n");
-                    }
-                    dbg("memfd file size according to fstat() = %d\n",
-                        (int)sb.st_size);
+            if (mem_fd >= 0 && map_circular_buffer(state, mem_fd)) {
+                if (lossless_mode) {
+                    state->ring.lossless = true;
+                    state->ring.info->ring_mode = UT_RING_LOSSLESS;
+                    state->priority_ring.lossless = true;
+                    state->priority_ring.info->ring_mode = UT_RING_LOSSLESS;
                 }
 
-                if (mem) {
-                    state->info = (void *)mem;
-
-                    state->info->abi_version = UT_ABI_VERSION;
-                    state->info->pid = getpid();
-                    state->info->tid = get_tid();
-                    state->info->sample_size = sizeof(struct ut_sample);
-                    state->info->n_samples_written = 0;
-
-                    state->buf = mem + page_size;
-
-                    fprintf(stderr, "passing circular buffer fd\n");
-                    ut_send_fd(conductor_fd, mem_fd);
-
-                    /* Initialize after passing the circular buffer fd, since
-                     * this will also pass an fd for the first ancillary data
-                     * buffer
-                     */
-                    ut_memfd_stack_init(&state->shared_ancillary,
-                                        conductor_fd,
-                                        "libut ancillary data");
-                } else
-                    fprintf(stderr, "Failed to mmap shared circular buffer\n");
+                fprintf(stderr, "passing circular buffer fd\n");
+                ut_send_fd(conductor_fd, mem_fd);
+
+                /* Initialize after passing the circular buffer fd, since
+                 * this will also pass an fd for the first ancillary data
+                 * buffer
+                 */
+                ut_memfd_stack_init(&state->shared_ancillary,
+                                    conductor_fd,
+                                    "libut ancillary data");
             }
+        } else if (flight_recorder_index_fd >= 0) {
+            setup_flight_recorder_buffers(state);
         } else
             fprintf(stderr, "Failed to connect to conductor\n");
 
-        if (!state->buf) {
-            uint8_t *mem = xmalloc(state->buf_size + page_size);
-            state->info = (void *)mem;
-            state->buf = mem + page_size;
+        if (lossless_mode && !state->ring.lossless)
+            fprintf(stderr, "Lossless mode requires a server connection\n");
+
+        /* Note: we use an anonymous mapping instead of malloc() so we don't
+         * immediately commit memory for very large buffers
+         */
+        if (!state->ring.info) {
+            uint8_t *mem = ut_untraced_mmap(NULL, state->mapping_size,
+                                            PROT_READ|PROT_WRITE,
+                                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                fprintf(stderr, "Failed to allocate circular buffer\n");
+                exit(1);
+            }
+            init_circular_buffer(state, mem, -1);
+
+            /* Even without a server we still want task descriptions for
+             * crash dumps
+             */
+            if (crash_dump_path[0])
+                ut_memfd_stack_init(&state->shared_ancillary,
+                                    -1, /* no socket */
+                                    "libut ancillary data");
         }
 
-        array_append_val(&thread_state_index, struct thread_state *, state);
-        array_append_val(&state->task_desc_registry,
-                         struct ut_shared_task_desc *, NULL); /* index 0 reserved */
+        if (crash_dump_path[0])
+            setup_crash_handler_stack();
+
+        /* Publish the state only once fully initialized */
+        state->next = __atomic_load_n(&all_thread_states, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&all_thread_states, &state->next,
+                                            state, true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+
+        state->ring.info->overhead_sample_period = overhead_sample_period;
+        account_allocation_overhead(state, start);
     }
 
     return state;
@@ -302,181 +832,1445 @@ rdtscp(uint32_t *cpuid)
     return  (uint64_t)tsc_lo | (((uint64_t)tsc_hi) << 32);
 }
 
-static uint64_t
-read_monotonic_clock(void)
+/* Returns the next slot in the circular buffer to write a sample into.
+ *
+ * Note: all samples have the same size, and since the buffer size is a
+ * multiple of the sample size no sample straddles the end of the buffer.
+ */
+static inline struct ut_sample *
+_next_sample_slot(struct ring *ring)
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    return (void *)(ring->buf + ring->write_idx * sizeof(struct ut_sample));
 }
 
-static struct ut_sample *
-_emit_task_sample(struct thread_state *state,
-                  enum ut_sample_type type,
-                  uint16_t task_desc_index)
+/* Copies a sample into the next slot of the circular buffer. Only the first
+ * size bytes of the sample are written, since the remainder of a slot is
+ * only meaningful for some sample types.
+ */
+static inline void
+_write_sample(struct ring *ring,
+              const struct ut_sample *sample,
+              size_t size)
 {
-    volatile struct ut_info_page *info = state->info;
-    struct ut_sample *sample;
-    uint32_t offset = info->n_samples_written * sizeof(struct ut_sample);
-    uint32_t mask = (UT_CIRCULAR_BUFFER_SIZE - 1);
-    uint32_t cpuid;
+    uint64_t *dst = (void *)_next_sample_slot(ring);
+    const uint64_t *src = (const void *)sample;
 
-#if 0
-    {
-        struct ut_task_desc *desc = array_value_at(&state->task_desc_registry,
-                                                   struct ut_task_desc *,
-                                                   task_desc_index);
-        dbg("sample = %s\n", desc->name);
+#if defined(__x86_64__)
+    if (commit_batch > 1) {
+        for (int i = 0; i < size / 8; i++)
+            __builtin_ia32_movnti64((long long *)dst + i, src[i]);
+        return;
     }
 #endif
 
-    offset &= mask;
-    sample = (void *)(state->buf + offset);
-    sample->type = type;
-    sample->padding = 0;
-    sample->task_desc_index = task_desc_index;
-    sample->timestamp = read_monotonic_clock();
-    //too much of a faff to open perf event and scale to nanoseconds + manually
-    //correlate PERF_CLOCK with CLOCK_MONOTONIC...
-    //sample->tsc = rdtscp(&cpuid);
-    rdtscp(&cpuid); // only care about cpuid, not tsc, for now
-    sample->cpu = cpuid & 0xff;
-    //sample->stack_pointer = state->stack_pointer;
-    sample->stack_pointer = state->stack.len;
+    memcpy(dst, src, size);
+}
 
-    /* ensure the sample only becomes visible after the contents have landed */
-    mb();
-    info->n_samples_written++;
+static inline void
+_publish_samples(struct ring *ring)
+{
+    volatile struct ut_info_page *info = ring->info;
+    uint64_t n_samples = ring->n_samples_written;
+    uint64_t n_unread = n_samples - ring->n_samples_read_at_fallback;
 
-    /* XXX: this is designed with the assumption that the clients are stopped
-     * via ptrace(PTRACE_INTERRUPT) before data is read. The memory barrier
-     * only ensures that the reader can trust that the most recent sample is
-     * consistent. On the other hand the reader should skip the oldest sample
-     * when the buffer is full since the interrupted client might have been in
-     * the middle of writing a new sample.
-     */
+    if (unlikely(n_unread > ring->max_samples) && !ring->lossless)
+        info->n_samples_overwritten = n_unread - ring->max_samples;
+
+#if defined(__x86_64__)
+    /* non-temporal stores are weakly ordered, even on x86 */
+    if (commit_batch > 1)
+        __builtin_ia32_sfence();
+#endif
 
-    return sample;
+    /* ensure the samples only become visible after the contents have landed,
+     * paired with an acquire load of n_samples_written by the reader
+     */
+    __atomic_store_n(&info->n_samples_written, n_samples, __ATOMIC_RELEASE);
 }
 
-static struct ut_sample *
-_emit_task_backtrace(struct thread_state *state)
+static inline void
+_commit_sample(struct ring *ring)
 {
-    volatile struct ut_info_page *info = state->info;
-    struct ut_sample *sample;
-    uint32_t offset = info->n_samples_written * sizeof(struct ut_sample);
-    uint32_t mask = (UT_CIRCULAR_BUFFER_SIZE - 1);
+    ring->n_samples_written++;
 
-    offset &= mask;
-    sample = (void *)(state->buf + offset);
-    sample->type = UT_SAMPLE_TASK_BACKTRACE;
-    sample->padding = 0;
-    backtrace(sample->backtrace, ARRAY_SIZE(sample->backtrace));
+    if (unlikely(++ring->write_idx == ring->max_samples))
+        ring->write_idx = 0;
 
-    mb();
-    info->n_samples_written++;
+    if (--ring->commit_countdown == 0) {
+        ring->commit_countdown = commit_batch;
+        _publish_samples(ring);
+    }
 
     /* XXX: this is designed with the assumption that the clients are stopped
-     * via ptrace(PTRACE_INTERRUPT) before data is read. The memory barrier
-     * only ensures that the reader can trust that the most recent sample is
-     * consistent. On the other hand the reader should skip the oldest sample
-     * when the buffer is full since the interrupted client might have been in
-     * the middle of writing a new sample.
+     * via ptrace(PTRACE_INTERRUPT) before data is read. The release store
+     * only ensures that the reader can trust that the most recently published
+     * samples are consistent. On the other hand the reader should skip the
+     * oldest commit_batch samples when the buffer is full since the
+     * interrupted client might have been in the middle of overwriting them.
+     *
+     * Note: with commit_batch > 1 the reader won't see up to
+     * commit_batch - 1 of the most recent samples.
      */
+}
+
+static bool
+_ring_has_space(struct ring *ring)
+{
+    uint64_t n_read = __atomic_load_n(&ring->info->n_samples_read,
+                                      __ATOMIC_SEQ_CST);
 
-    return sample;
+    return ring->n_samples_written - n_read < ring->max_samples;
 }
 
-static uint16_t
-get_task_desc_index(struct thread_state *state, struct ut_task_desc *task_desc)
+/* In lossless mode, waits for the server to read enough samples that we can
+ * write another one without overwriting unread data. We spin briefly first,
+ * since the server drains periodically, and then sleep on a futex.
+ *
+ * Returns false if we timed out.
+ */
+static bool
+_wait_for_ring_space(struct ring *ring)
 {
-    if (unlikely(task_desc->idx == 0)) {
-#ifdef SUPPORT_TRANSIENT_DSO_TASKS
-        /* TODO: search for existing id via a name index */
+    volatile struct ut_info_page *info = ring->info;
+    uint64_t start = read_monotonic_clock();
+    uint64_t deadline = start + lossless_timeout_ns;
+    bool ret = true;
+
+    /* make sure the server can see everything written so far */
+    _publish_samples(ring);
+
+    for (int i = 0; !_ring_has_space(ring); i++) {
+        uint32_t seq = ut_load_acquire(&info->read_futex);
+        uint64_t now;
+
+        if (i < UT_LOSSLESS_SPIN_COUNT) {
+#if defined(__x86_64__)
+            __builtin_ia32_pause();
 #endif
-        uint16_t task_desc_index = state->task_desc_registry.len;
-
-        array_append_val(&state->task_desc_registry,
-                         struct ut_task_desc *,
-                         task_desc);
-
-        task_desc->idx = task_desc_index;
-        dbg_assert(task_desc->idx != 0);
-
-        /* cope with failure to connect to server */
-        if (state->shared_ancillary.current_buf.size) {
-            size_t record_size = (sizeof(struct ut_ancillary_record) +
-                                  sizeof(struct ut_shared_task_desc));
-            volatile struct ut_ancillary_record *header =
-                ut_memfd_stack_memalign(&state->shared_ancillary,
-                                        record_size,
-                                        8); /* alignment */
-            volatile struct ut_shared_task_desc *shared_desc = (void *)(header + 1);
-
-            strncpy((char *)shared_desc->name, task_desc->name, sizeof(shared_desc->name));
-            shared_desc->idx = task_desc_index;
-
-            header->type = UT_ANCILLARY_TASK_DESC;
-            header->padding = 0;
-
-            /* Ensure the reader only sees a complete record for a non zero header
-             * type - i.e. the reader can parse the records as a NULL terminated
-             * sequence of records based on the type field.
-             */
-            mb();
-            header->size = record_size;
+            continue;
+        }
+
+        now = read_monotonic_clock();
+        if (now >= deadline) {
+            ret = false;
+            break;
+        }
+
+        /* Paired with the server checking n_waiters after updating
+         * n_samples_read, and the futex will also only sleep if the server
+         * hasn't incremented read_futex since we sampled seq.
+         */
+        __atomic_add_fetch(&info->n_waiters, 1, __ATOMIC_SEQ_CST);
+        if (!_ring_has_space(ring)) {
+            struct timespec timeout = {
+                .tv_sec = (deadline - now) / 1000000000ULL,
+                .tv_nsec = (deadline - now) % 1000000000ULL,
+            };
+
+            syscall(SYS_futex, &info->read_futex, FUTEX_WAIT, seq,
+                    &timeout, NULL, 0);
         }
+        __atomic_sub_fetch(&info->n_waiters, 1, __ATOMIC_SEQ_CST);
     }
 
-    dbg_assert(state->task_desc_registry.len <= UINT16_MAX);
+    info->n_stalls++;
+    info->stall_ns += read_monotonic_clock() - start;
 
-    return task_desc->idx;
+    return ret;
 }
 
-void
-ut_push_task(struct ut_task_desc *task_desc)
+/* If the server stops draining a lossless ring (e.g. because it exited or
+ * hung) we don't want every following sample to stall for the full timeout,
+ * so after the first timeout we go back to overwriting the oldest samples.
+ */
+static void
+_fall_back_to_overwrite_mode(struct ring *ring)
 {
-    struct thread_state *state = get_thread_state();
-    uint16_t task_desc_idx = get_task_desc_index(state, task_desc);
-    struct ut_task_sample *sample;
-    struct task_stack_entry entry;
+    volatile struct ut_info_page *info = ring->info;
 
-    sample = _emit_task_sample(state, UT_SAMPLE_TASK_PUSH, task_desc_idx);
+    ring->lossless = false;
+    ring->n_samples_read_at_fallback =
+        __atomic_load_n(&info->n_samples_read, __ATOMIC_SEQ_CST);
+    info->ring_mode = UT_RING_OVERWRITE;
+    info->n_lossless_timeouts++;
 
-    entry->start_time = sample->timestamp;
-    entry->task_desc_idx = task_desc_idx;
-    array_append_val(&state->stack, struct task_stack_entry, entry);
+    dbg("Timed out waiting for the server to drain a lossless buffer; "
+        "falling back to overwriting old samples\n");
 }
 
-void
-ut_pop_task(struct ut_task_desc *task_desc)
+/* In lossless mode, makes sure there's space to write another sample */
+static inline void
+_reserve_sample(struct ring *ring)
 {
-    struct thread_state *state = get_thread_state();
-    struct ut_info_page *info = state->info;
-    uint16_t task_desc_idx = get_task_desc_index(state, task_desc);
-    struct ut_task_sample *sample;
+    if (likely(!ring->lossless) || likely(_ring_has_space(ring)))
+        return;
 
-    dbg_assert(array_element_at(&state->stack,
-                                struct task_stack_entry,
-                                state->stack.len - 1)->task_desc_idx == task_desc_idx);
+    if (!_wait_for_ring_space(ring))
+        _fall_back_to_overwrite_mode(ring);
+}
 
-    sample = _emit_task_sample(state, UT_SAMPLE_TASK_POP, task_desc_idx);
+static uint64_t
+_emit_task_sample(struct thread_state *state,
+                  struct ring *ring,
+                  enum ut_sample_type type,
+                  uint16_t task_desc_index,
+                  uint8_t period_log2)
+{
+    struct ut_sample sample;
+    uint32_t cpuid;
 
-    /* Only emit a backtrace at the end of a task, if it's duration
-     * was > info->backtrace_delta_threshold, as a way to minimize
-     * the associated overhead...
-     */
-    if (info->backtrace_n_frames) {
-        struct task_stack_entry *top = array_element_at(state->stack,
-                                                        struct task_stack_entry,
-                                                        state->stack.len - 1);
-        uint64_t delta = sample->timestamp - top->timestamp;
+    _reserve_sample(ring);
 
-        if (delta > info->backtrace_delta_threashold)
-            _emit_task_backtrace();
-    }
+#if 0
+    {
+        struct ut_task_desc *desc = array_value_at(&task_desc_registry,
+                                                   struct ut_task_desc *,
+                                                   task_desc_index);
+        dbg("sample = %s\n", desc->name);
+    }
+#endif
+
+    sample.type = type;
+    sample.period_log2 = period_log2;
+    sample.task_desc_index = task_desc_index;
+    sample.timestamp = read_monotonic_clock();
+    //too much of a faff to open perf event and scale to nanoseconds + manually
+    //correlate PERF_CLOCK with CLOCK_MONOTONIC...
+    //sample.tsc = rdtscp(&cpuid);
+    rdtscp(&cpuid); // only care about cpuid, not tsc, for now
+    sample.cpu = cpuid & 0xff;
+    //sample.stack_pointer = state->stack_pointer;
+    sample.stack_pointer = state->stack.len;
+
+    _write_sample(ring, &sample, offsetof(struct ut_sample, timestamp) +
+                                 sizeof(sample.timestamp));
+    _commit_sample(ring);
+
+    return sample.timestamp;
+}
+
+static void
+_emit_task_args(struct thread_state *state,
+                struct ring *ring,
+                uint16_t task_desc_index,
+                int n_args,
+                const int64_t *args)
+{
+    struct ut_sample sample;
+
+    _reserve_sample(ring);
+
+    n_args = MIN(n_args, UT_MAX_TASK_ARGS);
+
+    sample.type = UT_SAMPLE_TASK_ARGS;
+    sample.args.task_desc_index = task_desc_index;
+    sample.args.n_args = n_args;
+    sample.args.padding = 0;
+    memcpy(sample.args.values, args, n_args * sizeof(args[0]));
+
+    _write_sample(ring, &sample, offsetof(struct ut_sample, args.values) +
+                                 n_args * sizeof(args[0]));
+    _commit_sample(ring);
+}
+
+static void
+_emit_task_backtrace(struct thread_state *state, struct ring *ring)
+{
+    volatile struct ut_info_page *info = state->ring.info;
+    struct ut_sample sample;
+
+    _reserve_sample(ring);
+
+    memset(&sample, 0, sizeof(sample));
+    sample.type = UT_SAMPLE_TASK_BACKTRACE;
+    backtrace(sample.addresses, MIN(info->backtrace_n_frames,
+                                    ARRAY_SIZE(sample.addresses)));
+
+    _write_sample(ring, &sample, sizeof(sample));
+    _commit_sample(ring);
+}
+
+/* Writes a snapshot of the current task stack, split over as many samples as
+ * necessary, all with the same timestamp
+ */
+static void
+_emit_task_checkpoint(struct thread_state *state)
+{
+    int depth = MIN(state->stack.len, UINT16_MAX);
+    struct ut_sample sample;
+    uint64_t timestamp = read_monotonic_clock();
+    int first = 0;
+
+    do {
+        int n_entries = MIN(depth - first, UT_CHECKPOINT_ENTRIES);
+
+        _reserve_sample(&state->ring);
+
+        memset(&sample, 0, sizeof(sample));
+        sample.type = UT_SAMPLE_TASK_CHECKPOINT;
+        sample.checkpoint.stack_depth = depth;
+        sample.checkpoint.first_entry = first;
+        sample.checkpoint.n_entries = n_entries;
+        sample.checkpoint.timestamp = timestamp;
+
+        for (int i = 0; i < n_entries; i++) {
+            struct task_stack_entry *entry =
+                array_element_at(&state->stack, struct task_stack_entry,
+                                 first + i);
+
+            /* 0 = unknown, for tasks we haven't emitted samples for */
+            sample.checkpoint.task_desc_indices[i] =
+                entry->emitted ? entry->task_desc_idx : 0;
+            sample.checkpoint.start_times[i] = entry->start_time;
+        }
+
+        _write_sample(&state->ring, &sample, sizeof(sample));
+        _commit_sample(&state->ring);
+
+        first += n_entries;
+    } while (first < depth);
+
+    state->next_checkpoint = state->ring.n_samples_written +
+                             state->checkpoint_interval;
+}
+
+/* An opt-in fatal signal handler that writes all circular buffers and
+ * ancillary data to a dump file so the last moments before a crash can be
+ * inspected with ut-server --load-dump.
+ *
+ * Note: everything here has to be async-signal safe, so we only make raw
+ * write() syscalls with no allocation, and find the thread states via the
+ * lock-free all_thread_states list.
+ */
+static void
+dump_write(int fd, const void *data, size_t size)
+{
+    const uint8_t *ptr = data;
+
+    while (size) {
+        ssize_t ret = syscall(SYS_write, fd, ptr, size);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        ptr += ret;
+        size -= ret;
+    }
+}
+
+static void
+dump_thread_state(int fd, struct thread_state *state)
+{
+    struct ut_dump_record record;
+    int n_ancillary = ut_memfd_stack_get_n_buffers(&state->shared_ancillary);
+
+    record.type = UT_DUMP_CIRCULAR_BUFFER;
+    record.tid = state->ring.info->tid;
+    record.size = state->mapping_size;
+    dump_write(fd, &record, sizeof(record));
+    dump_write(fd, (void *)state->ring.info, record.size);
+
+    for (int i = 0; i < n_ancillary; i++) {
+        struct ut_memfd_stack_buffer *buffer =
+            ut_memfd_stack_get_buffer(&state->shared_ancillary, i);
+
+        record.type = UT_DUMP_ANCILLARY;
+        record.tid = state->ring.info->tid;
+        record.size = buffer->size;
+        dump_write(fd, &record, sizeof(record));
+        dump_write(fd, (void *)buffer->data, record.size);
+    }
+}
+
+static void
+crash_handler(int signum, siginfo_t *info, void *context)
+{
+    struct thread_state *crashed_state = pthread_getspecific(tls_key);
+    struct ut_dump_header header;
+    int saved_errno = errno;
+    int fd;
+
+    /* Make sure any samples held back by batching are visible */
+    if (crashed_state && crashed_state->ring.info) {
+        _publish_samples(&crashed_state->ring);
+        _publish_samples(&crashed_state->priority_ring);
+    }
+
+    fd = syscall(SYS_open, crash_dump_path,
+                 O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        header.magic = UT_DUMP_MAGIC;
+        header.abi_version = UT_ABI_VERSION;
+        header.pid = getpid();
+        header.page_size = page_size;
+        header.signal = signum;
+        header.crashed_tid = get_tid();
+        dump_write(fd, &header, sizeof(header));
+
+        for (struct thread_state *state =
+                 __atomic_load_n(&all_thread_states, __ATOMIC_ACQUIRE);
+             state;
+             state = state->next)
+            dump_thread_state(fd, state);
+
+        syscall(SYS_close, fd);
+    }
+
+    errno = saved_errno;
+
+    /* Restore the previous handler and re-raise so that we still crash in
+     * the way the application expects (e.g. to produce a core dump)
+     */
+    sigaction(signum, &crash_prev_actions[signum], NULL);
+    raise(signum);
+}
+
+/* To be able to handle a stack overflow, each thread needs an alternative
+ * stack for the signal handler.
+ */
+static void
+setup_crash_handler_stack(void)
+{
+    stack_t ss;
+
+    ss.ss_size = MAX(SIGSTKSZ, 65536);
+    ss.ss_sp = ut_untraced_mmap(NULL, ss.ss_size, PROT_READ|PROT_WRITE,
+                                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    ss.ss_flags = 0;
+    if (ss.ss_sp == MAP_FAILED)
+        return;
+
+    if (sigaltstack(&ss, NULL) < 0)
+        dbg("Failed to set alternative signal stack: %m\n");
+}
+
+static void
+init_crash_handler(void)
+{
+    static const int fatal_signals[] = {
+        SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGTRAP, SIGSYS
+    };
+    const char *dir = getenv("UT_CRASH_DUMP_DIR");
+    struct sigaction action;
+
+    if (!dir) {
+        if (!ut_get_bool_env("UT_CRASH_DUMP"))
+            return;
+        dir = "/tmp";
+    }
+
+    snprintf(crash_dump_path, sizeof(crash_dump_path),
+             "%s/ut-crash-%d.dump", dir, (int)getpid());
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = crash_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+    sigfillset(&action.sa_mask);
+
+    for (int i = 0; i < ARRAY_SIZE(fatal_signals); i++) {
+        int signum = fatal_signals[i];
+        sigaction(signum, &action, &crash_prev_actions[signum]);
+    }
+
+    fprintf(stderr, "crash dumps will be written to %s\n", crash_dump_path);
+}
+
+/* Checks /proc/net/unix for a server listening on the abstract
+ * "ut-conductor" socket, without connecting, since the server expects
+ * every connection to be a new client
+ */
+static bool
+probe_for_server(void)
+{
+    FILE *fp = fopen("/proc/net/unix", "r");
+    char line[512];
+    bool found = false;
+
+    if (!fp)
+        return false;
+
+    while (!found && fgets(line, sizeof(line), fp)) {
+        char *name = strrchr(line, ' ');
+
+        if (name && strcmp(name + 1, "@ut-conductor\n") == 0)
+            found = true;
+    }
+
+    fclose(fp);
+
+    return found;
+}
+
+#if defined(__x86_64__)
+static const uint8_t nop5[] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+/* Patches a tracepoint's 5 byte nop into a jmp rel32 to its enabled branch
+ * (or back again). Since the nop is 8 byte aligned we can replace it with
+ * a single atomic store, without another thread ever being able to execute
+ * a partially written instruction.
+ *
+ * Returns false if the code couldn't be made writable (e.g. if denied by
+ * an SELinux execmod policy), which is only reported once.
+ */
+static bool
+patch_jump_site(struct ut_jump_entry *entry, bool enable)
+{
+    static bool reported_mprotect_failure;
+    uint64_t *slot = (uint64_t *)(uintptr_t)entry->code;
+    uintptr_t page = entry->code & ~(page_size - 1);
+    union {
+        uint64_t qword;
+        uint8_t bytes[8];
+    } insn;
+
+    if (entry->code & 7) {
+        fprintf(stderr, "Spurious unaligned tracepoint %p\n", slot);
+        return false;
+    }
+
+    insn.qword = *slot;
+    if (enable) {
+        int32_t rel = entry->target - (entry->code + 5);
+
+        insn.bytes[0] = 0xe9;
+        memcpy(&insn.bytes[1], &rel, sizeof(rel));
+    } else
+        memcpy(insn.bytes, nop5, sizeof(nop5));
+
+    if (mprotect((void *)page, page_size,
+                 PROT_READ|PROT_WRITE|PROT_EXEC) < 0) {
+        if (!reported_mprotect_failure) {
+            fprintf(stderr, "Failed to make tracepoints writable: %m\n");
+            reported_mprotect_failure = true;
+        }
+        return false;
+    }
+
+    __atomic_store_n(slot, insn.qword, __ATOMIC_SEQ_CST);
+
+    mprotect((void *)page, page_size, PROT_READ|PROT_EXEC);
+
+    return true;
+}
+#endif
 
+/* Returns false if any of the tracepoints couldn't be patched */
+static bool
+patch_jump_table(struct ut_jump_entry *start,
+                 struct ut_jump_entry *end,
+                 bool enable)
+{
+    bool ret = true;
+
+#if defined(__x86_64__)
+    for (struct ut_jump_entry *entry = start; entry < end; entry++) {
+        if (!patch_jump_site(entry, enable))
+            ret = false;
+    }
+#endif
+
+    return ret;
+}
+
+/* Called by a constructor in each module (executable or library) with
+ * tracepoints. Note: every translation unit including ut.h has its own
+ * constructor, so a module's table may be registered multiple times.
+ */
+void
+ut_register_jump_table(struct ut_jump_entry *start, struct ut_jump_entry *end)
+{
+    pthread_once(&init_tls_once, init_tls_state);
+
+    ut_untraced_pthread_mutex_lock(&jump_tables_lock);
+
+    /* pairs of start, end pointers */
+    for (int i = 0; i < jump_tables.len; i += 2) {
+        if (array_value_at(&jump_tables, struct ut_jump_entry *, i) == start) {
+            ut_untraced_pthread_mutex_unlock(&jump_tables_lock);
+            return;
+        }
+    }
+
+    array_append_val(&jump_tables, struct ut_jump_entry *, start);
+    array_append_val(&jump_tables, struct ut_jump_entry *, end);
+
+    /* If we can't enable all of the module's tracepoints then we leave
+     * them all disabled, rather than tracing an arbitrary subset
+     */
+    if (ut_tracing_enabled_flag && !patch_jump_table(start, end, true))
+        patch_jump_table(start, end, false);
+
+    ut_untraced_pthread_mutex_unlock(&jump_tables_lock);
+}
+
+/* Patches in all registered tracepoints, or none of them if any can't be
+ * patched, in which case tracing stays disabled
+ */
+static void
+enable_tracepoints(void)
+{
+    bool patched = true;
+
+    ut_untraced_pthread_mutex_lock(&jump_tables_lock);
+
+    /* pairs of start, end pointers */
+    for (int i = 0; i < jump_tables.len; i += 2) {
+        if (!patch_jump_table(array_value_at(&jump_tables, struct ut_jump_entry *, i),
+                              array_value_at(&jump_tables, struct ut_jump_entry *, i + 1),
+                              true))
+            patched = false;
+    }
+
+    if (patched)
+        __atomic_store_n(&ut_tracing_enabled_flag, 1, __ATOMIC_SEQ_CST);
+    else {
+        for (int i = 0; i < jump_tables.len; i += 2) {
+            patch_jump_table(array_value_at(&jump_tables, struct ut_jump_entry *, i),
+                             array_value_at(&jump_tables, struct ut_jump_entry *, i + 1),
+                             false);
+        }
+    }
+
+    ut_untraced_pthread_mutex_unlock(&jump_tables_lock);
+
+    dbg("tracepoints %s\n", patched ? "enabled" : "left disabled");
+}
+
+/* How often to check whether a server has started, while tracing is
+ * disabled
+ */
+#define UT_SERVER_PROBE_INTERVAL_MS 500
+
+static void *
+server_probe_thread_cb(void *data)
+{
+    struct timespec interval = {
+        .tv_sec = UT_SERVER_PROBE_INTERVAL_MS / 1000,
+        .tv_nsec = (UT_SERVER_PROBE_INTERVAL_MS % 1000) * 1000000,
+    };
+
+    /* Nothing this thread does should be traced (including exiting after
+     * enabling tracing)
+     */
+    in_libut = true;
+
+    while (!probe_for_server())
+        syscall(SYS_nanosleep, &interval, NULL);
+
+    enable_tracepoints();
+
+    return NULL;
+}
+
+/* Starts a thread that patches in the tracepoints once a server starts
+ *
+ * Note: tasks that were pushed before tracing was enabled are popped with
+ * an empty stack, which ut_pop_task() ignores.
+ */
+static void
+start_server_probe_thread(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all, prev;
+
+    /* So the thread never handles signals meant for the application */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, server_probe_thread_cb, NULL) != 0)
+        fprintf(stderr, "Failed to start thread to probe for server\n");
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* Hold jump_tables_lock over fork() so a child can't inherit it locked in
+ * the middle of enable_tracepoints()
+ */
+static void
+server_probe_atfork_prepare(void)
+{
+    ut_untraced_pthread_mutex_lock(&jump_tables_lock);
+}
+
+static void
+server_probe_atfork_parent(void)
+{
+    ut_untraced_pthread_mutex_unlock(&jump_tables_lock);
+}
+
+/* Only the forking thread exists in a child process, so if we were still
+ * waiting for a server the child needs its own probe thread
+ */
+static void
+server_probe_atfork_child(void)
+{
+    ut_untraced_pthread_mutex_unlock(&jump_tables_lock);
+
+    if (!ut_tracing_enabled_flag)
+        start_server_probe_thread();
+}
+
+/* Tracing is only enabled if there's something to collect the data: a
+ * server, or flight-recorder or crash dump mode. If there's no server yet
+ * then the tracepoints are patched in as soon as one starts. UT_ENABLE can
+ * force tracing on or off.
+ */
+static void
+init_tracepoints(void)
+{
+    array_init(&jump_tables, sizeof(void *), 16);
+
+    if (getenv("UT_ENABLE"))
+        ut_tracing_enabled_flag = ut_get_bool_env("UT_ENABLE");
+    else {
+        ut_tracing_enabled_flag = (flight_recorder_index_fd >= 0 ||
+                                   crash_dump_path[0] ||
+                                   probe_for_server());
+        if (!ut_tracing_enabled_flag) {
+            pthread_atfork(server_probe_atfork_prepare,
+                           server_probe_atfork_parent,
+                           server_probe_atfork_child);
+            start_server_probe_thread();
+        }
+    }
+
+    dbg("tracepoints %s\n", ut_tracing_enabled_flag ? "enabled" : "disabled");
+}
+
+/* Writes a task description to our ancillary data, so the server can map
+ * the indices in our samples back to names
+ */
+static void
+share_task_desc(struct thread_state *state, struct ut_task_desc *task_desc)
+{
+    size_t record_size = (sizeof(struct ut_ancillary_record) +
+                          sizeof(struct ut_shared_task_desc));
+    volatile struct ut_ancillary_record *header;
+    volatile struct ut_shared_task_desc *shared_desc;
+
+    /* cope with failure to connect to server */
+    if (!state->shared_ancillary.current_buf.size)
+        return;
+
+    header = ut_memfd_stack_memalign(&state->shared_ancillary,
+                                     record_size,
+                                     8); /* alignment */
+    if (unlikely(!header)) {
+        state->ring.info->n_ancillary_alloc_failures++;
+        return;
+    }
+
+    shared_desc = (void *)(header + 1);
+
+    strncpy((char *)shared_desc->name, task_desc->name, sizeof(shared_desc->name));
+    shared_desc->idx = task_desc->idx;
+    shared_desc->category = task_desc->category;
+    shared_desc->wait_reason = task_desc->wait_reason;
+
+    header->type = UT_ANCILLARY_TASK_DESC;
+    header->padding = 0;
+
+    /* Ensure the reader only sees a complete record for a non zero header
+     * size - i.e. the reader can parse the records as a NULL terminated
+     * sequence of records based on the size field.
+     */
+    __atomic_store_n(&header->size, record_size, __ATOMIC_RELEASE);
+}
+
+/* Writes the names of the values recorded via ut_pop_task_args(), parsed
+ * from the comma separated task_desc->args
+ */
+static void
+share_task_arg_names(struct thread_state *state, struct ut_task_desc *task_desc)
+{
+    size_t record_size = (sizeof(struct ut_ancillary_record) +
+                          sizeof(struct ut_shared_task_arg_names));
+    volatile struct ut_ancillary_record *header;
+    volatile struct ut_shared_task_arg_names *arg_names;
+    const char *name = task_desc->args;
+    int n_args = 0;
+
+    header = ut_memfd_stack_memalign(&state->shared_ancillary,
+                                     record_size,
+                                     8); /* alignment */
+    if (unlikely(!header)) {
+        state->ring.info->n_ancillary_alloc_failures++;
+        return;
+    }
+
+    /* Note: new ancillary buffers are zero initialized */
+    arg_names = (void *)(header + 1);
+
+    while (*name && n_args < UT_MAX_TASK_ARGS) {
+        size_t len = strcspn(name, ",");
+
+        memcpy((char *)arg_names->names[n_args], name,
+               MIN(len, UT_TASK_ARG_NAME_LEN - 1));
+        n_args++;
+
+        name += len;
+        if (*name == ',')
+            name++;
+    }
+
+    arg_names->task_desc_idx = task_desc->idx;
+    arg_names->n_args = n_args;
+
+    header->type = UT_ANCILLARY_TASK_ARG_NAMES;
+    header->padding = 0;
+    __atomic_store_n(&header->size, record_size, __ATOMIC_RELEASE);
+}
+
+static uint16_t
+register_task_desc(struct ut_task_desc *task_desc)
+{
+    uint16_t task_desc_index;
+
+    ut_untraced_pthread_mutex_lock(&task_desc_registry_lock);
+
+    /* Another thread may have registered it in the meantime */
+    task_desc_index = task_desc->idx;
+    if (task_desc_index)
+        goto out;
+
+#ifdef SUPPORT_TRANSIENT_DSO_TASKS
+    /* TODO: search for existing id via a name index */
+#endif
+
+    /* We've run out of 16bit indices, so the caller will have to drop
+     * any samples for this task (index 0 is reserved)
+     */
+    if (unlikely(task_desc_registry.len > UINT16_MAX))
+        goto out;
+
+    task_desc_index = task_desc_registry.len;
+
+    array_append_val(&task_desc_registry,
+                     struct ut_task_desc *,
+                     task_desc);
+
+    __atomic_store_n(&task_desc->idx, task_desc_index, __ATOMIC_RELEASE);
+    dbg_assert(task_desc->idx != 0);
+
+out:
+    ut_untraced_pthread_mutex_unlock(&task_desc_registry_lock);
+
+    return task_desc_index;
+}
+
+static uint16_t
+get_task_desc_index(struct thread_state *state, struct ut_task_desc *task_desc)
+{
+    uint16_t task_desc_index = ut_load_acquire(&task_desc->idx);
+    struct array *shared = &state->shared_task_descs;
+    uint64_t start = 0;
+    int byte;
+    uint8_t bit;
+
+    if (unlikely(task_desc_index == 0)) {
+        start = read_monotonic_clock();
+        task_desc_index = register_task_desc(task_desc);
+        if (unlikely(task_desc_index == 0)) {
+            account_registration_overhead(state, start);
+            return 0;
+        }
+    }
+
+    byte = task_desc_index / 8;
+    bit = 1 << (task_desc_index % 8);
+
+    if (unlikely(byte >= shared->len)) {
+        int len = shared->len;
+
+        array_set_len(shared, MAX(byte + 1, len * 2));
+        memset(shared->bytes + len, 0, shared->len - len);
+    }
+
+    if (unlikely(!(shared->bytes[byte] & bit))) {
+        if (!start)
+            start = read_monotonic_clock();
+        share_task_desc(state, task_desc);
+        if (task_desc->args && state->shared_ancillary.current_buf.size)
+            share_task_arg_names(state, task_desc);
+        shared->bytes[byte] |= bit;
+    }
+
+    if (unlikely(start))
+        account_registration_overhead(state, start);
+
+    return task_desc_index;
+}
+
+static inline struct ring *
+get_task_ring(struct thread_state *state, struct ut_task_desc *task_desc)
+{
+    if (unlikely(task_desc->priority == UT_PRIORITY_HIGH))
+        return &state->priority_ring;
+    else
+        return &state->ring;
+}
+
+static struct task_sampling *
+get_task_sampling(struct thread_state *state, uint16_t task_desc_idx)
+{
+    struct array *sampling = &state->task_sampling;
+
+    if (unlikely(task_desc_idx >= sampling->len)) {
+        int len = sampling->len;
+
+        array_set_len(sampling, MAX(task_desc_idx + 1, len * 2));
+        memset(sampling->bytes + len * sampling->elem_size, 0,
+               (sampling->len - len) * sampling->elem_size);
+    }
+
+    return array_element_at(sampling, struct task_sampling, task_desc_idx);
+}
+
+/* Decides whether to record this instance of a task, based on its current
+ * sampling period
+ */
+static inline bool
+sample_task(struct thread_state *state,
+            uint16_t task_desc_idx,
+            uint8_t *period_log2)
+{
+    struct task_sampling *sampling = get_task_sampling(state, task_desc_idx);
+
+    if (sampling->countdown > 1) {
+        sampling->countdown--;
+        return false;
+    }
+
+    sampling->countdown = 1 << sampling->period_log2;
+    sampling->n_recorded++;
+    state->sampling_window_n_recorded++;
+    *period_log2 = sampling->period_log2;
+
+    return true;
+}
+
+/* At the end of each window, if we're over budget we increase the sampling
+ * period of any tasks recorded more than their fair share of the budget, by
+ * enough that they would have been within their share, or if we're well
+ * under budget we halve the sampling periods.
+ */
+static void
+update_sampling_periods(struct thread_state *state, uint64_t now)
+{
+    struct array *sampling = &state->task_sampling;
+    uint64_t window_ns = now - state->sampling_window_start;
+    uint64_t budget = event_budget * window_ns / 1000000000ULL;
+    uint32_t n_recorded = state->sampling_window_n_recorded;
+    int n_active = 0;
+
+    for (int i = 0; i < sampling->len; i++) {
+        if (array_element_at(sampling, struct task_sampling, i)->n_recorded)
+            n_active++;
+    }
+
+    for (int i = 0; n_active && i < sampling->len; i++) {
+        struct task_sampling *task = array_element_at(sampling,
+                                                      struct task_sampling, i);
+
+        if (n_recorded > budget) {
+            uint64_t share = MAX(budget / n_active, 1);
+
+            while ((task->n_recorded >> 1) >= share &&
+                   task->period_log2 < UT_MAX_SAMPLING_PERIOD_LOG2) {
+                task->n_recorded >>= 1;
+                task->period_log2++;
+            }
+        } else if (n_recorded < budget / 2 && task->period_log2)
+            task->period_log2--;
+
+        task->n_recorded = 0;
+    }
+
+    state->sampling_window_start = now;
+    state->sampling_window_n_recorded = 0;
+}
+
+static volatile struct ut_shared_task_histogram *
+get_task_histogram(struct thread_state *state, uint16_t task_desc_idx)
+{
+    struct array *histograms = &state->task_histograms;
+    size_t record_size = (sizeof(struct ut_ancillary_record) +
+                          sizeof(struct ut_shared_task_histogram));
+    volatile struct ut_ancillary_record *header;
+    volatile struct ut_shared_task_histogram *histogram;
+    uint64_t start;
+
+    if (unlikely(task_desc_idx >= histograms->len)) {
+        int len = histograms->len;
+
+        array_set_len(histograms, MAX(task_desc_idx + 1, len * 2));
+        memset(histograms->bytes + len * histograms->elem_size, 0,
+               (histograms->len - len) * histograms->elem_size);
+    }
+
+    histogram = array_value_at(histograms,
+                               volatile struct ut_shared_task_histogram *,
+                               task_desc_idx);
+    if (likely(histogram))
+        return histogram;
+
+    /* Don't keep retrying to allocate a new buffer for every pop */
+    if (!state->shared_ancillary.current_buf.size ||
+        state->histogram_alloc_failed)
+        return NULL;
+
+    start = read_monotonic_clock();
+    header = ut_memfd_stack_memalign(&state->shared_ancillary,
+                                     record_size,
+                                     8); /* alignment */
+    account_allocation_overhead(state, start);
+    if (unlikely(!header)) {
+        state->ring.info->n_ancillary_alloc_failures++;
+        state->histogram_alloc_failed = true;
+        return NULL;
+    }
+
+    /* Note: new ancillary buffers are zero initialized */
+    histogram = (void *)(header + 1);
+    histogram->task_desc_idx = task_desc_idx;
+    histogram->min_ns = UINT64_MAX;
+
+    header->type = UT_ANCILLARY_TASK_HISTOGRAM;
+    header->padding = 0;
+    __atomic_store_n(&header->size, record_size, __ATOMIC_RELEASE);
+
+    *array_element_at(histograms, volatile struct ut_shared_task_histogram *,
+                      task_desc_idx) = histogram;
+
+    return histogram;
+}
+
+/* Note: the server only reads the histograms while the thread is stopped, so
+ * they don't need to be updated atomically
+ */
+static void
+update_task_histogram(struct thread_state *state,
+                      struct task_stack_entry *entry,
+                      uint64_t duration)
+{
+    volatile struct ut_shared_task_histogram *histogram =
+        get_task_histogram(state, entry->task_desc_idx);
+    uint64_t weight = 1ULL << entry->period_log2;
+
+    if (unlikely(!histogram))
+        return;
+
+    histogram->count += weight;
+    histogram->total_ns += duration * weight;
+    if (duration < histogram->min_ns)
+        histogram->min_ns = duration;
+    if (duration > histogram->max_ns)
+        histogram->max_ns = duration;
+    histogram->buckets[ut_histogram_bucket_index(duration)] += weight;
+}
+
+static inline bool
+is_category_enabled(struct thread_state *state, struct ut_task_desc *task_desc)
+{
+    uint64_t mask = state->ring.info->category_mask;
+
+    return mask & (1ULL << (task_desc->category & 63));
+}
+
+/* Whether to time this push/pop call, for 1 in overhead_sample_period calls
+ * unless that's 0
+ */
+static inline __attribute__((always_inline)) bool
+should_time_event(struct thread_state *state)
+{
+    return overhead_sample_period && --state->overhead_countdown == 0;
+}
+
+/* Called for 1 in overhead_sample_period push/pop calls, to estimate the
+ * total time spent in them
+ */
+static void
+account_event_overhead(struct thread_state *state,
+                       uint64_t start,
+                       uint64_t slow_path_ns)
+{
+    volatile struct ut_info_page *info = state->ring.info;
+    uint64_t elapsed = read_monotonic_clock() - start;
+
+    state->overhead_countdown = overhead_sample_period;
+
+    /* Registrations and allocations are accounted separately, and we
+     * mustn't scale them up by the sample period
+     */
+    elapsed -= MIN(state->slow_path_ns - slow_path_ns, elapsed);
+
+    info->n_timed_events++;
+    info->event_overhead_ns += elapsed * overhead_sample_period;
+}
+
+static inline __attribute__((always_inline)) void
+_push_task(struct thread_state *state, struct ut_task_desc *task_desc)
+{
+    struct ring *ring = get_task_ring(state, task_desc);
+    struct task_stack_entry entry = { 0 };
+
+    /* Note: we still track the push on our stack, even if the category is
+     * disabled, the task is sampled out or we have to drop the sample, so
+     * that it stays balanced with the corresponding pop
+     */
+    if (likely(is_category_enabled(state, task_desc))) {
+        entry.task_desc_idx = get_task_desc_index(state, task_desc);
+
+        if (likely(entry.task_desc_idx)) {
+            if (likely(!event_budget) ||
+                sample_task(state, entry.task_desc_idx, &entry.period_log2)) {
+                entry.start_time = _emit_task_sample(state, ring,
+                                                     UT_SAMPLE_TASK_PUSH,
+                                                     entry.task_desc_idx,
+                                                     entry.period_log2);
+                entry.emitted = true;
+
+                /* Note: we end the window early if we've already used up
+                 * its whole budget, so we react quickly to bursts
+                 */
+                if (event_budget &&
+                    (entry.start_time - state->sampling_window_start >
+                     UT_SAMPLING_WINDOW_NS ||
+                     state->sampling_window_n_recorded >
+                     event_budget * UT_SAMPLING_WINDOW_NS / 1000000000ULL))
+                    update_sampling_periods(state, entry.start_time);
+            }
+        } else {
+            ring->info->n_samples_dropped++;
+            entry.dropped = true;
+        }
+    }
+
+    array_append_val(&state->stack, struct task_stack_entry, entry);
+
+    if (unlikely(state->ring.n_samples_written >= state->next_checkpoint))
+        _emit_task_checkpoint(state);
+}
+
+void
+ut_push_task(struct ut_task_desc *task_desc)
+{
+    struct thread_state *state;
+
+    if (unlikely(in_libut))
+        return;
+    in_libut = true;
+
+    state = get_thread_state();
+
+    if (unlikely(should_time_event(state))) {
+        uint64_t slow_path_ns = state->slow_path_ns;
+        uint64_t start = read_monotonic_clock();
+
+        _push_task(state, task_desc);
+        account_event_overhead(state, start, slow_path_ns);
+    } else
+        _push_task(state, task_desc);
+
+    in_libut = false;
+}
+
+static inline __attribute__((always_inline)) void
+_pop_task(struct thread_state *state,
+          struct ut_task_desc *task_desc,
+          int n_args,
+          const int64_t *args)
+{
+    struct ring *ring = get_task_ring(state, task_desc);
+    volatile struct ut_info_page *info = state->ring.info;
+    struct task_stack_entry *top;
+    uint64_t timestamp;
+
+    /* e.g. if tracing was enabled between a push and pop. Nothing was lost
+     * since the push was never traced, so this isn't counted as dropped.
+     */
+    if (unlikely(state->stack.len == 0))
+        return;
+
+    top = array_element_at(&state->stack, struct task_stack_entry,
+                           state->stack.len - 1);
+
+    /* We only emit a pop if we emitted the push, regardless of whether the
+     * task's category has since been enabled or disabled
+     */
+    if (!top->emitted) {
+        if (top->dropped)
+            ring->info->n_samples_dropped++;
+        array_remove_fast(&state->stack, state->stack.len - 1);
+        return;
+    }
+
+    dbg_assert(top->task_desc_idx == task_desc->idx);
+
+    timestamp = _emit_task_sample(state, ring, UT_SAMPLE_TASK_POP,
+                                  top->task_desc_idx, top->period_log2);
+
+    /* Note: the server associates the args with the preceding pop */
+    if (n_args)
+        _emit_task_args(state, ring, top->task_desc_idx, n_args, args);
+
+    /* Only emit a backtrace at the end of a task, if it's duration
+     * was > info->backtrace_delta_threshold, as a way to minimize
+     * the associated overhead...
+     */
+    if (info->backtrace_n_frames) {
+        uint64_t delta = timestamp - top->start_time;
+
+        if (delta > info->backtrace_delta_threshold)
+            _emit_task_backtrace(state, ring);
+    }
+
+    if (histograms_enabled)
+        update_task_histogram(state, top, timestamp - top->start_time);
 
     array_remove_fast(&state->stack, state->stack.len - 1);
+
+    if (unlikely(state->ring.n_samples_written >= state->next_checkpoint))
+        _emit_task_checkpoint(state);
+}
+
+void
+ut_pop_task(struct ut_task_desc *task_desc)
+{
+    struct thread_state *state;
+
+    if (unlikely(in_libut))
+        return;
+    in_libut = true;
+
+    state = get_thread_state();
+
+    if (unlikely(should_time_event(state))) {
+        uint64_t slow_path_ns = state->slow_path_ns;
+        uint64_t start = read_monotonic_clock();
+
+        _pop_task(state, task_desc, 0, NULL);
+        account_event_overhead(state, start, slow_path_ns);
+    } else
+        _pop_task(state, task_desc, 0, NULL);
+
+    in_libut = false;
+}
+
+void
+ut_pop_task_args(struct ut_task_desc *task_desc,
+                 int n_args,
+                 const int64_t *args)
+{
+    struct thread_state *state;
+
+    if (unlikely(in_libut))
+        return;
+    in_libut = true;
+
+    state = get_thread_state();
+
+    if (unlikely(should_time_event(state))) {
+        uint64_t slow_path_ns = state->slow_path_ns;
+        uint64_t start = read_monotonic_clock();
+
+        _pop_task(state, task_desc, n_args, args);
+        account_event_overhead(state, start, slow_path_ns);
+    } else
+        _pop_task(state, task_desc, n_args, args);
+
+    in_libut = false;
+}
+
+static void
+set_fd_name(struct thread_state *state, int fd, const char *name)
+{
+    size_t len = name ? strnlen(name, UT_FD_NAME_MAX - 1) : 0;
+    size_t record_size = (sizeof(struct ut_ancillary_record) +
+                          sizeof(struct ut_shared_fd_name) + len + 8) & ~7;
+    volatile struct ut_ancillary_record *header;
+    volatile struct ut_shared_fd_name *fd_name;
+    uint64_t start;
+
+    if (!state->shared_ancillary.current_buf.size)
+        return;
+
+    start = read_monotonic_clock();
+    header = ut_memfd_stack_memalign(&state->shared_ancillary,
+                                     record_size,
+                                     8); /* alignment */
+    if (unlikely(!header)) {
+        account_registration_overhead(state, start);
+        state->ring.info->n_ancillary_alloc_failures++;
+        return;
+    }
+
+    /* Note: new ancillary buffers are zero initialized, so the name is
+     * already nul terminated
+     */
+    fd_name = (void *)(header + 1);
+    fd_name->fd = fd;
+    fd_name->timestamp = start;
+    if (len)
+        memcpy((char *)fd_name->name, name, len);
+
+    header->type = UT_ANCILLARY_FD_NAME;
+    header->padding = 0;
+    __atomic_store_n(&header->size, record_size, __ATOMIC_RELEASE);
+
+    account_registration_overhead(state, start);
+}
+
+void
+ut_set_fd_name(int fd, const char *name)
+{
+    if (unlikely(in_libut))
+        return;
+    in_libut = true;
+
+    set_fd_name(get_thread_state(), fd, name);
+
+    in_libut = false;
+}
+
+static inline bool
+are_locks_enabled(struct thread_state *state)
+{
+    return state->ring.info->category_mask & (1ULL << UT_CATEGORY_LOCKS);
+}
+
+static void
+lock_acquired(struct thread_state *state, void *lock, bool reacquired)
+{
+    struct array *held_locks = &state->held_locks;
+    struct held_lock held;
+
+    if (!are_locks_enabled(state))
+        return;
+
+    held.lock = lock;
+    held.acquire_time = read_monotonic_clock();
+    held.reacquired = reacquired;
+
+    /* Don't let a lock we never see released (e.g. that's released via
+     * some untraced api) grow the array indefinitely
+     */
+    if (unlikely(held_locks->len >= UT_MAX_HELD_LOCKS)) {
+        memmove(held_locks->data,
+                array_element_at(held_locks, struct held_lock, 1),
+                (held_locks->len - 1) * sizeof(held));
+        held_locks->len--;
+    }
+
+    array_append_val(held_locks, struct held_lock, held);
+}
+
+void
+ut_lock_acquired(void *lock)
+{
+    if (unlikely(in_libut))
+        return;
+    in_libut = true;
+
+    lock_acquired(get_thread_state(), lock, false);
+
+    in_libut = false;
+}
+
+void
+ut_lock_reacquired(void *lock)
+{
+    if (unlikely(in_libut))
+        return;
+    in_libut = true;
+
+    lock_acquired(get_thread_state(), lock, true);
+
+    in_libut = false;
 }
 
+static void
+lock_released(struct thread_state *state, void *lock, bool contended)
+{
+    struct array *held_locks = &state->held_locks;
+    struct ring *ring = &state->ring;
+    struct held_lock *held = NULL;
+    struct ut_sample sample;
+    uint64_t now;
+    int i;
+
+    /* Forget any holds we can no longer report */
+    if (!are_locks_enabled(state)) {
+        held_locks->len = 0;
+        return;
+    }
+
+    /* Locks are usually released in the reverse order they were acquired */
+    for (i = held_locks->len - 1; i >= 0; i--) {
+        held = array_element_at(held_locks, struct held_lock, i);
+        if (held->lock == lock)
+            break;
+    }
+
+    /* e.g. if the lock was acquired before tracing was enabled */
+    if (i < 0)
+        return;
+
+    now = read_monotonic_clock();
+
+    if (held->reacquired)
+        contended = false;
+
+    if (contended || now - held->acquire_time >= lock_hold_threshold) {
+        _reserve_sample(ring);
+
+        memset(&sample, 0, sizeof(sample));
+        sample.type = UT_SAMPLE_LOCK_HOLD;
+        sample.lock_hold.contended = contended;
+        sample.lock_hold.lock = (uintptr_t)lock;
+        sample.lock_hold.acquire_timestamp = held->acquire_time;
+        sample.lock_hold.timestamp = now;
+
+        _write_sample(ring, &sample, offsetof(struct ut_sample, lock_hold) +
+                                     sizeof(sample.lock_hold));
+        _commit_sample(ring);
+    }
+
+    /* Note: this preserves the order of any locks still held */
+    memmove(held, held + 1, (held_locks->len - i - 1) * sizeof(*held));
+    held_locks->len--;
+}
+
+bool
+ut_category_enabled(enum ut_task_category category)
+{
+    bool enabled;
+
+    if (unlikely(in_libut))
+        return false;
+    in_libut = true;
+
+    enabled = get_thread_state()->ring.info->category_mask &
+              (1ULL << (category & 63));
+
+    in_libut = false;
+
+    return enabled;
+}
+
+void
+ut_lock_released(void *lock, bool contended)
+{
+    if (unlikely(in_libut))
+        return;
+    in_libut = true;
+
+    lock_released(get_thread_state(), lock, contended);
+
+    in_libut = false;
+}
@@ -1,10 +1,62 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+
+enum ut_task_priority {
+    UT_PRIORITY_NORMAL = 0,
+
+    /* For low-rate but important tasks (such as frames or requests) which
+     * are recorded in a separate ring so they aren't overwritten by a flood
+     * of normal priority tasks
+     */
+    UT_PRIORITY_HIGH,
+};
+
+/* Categories of tasks which can be enabled/disabled at runtime (see
+ * ut-server --categories) without restarting the traced process
+ */
+enum ut_task_category {
+    UT_CATEGORY_APP = 0,
+    UT_CATEGORY_IO,
+    UT_CATEGORY_LOCKS,
+    UT_CATEGORY_GL,
+    UT_CATEGORY_MEMORY,
+    UT_CATEGORY_WAIT, /* e.g. sleeping or polling */
+
+    UT_N_CATEGORIES
+};
+
+/* Why a task may block, for tasks that wrap blocking calls, so that ut-server
+ * can break down the time each thread spends blocked (off-CPU) by reason
+ */
+enum ut_wait_reason {
+    UT_WAIT_NONE = 0,
+    UT_WAIT_LOCK, /* locks and other synchronization, e.g. joining threads */
+    UT_WAIT_IO,
+    UT_WAIT_NETWORK,
+    UT_WAIT_SLEEP, /* including yielding */
+    UT_WAIT_POLL, /* waiting for events */
+
+    UT_N_WAIT_REASONS
+};
+
+/* The maximum number of values that can be recorded for a task instance
+ * via ut_pop_task_args()
+ */
+#define UT_MAX_TASK_ARGS 8
 
 struct ut_task_desc {
     const char *name;
     const char *desc;
+    uint8_t priority; /* enum ut_task_priority */
+    uint8_t category; /* enum ut_task_category */
+    uint8_t wait_reason; /* enum ut_wait_reason */
+
+    /* Optional, comma separated names for the values recorded via
+     * ut_pop_task_args(), e.g. "fd,size,bytes"
+     */
+    const char *args;
 
     /* private */
     uint16_t idx;
@@ -15,3 +67,143 @@ ut_push_task(struct ut_task_desc *task_desc);
 
 void
 ut_pop_task(struct ut_task_desc *task_desc);
+
+/* Like ut_pop_task() but also records up to UT_MAX_TASK_ARGS values for the
+ * task instance (such as a file descriptor and the number of bytes read),
+ * named by task_desc->args
+ */
+void
+ut_pop_task_args(struct ut_task_desc *task_desc,
+                 int n_args,
+                 const int64_t *args);
+
+/* Associates a name with a file descriptor, such as the path of a file or
+ * the address of a socket's peer, so that ut-server can attribute the I/O
+ * recorded for the fd (see ut_pop_task_args()). The name applies until the
+ * fd is named again, or cleared with a NULL name, which should be done before
+ * the fd is closed so a reused fd doesn't inherit the name.
+ */
+void
+ut_set_fd_name(int fd, const char *name);
+
+/* For profiling lock contention, called after a lock is acquired and before
+ * it's released. Whether anyone was waiting for the lock should be passed
+ * as contended, if known, so that ut-server can find what held a lock while
+ * other threads were waiting for it (see UT_LOCK_HOLD_THRESHOLD_NS).
+ */
+void
+ut_lock_acquired(void *lock);
+
+/* Like ut_lock_acquired() but for a lock that's reacquired after waiting on
+ * a condition variable, for which the contended argument of
+ * ut_lock_released() is ignored, since whether anyone is waiting for such a
+ * lock usually can't be told (e.g. glibc always marks a mutex as contended
+ * after a condition variable wait). Such holds are only recorded if they
+ * exceed UT_LOCK_HOLD_THRESHOLD_NS.
+ */
+void
+ut_lock_reacquired(void *lock);
+
+void
+ut_lock_released(void *lock, bool contended);
+
+/* Whether tasks of the given category are currently recorded for the
+ * calling thread, so that work only needed for tracing them can be skipped
+ */
+bool
+ut_category_enabled(enum ut_task_category category);
+
+/* Tracepoint levels, where higher levels are more detailed */
+#define UT_LEVEL_ESSENTIAL  1
+#define UT_LEVEL_NORMAL     2
+#define UT_LEVEL_VERBOSE    3
+
+/* Tracepoints with a level above UT_TRACE_LEVEL are compiled out entirely,
+ * and 0 compiles out all tracepoints
+ */
+#ifndef UT_TRACE_LEVEL
+#define UT_TRACE_LEVEL UT_LEVEL_NORMAL
+#endif
+
+/* The UT_PUSH_TASK()/UT_POP_TASK() tracepoints are disabled until libut
+ * finds there's something to collect the data (i.e. a server is running,
+ * or flight-recorder or crash dump mode is enabled).
+ *
+ * On x86-64 each tracepoint is a 5 byte nop when disabled, which libut
+ * patches into a jump when enabling tracing. The nop is 8 byte aligned so
+ * that it can be patched with a single atomic store. The locations are
+ * recorded in a __ut_jump_table section, which a constructor registers with
+ * libut for each module.
+ */
+struct ut_jump_entry {
+    uint64_t code;
+    uint64_t target;
+};
+
+/* Note: weak, so that including ut.h doesn't require linking with libut */
+void
+ut_register_jump_table(struct ut_jump_entry *start, struct ut_jump_entry *end)
+    __attribute__((weak));
+
+extern int ut_tracing_enabled_flag;
+
+#if defined(__x86_64__) && !defined(UT_DISABLE_STATIC_KEYS)
+
+extern struct ut_jump_entry __start___ut_jump_table[]
+    __attribute__((weak, visibility("hidden")));
+extern struct ut_jump_entry __stop___ut_jump_table[]
+    __attribute__((weak, visibility("hidden")));
+
+static void __attribute__((constructor, unused))
+_ut_register_module_jump_table(void)
+{
+    if (__start___ut_jump_table && ut_register_jump_table)
+        ut_register_jump_table(__start___ut_jump_table, __stop___ut_jump_table);
+}
+
+static inline __attribute__((always_inline)) bool
+ut_tracing_enabled(void)
+{
+    __asm__ goto(".balign 8\n\t"
+                 "1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t" /* nopl 0(%%rax,%%rax) */
+                 ".pushsection __ut_jump_table, \"aw\"\n\t"
+                 ".balign 8\n\t"
+                 ".quad 1b, %l[enabled]\n\t"
+                 ".popsection\n\t"
+                 : : : : enabled);
+    return false;
+enabled:
+    return true;
+}
+
+#else
+
+static inline bool
+ut_tracing_enabled(void)
+{
+    return __builtin_expect(ut_tracing_enabled_flag, 0);
+}
+
+#endif
+
+#define UT_PUSH_TASK(LEVEL, TASK_DESC) do { \
+    if ((LEVEL) <= UT_TRACE_LEVEL && ut_tracing_enabled()) \
+        ut_push_task(TASK_DESC); \
+} while (0)
+
+#define UT_POP_TASK(LEVEL, TASK_DESC) do { \
+    if ((LEVEL) <= UT_TRACE_LEVEL && ut_tracing_enabled()) \
+        ut_pop_task(TASK_DESC); \
+} while (0)
+
+/* Note: the arguments are only evaluated if the tracepoint is enabled, e.g.
+ * UT_POP_TASK_ARGS(UT_LEVEL_NORMAL, &task_desc, fd, size, bytes)
+ */
+#define UT_POP_TASK_ARGS(LEVEL, TASK_DESC, ...) do { \
+    if ((LEVEL) <= UT_TRACE_LEVEL && ut_tracing_enabled()) { \
+        const int64_t _ut_args[] = { __VA_ARGS__ }; \
+        ut_pop_task_args(TASK_DESC, \
+                         sizeof(_ut_args) / sizeof(_ut_args[0]), \
+                         _ut_args); \
+    } \
+} while (0)
@@ -123,10 +123,78 @@ function get_thread_tasks(thread)
     return tasks;
 }
 
+/* Once the circular buffer has wrapped we may have lost the push samples for
+ * tasks that were already running at the time of the oldest sample we have.
+ *
+ * libut periodically records a checkpoint of the complete task stack, so we
+ * find the first checkpoint and then walk backwards over the preceding
+ * samples to determine which tasks were open at the start, along with their
+ * start times.
+ *
+ * Returns an array of implicit push samples indexed by stack depth, with
+ * null for depths where the initial state is unknown.
+ */
+function reconstruct_initial_stack(samples)
+{
+    var checkpoint_idx = -1;
+    var stack = [];
+
+    for (var i = 0; i < samples.length; i++) {
+        if (samples[i].type === 4) {
+            checkpoint_idx = i;
+            break;
+        }
+    }
+    if (checkpoint_idx < 0)
+        return stack;
+
+    var checkpoint = samples[checkpoint_idx];
+    for (var i = 0; i < checkpoint.stack.length; i++) {
+        var entry = checkpoint.stack[i];
+
+        /* task 0 is a task that wasn't traced, e.g. due to its category */
+        if (entry.task === 0) {
+            stack.push(null);
+            continue;
+        }
+
+        stack.push({
+            type: 1,
+            /* tasks that started before our epoch are clamped */
+            timestamp: entry.start === null ? 0 : Math.max(entry.start, 0),
+            cpu: 0,
+            stack_depth: i,
+            task: entry.task,
+        });
+    }
+
+    for (var i = checkpoint_idx - 1; i >= 0; i--) {
+        var sample = samples[i];
+
+        switch (sample.type) {
+            case 1: // task push
+                /* this task, and anything above it, wasn't open before here */
+                stack.length = Math.min(stack.length, sample.stack_depth);
+                break;
+            case 2: // task pop
+                /* a task that was open before here, but we don't know when it
+                 * started...
+                 */
+                for (var j = stack.length; j < sample.stack_depth; j++)
+                    stack.push(null);
+                stack.length = sample.stack_depth;
+                stack[sample.stack_depth - 1] = null;
+                break;
+        }
+    }
+
+    return stack;
+}
+
 function process_task_samples(thread, task_descriptions)
 {
     var samples = thread.samples;
-    var stack = [];
+    var stack = reconstruct_initial_stack(samples);
     var task_samples = [];
 
     for (var i = 0; i < samples.length; i++) {
@@ -149,25 +217,29 @@ function process_task_samples(thread, task_descriptions)
                 stack.push(sample);
                 break;
             case 2: // task pop
-                if (stack.length <= sample.stack_depth) {
-                    for (var j = stack.length; j <= sample.stack_depth; j++)
-                        stack.push(null);
-                }
+                /* NB: the stack depth of a pop sample includes the task being
+                 * popped
+                 */
+                var idx = sample.stack_depth - 1;
+
+                for (var j = stack.length; j <= idx; j++)
+                    stack.push(null);
 
-                if (stack[sample.stack_depth] == null) {
+                if (stack[idx] == null) {
                     //XXX: assume task started from time = 0
                     var implicit_sample = JSON.parse(JSON.stringify(sample));
                     implicit_sample.type = 1;
                     implicit_sample.timestamp = 0;
 
-                    stack[sample.stack_depth] = implicit_sample;
+                    stack[idx] = implicit_sample;
                 }
 
-                if (stack[sample.stack_depth].task !== sample.task) {
+                if (stack[idx].task !== sample.task) {
                     console.error("unballanced task stack pop\n");
                     continue;
                 }
 
+                stack.length = idx + 1;
                 var start_sample = stack.pop();
 
                 var task_sample = {
@@ -176,7 +248,7 @@ function process_task_samples(thread, task_descriptions)
                     start_time: start_sample.timestamp,
                     end_time: sample.timestamp,
                     task: task_descriptions[sample.task],
-                    stack_depth: stack.length - 1,
+                    stack_depth: stack.length,
                 };
 
                 if (!task_sample.task)